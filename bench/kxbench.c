@@ -0,0 +1,396 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Rendering and device probing benchmark. Drawing goes to in-memory
+ *  framebuffer (FBDEV=mem:...), so numbers show CPU side only.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "util.h"
+#include "cfgparser.h"
+#include "devicescan.h"
+#include "evdevs.h"
+#include "menu.h"
+
+#ifdef USE_FBMENU
+#include "fb.h"
+#include "gui.h"
+
+/* Font of theme. Theme header itself defines it */
+extern const Font ter_u16n_ascii_font;
+#define BENCH_FONT		(&ter_u16n_ascii_font)
+#define BENCH_TEXT		0xFFFFFF00
+#define BENCH_BG		0x33669900
+#endif
+
+/* devicescan.c wants these from kexecboot.c */
+#ifdef USE_MACHINE_KERNEL
+char *machine_kernel = NULL;
+#endif
+char *default_kernels[] = { NULL };
+
+#define BENCH_ITEMS		20		/* Boot items in menu */
+#define BENCH_LOG_LINES	300		/* Lines in log view */
+#define BENCH_DEVICES	32		/* Devices probed per scan */
+
+static int runs = 300;		/* Every value is best of that many runs */
+
+/* Keep best (smallest) time of run started at 't' */
+#define BEST(best, t)	do { \
+		unsigned long long d = get_time_us() - (t); \
+		if (d < (best)) (best) = d; \
+	} while (0)
+
+/* Megapixels per second of 'pixels' drawn in 'us' microseconds */
+#define MPIX(pixels, us)	((us) ? (double)(pixels) / (us) : 0.0)
+
+
+#if defined(USE_FBMENU) && defined(USE_FB_MEMORY)
+/* Menu similar to real one: system item and boot items with icons */
+static kx_menu *bench_menu(struct gui_t *gui)
+{
+	kx_menu *menu;
+	kx_menu_item *mi;
+	char label[64], desc[64];
+	int i;
+
+	menu = menu_create(4);
+	menu->top = menu_level_create(menu, BENCH_ITEMS + 2, NULL);
+	menu->current = menu->top;
+
+	mi = menu_item_add(menu->top, A_SUBMENU, "System menu", NULL, NULL);
+#ifdef USE_ICONS
+	menu_item_set_data(mi, gui->icons[ICON_SYSTEM]);
+#endif
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		snprintf(label, sizeof(label), "Boot item %d /dev/mmcblk0p%d", i, i);
+		snprintf(desc, sizeof(desc), "ext4 %d MB Linux 6.%d", 100 + i, i);
+		mi = menu_item_add(menu->top, A_DEVICES + i, label, desc, NULL);
+#ifdef USE_ICONS
+		menu_item_set_data(mi, gui->icons[ICON_STORAGE + i % 3]);
+#endif
+	}
+
+	return menu;
+}
+
+/* Square picture with every pixel half transparent */
+static kx_picture *bench_picture(int size)
+{
+	kx_picture *pic;
+	int i;
+
+	pic = calloc(1, sizeof(*pic));
+	if (NULL == pic) return NULL;
+	pic->width = pic->height = size;
+	pic->pixels = malloc(size * size * sizeof(kx_rgba));
+	if (NULL == pic->pixels) {
+		free(pic);
+		return NULL;
+	}
+	for (i = 0; i < size * size; i++)
+		pic->pixels[i] = comp2rgba(i & 0xFF, (i >> 8) & 0xFF, 0x80, 0x80);
+
+	return pic;
+}
+
+/* Time rendering of one screen configuration. FBDEV is already set */
+static int bench_render(const char *name)
+{
+	struct gui_t *gui;
+	kx_menu *menu;
+	kx_surface *s;
+	kx_picture *pic;
+	unsigned long long t, full = ~0ULL, step = ~0ULL, scroll = ~0ULL,
+			text = ~0ULL, text_scroll = ~0ULL, logo = ~0ULL,
+			text20 = ~0ULL, opaque = ~0ULL, blend = ~0ULL, blend_pic = ~0ULL;
+	int i, j, pixels;
+
+	gui = gui_init(0, NULL, 0);
+	if (NULL == gui) return -1;
+	s = gui->screen;
+	pixels = s->width * s->height;
+
+	menu = bench_menu(gui);
+	for (i = 0; i < BENCH_LOG_LINES; i++)
+		log_msg(lg, "Log line %d: probing /dev/sda%d ext4 superblock ok", i, i);
+
+	/* Whole frames as user sees them */
+	for (i = 0; i < runs; i++) {
+		gui->shown_level = NULL;
+		t = get_time_us();
+		gui_show_menu(gui, menu);
+		BEST(full, t);
+
+		menu_item_select(menu, (i / 8) & 1 ? -1 : 1);
+		t = get_time_us();
+		gui_show_menu(gui, menu);
+		BEST(step, t);
+
+		lg->current_line_no = 0;
+		t = get_time_us();
+		gui_show_text(gui, lg);
+		BEST(text, t);
+
+		/* Log scrolled by one line */
+		lg->current_line_no = 1;
+		t = get_time_us();
+		gui_show_text(gui, lg);
+		BEST(text_scroll, t);
+	}
+
+	/* Last visible item to previous one scrolls menu by one slot */
+	for (i = 0; i < runs; i++) {
+		menu_item_select_by_no(menu, 0);
+		gui->shown_level = NULL;
+		gui_show_menu(gui, menu);
+		for (j = 0; j < BENCH_ITEMS; j++)
+			menu_item_select(menu, 1);
+		gui_show_menu(gui, menu);
+		for (j = 0; j < 3; j++) {
+			menu_item_select(menu, -1);
+			gui_show_menu(gui, menu);
+		}
+		menu_item_select(menu, -1);
+		t = get_time_us();
+		gui_show_menu(gui, menu);
+		BEST(scroll, t);
+	}
+
+	/* Primitives into backbuffer without presenting */
+	pic = bench_picture(128);
+	for (i = 0; i < runs; i++) {
+#ifdef USE_ICONS
+		t = get_time_us();
+		for (j = 0; j < 20; j++)
+			fb_draw_picture(s, 0, j * 32, gui->icons[ICON_LOGO]);
+		BEST(logo, t);
+#endif
+
+		t = get_time_us();
+		for (j = 0; j < 20; j++)
+			fb_draw_text(s, 0, j * 16, BENCH_TEXT, BENCH_FONT,
+					"Log line: probing /dev/sda1 ext4 superblock ok");
+		BEST(text20, t);
+
+		t = get_time_us();
+		fb_draw_rect(s, 0, 0, s->width, s->height, BENCH_BG);
+		BEST(opaque, t);
+
+		t = get_time_us();
+		fb_draw_rect(s, 0, 0, s->width, s->height, BENCH_BG | 0x80);
+		BEST(blend, t);
+
+		t = get_time_us();
+		fb_draw_picture(s, 0, 0, pic);
+		BEST(blend_pic, t);
+	}
+	fb_destroy_picture(pic);
+
+	printf("%-22s %6llu %6llu %6llu %6llu %6llu %6llu %6llu %8.0f %8.0f %8.0f\n",
+			name, full, step, scroll, text, text_scroll, logo, text20,
+			MPIX(pixels, opaque), MPIX(pixels, blend),
+			MPIX(128 * 128, blend_pic));
+
+	menu_destroy(menu, 0);
+	gui_destroy(gui);
+	return 0;
+}
+
+#ifdef USE_FB_THREADS
+/* Time full frames drawn by bands. FBDEV and FBTHREADS are already set */
+static int bench_threads(const char *name)
+{
+	struct gui_t *gui;
+	kx_menu *menu;
+	unsigned long long t, full = ~0ULL, text = ~0ULL;
+	int i;
+
+	gui = gui_init(0, NULL, 0);
+	if (NULL == gui) return -1;
+
+	menu = bench_menu(gui);
+	for (i = 0; i < BENCH_LOG_LINES; i++)
+		log_msg(lg, "Log line %d: probing /dev/sda%d ext4 superblock ok", i, i);
+
+	for (i = 0; i < runs; i++) {
+		gui->shown_level = NULL;
+		t = get_time_us();
+		gui_show_menu(gui, menu);
+		BEST(full, t);
+
+		lg->current_line_no = 0;
+		t = get_time_us();
+		gui_show_text(gui, lg);
+		BEST(text, t);
+	}
+
+	printf("%-30s %8llu %8llu\n", name, full, text);
+
+	menu_destroy(menu, 0);
+	gui_destroy(gui);
+	return 0;
+}
+#endif
+#endif	/* USE_FBMENU && USE_FB_MEMORY */
+
+
+/* Run benchmark in child process, because framebuffer state is global */
+static void bench_fork(int (*func)(const char *), const char *name,
+		const char *fbdev, const char *threads)
+{
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if (0 == pid) {
+		if (fbdev) setenv("FBDEV", fbdev, 1);
+		if (threads) setenv("FBTHREADS", threads, 1);
+		/* Keep framebuffer messages off the table */
+		freopen("/dev/null", "w", stderr);
+		lg = log_open(16);
+		status = func(name);
+		fflush(stdout);
+		_exit(status ? 1 : 0);
+	}
+
+	if ( (pid < 0) || (pid != waitpid(pid, &status, 0))
+			|| !WIFEXITED(status) || (0 != WEXITSTATUS(status)) )
+		printf("%-22s failed\n", name);
+}
+
+
+/* Probe page-cached files with ext2 superblock as boot devices */
+static int bench_devices(const char *name)
+{
+	char dir[] = "/tmp/kxbench.XXXXXX";
+	char path[64], cfgpath[64];
+	char buf[2048];
+	struct cfgdata_t cfgdata;
+	struct bootconf_t *bc;
+	unsigned long long t, best = ~0ULL;
+	FILE *cfg;
+	int i, fd;
+
+	if (NULL == mkdtemp(dir)) return -1;
+	snprintf(cfgpath, sizeof(cfgpath), "%s/boot.cfg", dir);
+	cfg = fopen(cfgpath, "w");
+	if (NULL == cfg) return -1;
+
+	/* Superblock magic at 1080 */
+	memset(buf, 0, sizeof(buf));
+	buf[1080] = 0x53;
+	buf[1081] = 0xEF;
+	for (i = 0; i < BENCH_DEVICES; i++) {
+		snprintf(path, sizeof(path), "%s/dev%d", dir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) break;
+		if ( (sizeof(buf) != write(fd, buf, sizeof(buf)))
+				|| (-1 == ftruncate(fd, 65536)) )
+		{
+			close(fd);
+			break;
+		}
+		close(fd);
+		fprintf(cfg, "LABEL=dev%d\nDEVICE=%s\nKERNEL=/boot/zImage\n\n", i, path);
+	}
+	fclose(cfg);
+
+	for (i = 0; i < runs / 10 + 1; i++) {
+		init_cfgdata(&cfgdata);
+		parse_cfgfile(cfgpath, &cfgdata);
+		bc = create_bootcfg(4);
+
+		t = get_time_us();
+		addto_bootcfg(bc, &cfgdata);
+		BEST(best, t);
+
+		free_bootcfg(bc);
+		destroy_cfgdata(&cfgdata);
+		lg->current_line_no = 0;
+	}
+
+	printf("%s: %d devices in %llu us, %.0f devices/s\n", name,
+			BENCH_DEVICES, best, best ? BENCH_DEVICES * 1e6 / best : 0.0);
+
+	for (i = 0; i < BENCH_DEVICES; i++) {
+		snprintf(path, sizeof(path), "%s/dev%d", dir, i);
+		unlink(path);
+	}
+	unlink(cfgpath);
+	rmdir(dir);
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) runs = atoi(argv[1]);
+	if (runs < 1) runs = 1;
+
+	printf("kexecboot benchmark, best of %d runs\n\n", runs);
+
+#if defined(USE_FBMENU) && defined(USE_FB_MEMORY)
+	static const int bpps[] = { 32, 24, 18, 16, 8 };
+	static const int angles[] = { 0, 90, 180, 270 };
+	char fbdev[64], name[64];
+	unsigned int b, a;
+
+	printf("480x800 memory framebuffer. Frames (us): full menu, menu step,\n"
+			"scroll, log view, log scrolled by line. Backbuffer only (us): 20\n"
+			"logo pictures, 20 text lines. Mpix/s: opaque fill, blended fill,\n"
+			"blended picture\n\n");
+	printf("%-22s %6s %6s %6s %6s %6s %6s %6s %8s %8s %8s\n", "bpp/angle",
+			"full", "step", "scroll", "log", "logscr", "logo", "text",
+			"fill", "blend", "blendpic");
+	for (b = 0; b < ROWS(bpps); b++) {
+		for (a = 0; a < ROWS(angles); a++) {
+			snprintf(fbdev, sizeof(fbdev), "mem:480x800x%d:%d",
+					bpps[b], angles[a]);
+			snprintf(name, sizeof(name), "%dbpp %d", bpps[b], angles[a]);
+			bench_fork(bench_render, name, fbdev, NULL);
+		}
+	}
+
+#ifdef USE_FB_THREADS
+	char threads[4];
+	unsigned int n;
+
+	printf("\n1920x1080 memory framebuffer by threads (us): full menu, log view\n");
+	for (b = 0; b < 2; b++) {
+		for (n = 1; n <= 4; n <<= 1) {
+			snprintf(fbdev, sizeof(fbdev), "mem:1920x1080x%d", b ? 16 : 32);
+			snprintf(threads, sizeof(threads), "%u", n);
+			snprintf(name, sizeof(name), "%dbpp %u thread(s)", b ? 16 : 32, n);
+			bench_fork(bench_threads, name, fbdev, threads);
+		}
+	}
+#endif
+	printf("\n");
+#else
+	printf("Rendering is not measured: build with --enable-fb-memory\n\n");
+#endif
+
+	bench_fork(bench_devices, "Device probing", NULL, NULL);
+	return 0;
+}
@@ -28,6 +28,8 @@
 #define MMCBLK_BOOTCONF_FSTYPE	"vfat"
 #define BOOTCONF_PATH			MOUNTPOINT "/multiboot"
 #define BOOTCFG_PATH 			MOUNTPOINT "/boot/boot.cfg"
+#define SPLASH_MOUNTPOINT		"/splash"	/* Preloading may hold MOUNTPOINT */
+#define SPLASH_PATH				SPLASH_MOUNTPOINT "/kexecboot-splash.raw"
 
 /* define BOOT TYPE */
 #define BOOT_TYPE_LINUX		0x1
@@ -0,0 +1,180 @@
+/* config.h.  Generated from config.h.in by configure.  */
+/* config.h.in.  Generated from configure.ac by autoheader.  */
+
+/* Define to 1 if you have the <inttypes.h> header file. */
+#define HAVE_INTTYPES_H 1
+
+/* Define to 1 if you have the <stdint.h> header file. */
+#define HAVE_STDINT_H 1
+
+/* Define to 1 if you have the <stdio.h> header file. */
+#define HAVE_STDIO_H 1
+
+/* Define to 1 if you have the <stdlib.h> header file. */
+#define HAVE_STDLIB_H 1
+
+/* Define to 1 if you have the <strings.h> header file. */
+#define HAVE_STRINGS_H 1
+
+/* Define to 1 if you have the <string.h> header file. */
+#define HAVE_STRING_H 1
+
+/* Define to 1 if you have the <sys/stat.h> header file. */
+#define HAVE_SYS_STAT_H 1
+
+/* Define to 1 if you have the <sys/types.h> header file. */
+#define HAVE_SYS_TYPES_H 1
+
+/* Define to 1 if you have the <unistd.h> header file. */
+#define HAVE_UNISTD_H 1
+
+/* Where to look for kexec binary */
+#define KEXEC_PATH "/usr/sbin/kexec"
+
+/* Name of package */
+#define PACKAGE "kexecboot"
+
+/* Define to the address where bug reports for this package should be sent. */
+#define PACKAGE_BUGREPORT "kexecboot-devel@linuxtogo.org"
+
+/* Define to the full name of this package. */
+#define PACKAGE_NAME "kexecboot"
+
+/* Define to the full name and version of this package. */
+#define PACKAGE_STRING "kexecboot 0.5.9"
+
+/* Define to the one symbol short name of this package. */
+#define PACKAGE_TARNAME "kexecboot"
+
+/* Define to the home page for this package. */
+#define PACKAGE_URL ""
+
+/* Define to the version of this package. */
+#define PACKAGE_VERSION "0.5.9"
+
+/* Define to 1 if all of the C90 standard headers exist (not just the ones
+   required in a freestanding environment). This macro is provided for
+   backward compatibility; new code need not use it. */
+#define STDC_HEADERS 1
+
+/* Where to look for ubiattach binary */
+#define UBIATTACH_PATH "/usr/sbin/ubiattach"
+
+/* UBI VID header offset */
+/* #undef UBI_VID_HDR_OFFSET */
+
+/* Define if you want to support this bpp mode */
+#define USE_16BPP 1
+
+/* Define if you want to support this bpp mode */
+#define USE_18BPP 1
+
+/* Define if you want to support this bpp mode */
+#define USE_24BPP 1
+
+/* Define if you want to support this bpp mode */
+#define USE_32BPP 1
+
+/* Define if you want to support this bpp mode */
+#define USE_8BPP 1
+
+/* Define duration in milliseconds of animated menu scrolling */
+/* #undef USE_ANIMATION */
+
+/* Define if you want to use special buffer to hold pre-drawed background */
+/* #undef USE_BG_BUFFER */
+
+/* Define if you want to parse cfgfiles */
+#define USE_CFGFILES 1
+
+/* Define maximum time in seconds to wait for devices before scanning */
+#define USE_DELAY 1
+
+/* Define to enable devices re-creating */
+#define USE_DEVICES_RECREATING 1
+
+/* Define if you wish to mount devtmpfs at startup in init-mode */
+#define USE_DEVTMPFS 1
+
+/* Define evdev (keyboard/mouse) repeat rate to use in milliseconds
+   (first_delay, repeat_delay) */
+/* #undef USE_EVDEV_RATE */
+
+/* Define if you use the framebuffer user interface */
+#define USE_FBMENU 1
+
+/* Define if you want to limit FB UI height to specified value */
+/* #undef USE_FBUI_HEIGHT */
+
+/* Define if you want to limit FB UI width to specified value */
+/* #undef USE_FBUI_WIDTH */
+
+/* Define if you want to use DRM/KMS dumb buffers when there is no fbdev */
+/* #undef USE_FB_DRM */
+
+/* Define if you want to use in-memory framebuffer for testing */
+#define USE_FB_MEMORY 1
+
+/* Define maximum count of framebuffers mirroring main one */
+#define USE_FB_MIRROR 1
+
+/* Define if you want to flip FB pages by panning instead of copying
+   backbuffer */
+#define USE_FB_PAN 1
+
+/* Define if you want to rotate 90/270 degrees screens while presenting them
+   */
+#define USE_FB_ROTATE 1
+
+/* Define screen size in pixels to render it by several threads on multi-core
+   systems */
+#define USE_FB_THREADS 1000000
+
+/* How to change data length for RAM-to-FB transfers */
+#define USE_FB_TRANS_LENGTH(x) (x >> 2)
+
+/* Data type for RAM-to-FB transfers */
+#define USE_FB_TRANS_TYPE uint32_t
+
+/* Define if you wish to debug kexecboot right on host system */
+#define USE_HOST_DEBUG 1
+
+/* Define if you want to parse and use custom icons */
+#define USE_ICONS 1
+
+/* Define if you wish to load kernel with kexec_file_load syscall instead of
+   kexec binary */
+#define USE_KEXEC_FILE_LOAD 1
+
+/* Define if you wish to preload kernel in background while menu is shown */
+#define USE_KEXEC_PRELOAD 1
+
+/* Define if you wish to enable looking for machine-specific zImage kernel */
+/* #undef USE_MACHINE_KERNEL */
+
+/* Define if you wish to allow to choose menu items by 0-9 keys */
+#define USE_NUMKEYS 1
+
+/* Define if you wish to probe devices in parallel threads */
+#define USE_PARALLEL_SCAN 1
+
+/* Define if you want to show saved menu while devices are scanned */
+#define USE_SPLASH 1
+
+/* Define if you wish to enable text-mode UI support */
+/* #undef USE_TEXTUI */
+
+/* Define timeout in seconds to automatic boot 1st kernel after this time */
+/* #undef USE_TIMEOUT */
+
+/* Define if you wish to compile uImage kernel support */
+/* #undef USE_UIMAGE */
+
+/* Define if you wish to compile Sharp Zaurus specific code */
+/* #undef USE_ZAURUS */
+
+/* Define if you wish to compile zImage kernel support */
+#define USE_ZIMAGE 1
+
+/* Version number of package */
+#define VERSION "0.5.9"
@@ -24,39 +24,26 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
 
 #include "fstype/fstype.h"
 #include "util.h"
 #include "devicescan.h"
 #include "config.h"
 
+#ifdef USE_PARALLEL_SCAN
+#include <pthread.h>
+#endif
 
-/* Create charlist of known filesystems */
-struct charlist *scan_filesystems()
-{
-	char *split;
-	struct charlist *fl;
-	char line[80];
-
-	fl = create_charlist(8);
-	// make a list of all known filesystems
-	FILE *f = fopen("/proc/filesystems", "r");
-
-	if (NULL == f) {
-		log_msg(lg, "+ can't open /proc/filesystems: %s", ERRMSG);
-		free_charlist(fl);
-		return NULL;
-	}
-
-	while (fgets(line, sizeof(line), f)) {
-		line[strlen(line) - 1] = '\0';	/* kill last '\n' */
-		split = strchr(line, '\t');
-		split++;
-		addto_charlist(fl, split);	/* NOTE: strdup() may return NULL */
-	}
-	fclose(f);
-	return fl;
-}
+#ifdef USE_IO_URING_SCAN
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 
 /* Allocate bootconf structure */
@@ -99,31 +86,420 @@ static struct dtypes_t dtypes[] = {
 	{ DVT_UNKNOWN, 0, NULL }
 };
 
+/* Probing result of one distinct device */
+struct devprobe_t {
+	char *device;		/* Device path */
+	const char *fstype;	/* Detected FS type (NULL - unknown) */
+	int rc;			/* identify_fs() return value */
+	int err;		/* errno of failed open() (0 - opened) */
+};
+
+/* Devices to probe during one scan */
+struct devprobe_list_t {
+	struct devprobe_t *list;
+	unsigned int count;
+	unsigned int next;	/* Next device to be taken by worker */
+#ifdef USE_PARALLEL_SCAN
+	pthread_mutex_t lock;
+#endif
+};
+
+/* Maximum count of threads probing devices simultaneously */
+#define DEVSCAN_THREADS	4
+
+/* Open device and identify FS type on it. Does not log anything
+ * because it may be called from several threads at once */
+static void probe_device(struct devprobe_t *p)
+{
+	int fd;
+
+	p->fstype = NULL;
+	p->err = 0;
+
+	fd = open(p->device, O_RDONLY);
+	if (fd < 0) {
+		p->err = errno;
+		p->rc = -1;
+		return;
+	}
+
+	p->rc = identify_fs(fd, &p->fstype, NULL, 0);
+	close(fd);
+}
+
+/* Report probing result and check that kernel supports found FS.
+ * Return FS type or NULL */
+static const char *check_probed_device(struct devprobe_t *p)
+{
+	if (p->err) {
+		log_msg(lg, "+ can't open device '%s': %s", p->device, strerror(p->err));
+		return NULL;
+	}
+
+	if (0 != p->rc) {
+		log_msg(lg, "+ can't identify FS type");
+		return NULL;
+	}
+
+	log_msg(lg, "+ FS type '%s' detected", p->fstype);
+
+	/* Check that FS is known */
+	if (!fs_proc_check(p->fstype)) {
+
+		/* whitelist 'ubi', we assume it is ubifs */
+		if (!strncmp(p->fstype, "ubi",3)) {
+			log_msg(lg, "+ found %s container: assume ubifs", p->fstype);
+		} else {
+			log_msg(lg, "+ FS %s is not supported by kernel", p->fstype);
+		return NULL;
+		}
+	}
+
+	return p->fstype;
+}
+
+/* Take next device from list and probe it until list is exhausted */
+static void *probe_worker(void *arg)
+{
+	struct devprobe_list_t *pl = arg;
+	unsigned int i;
+
+	for (;;) {
+#ifdef USE_PARALLEL_SCAN
+		pthread_mutex_lock(&pl->lock);
+#endif
+		i = pl->next++;
+#ifdef USE_PARALLEL_SCAN
+		pthread_mutex_unlock(&pl->lock);
+#endif
+		if (i >= pl->count) break;
+		probe_device(&pl->list[i]);
+	}
+
+	return NULL;
+}
+
+#ifdef USE_IO_URING_SCAN
+/* Maximum count of device reads submitted at once */
+#define DEVSCAN_URING_DEPTH	32
+
+/* Rings of io_uring mapped by hand. liburing is not needed */
+struct devscan_uring_t {
+	int fd;
+	char *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+#ifdef __NR_io_uring_setup
+	return syscall(__NR_io_uring_setup, entries, p);
+#else
+	/* Headers have no syscall number. Behave like old kernel */
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+#ifdef __NR_io_uring_enter
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			flags, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Release io_uring */
+static void uring_close(struct devscan_uring_t *r)
+{
+	if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+	if ( (r->cq_ring != MAP_FAILED) && (r->cq_ring != r->sq_ring) )
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/* Set up io_uring of 'entries' entries. Return -1 when kernel has no
+ * io_uring or it is disabled */
+static int uring_open(struct devscan_uring_t *r, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0) return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->cq_ring = MAP_FAILED;
+	r->sqes = MAP_FAILED;
+
+	/* Both rings may share one mapping */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == r->sq_ring) goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (MAP_FAILED == r->cq_ring) goto fail;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (MAP_FAILED == r->sqes) goto fail;
+
+	r->sq_tail = (unsigned int *)(r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned int *)(r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(r->cq_ring + p.cq_off.cqes);
+	return 0;
+
+fail:
+	uring_close(r);
+	return -1;
+}
+
+/* Read start of every device by io_uring and identify FS types. Devices
+ * are opened in order, but all reads wait for media together. Return -1
+ * when io_uring can't be used and devices should be probed other way */
+static int probe_devices_uring(struct devprobe_list_t *pl)
+{
+	struct devscan_uring_t r;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct devprobe_t *p;
+	struct iovec *iov;
+	char *buf;
+	int *fds, err = 0;
+	unsigned int depth, first, batch, queued, submitted, done;
+	unsigned int i, tail, head;
+	int n;
+
+	depth = (pl->count < DEVSCAN_URING_DEPTH) ? pl->count : DEVSCAN_URING_DEPTH;
+	if (-1 == uring_open(&r, depth)) return -1;
+
+	buf = malloc(depth * FS_PROBE_SIZE);
+	iov = malloc(depth * sizeof(*iov));
+	fds = malloc(depth * sizeof(*fds));
+	if ( (NULL == buf) || (NULL == iov) || (NULL == fds) ) {
+		DPRINTF("Can't allocate io_uring buffers");
+		free(buf);
+		free(iov);
+		free(fds);
+		uring_close(&r);
+		return -1;
+	}
+
+	for (first = 0; first < pl->count; first += batch) {
+		batch = pl->count - first;
+		if (batch > depth) batch = depth;
+
+		/* Open devices and queue one read for each */
+		queued = 0;
+		tail = *r.sq_tail;
+		for (i = 0; i < batch; i++) {
+			p = &pl->list[first + i];
+			p->fstype = NULL;
+			p->err = 0;
+			p->rc = -1;
+
+			fds[i] = open(p->device, O_RDONLY);
+			if (fds[i] < 0) {
+				p->err = errno;
+				continue;
+			}
+
+			iov[i].iov_base = buf + i * FS_PROBE_SIZE;
+			iov[i].iov_len = FS_PROBE_SIZE;
+
+			sqe = &r.sqes[tail & *r.sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fds[i];
+			sqe->addr = (unsigned long)&iov[i];
+			sqe->len = 1;
+			sqe->off = 0;
+			sqe->user_data = i;
+			r.sq_array[tail & *r.sq_mask] = tail & *r.sq_mask;
+			++tail;
+			++queued;
+		}
+		/* Kernel should see filled entries before new tail */
+		__atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* Submit reads and identify FS of every completed one */
+		submitted = 0;
+		done = 0;
+		while (done < queued) {
+			n = sys_io_uring_enter(r.fd, queued - submitted, 1,
+					IORING_ENTER_GETEVENTS);
+			if (n < 0) {
+				if ( (EINTR == errno) || (EAGAIN == errno)
+						|| (EBUSY == errno) )
+					continue;
+				err = errno;
+				break;
+			}
+			submitted += n;
+
+			head = *r.cq_head;
+			tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++) {
+				cqe = &r.cqes[head & *r.cq_mask];
+				i = cqe->user_data;
+				p = &pl->list[first + i];
+				if (cqe->res >= 0)
+					p->rc = identify_fs_buf(buf + i * FS_PROBE_SIZE,
+							cqe->res, &p->fstype, NULL);
+				++done;
+			}
+			__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		for (i = 0; i < batch; i++)
+			if (fds[i] >= 0) close(fds[i]);
+
+		if (done < queued) {
+			log_msg(lg, "+ io_uring failed: %s", strerror(err));
+			break;
+		}
+	}
+
+	uring_close(&r);
+	free(buf);
+	free(iov);
+	free(fds);
+
+	/* Ring is broken. Probe devices once more other way */
+	return (first < pl->count) ? -1 : 0;
+}
+#endif	/* USE_IO_URING_SCAN */
+
+/* Probe all devices in list. Slow device does not stall others
+ * when io_uring or parallel scan is enabled */
+static void probe_devices(struct devprobe_list_t *pl)
+{
+	unsigned long long t;
+#ifdef USE_PARALLEL_SCAN
+	pthread_t threads[DEVSCAN_THREADS - 1];
+	int i, nthreads = 0;
+#endif
+
+	t = get_time_us();
+	pl->next = 0;
+
+#ifdef USE_IO_URING_SCAN
+	if ( (pl->count > 1) && (0 == probe_devices_uring(pl)) ) {
+		log_msg(lg, "+ probed %d device(s) by io_uring in %llu us",
+				pl->count, get_time_us() - t);
+		return;
+	}
+#endif
+
+#ifdef USE_PARALLEL_SCAN
+	if (pl->count > 1) {
+		/* Identifiers consult kernel lists. Read them before threads */
+		fs_cache_load();
+		pthread_mutex_init(&pl->lock, NULL);
+
+		for (i = 0; (i < DEVSCAN_THREADS - 1) && (i < pl->count - 1); i++) {
+			if (0 != pthread_create(&threads[i], NULL, probe_worker, pl))
+				break;
+			++nthreads;
+		}
+
+		/* Main thread works too */
+		probe_worker(pl);
+
+		for (i = 0; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+
+		pthread_mutex_destroy(&pl->lock);
+	} else
+#endif
+		probe_worker(pl);
+
+	log_msg(lg, "+ probed %d device(s) in %llu us", pl->count, get_time_us() - t);
+}
+
+/* Find device in probed devices list */
+static struct devprobe_t *find_probed_device(struct devprobe_list_t *pl,
+		const char *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < pl->count; i++) {
+		if (!strcmp(pl->list[i].device, device)) return &pl->list[i];
+	}
+	return NULL;
+}
+
 /* Import values from cfgdata and boot to bootconf */
-int addto_bootcfg(struct bootconf_t *bc, struct charlist *fl,
-		struct cfgdata_t *cfgdata)
+int addto_bootcfg(struct bootconf_t *bc, struct cfgdata_t *cfgdata)
 {
 	struct boot_item_t *bi;
 	struct dtypes_t *dt;
-	struct device_t dev;
+	struct devprobe_list_t pl;
+	struct devprobe_t *probe;
 	int i;
 	kx_cfg_section *sc;
 
+	/* Collect distinct devices so each one is probed only once */
+	pl.count = 0;
+	pl.list = malloc((cfgdata->count + 1) * sizeof(*(pl.list)));
+	if (NULL == pl.list) {
+		DPRINTF("Can't allocate memory for devices list");
+		return -1;
+	}
+
+	for (i = 0; i < cfgdata->count; i++) {
+		sc = cfgdata->list[i];
+		if ( (!sc) || (!sc->device) ) continue;
+		if (find_probed_device(&pl, sc->device)) continue;
+		pl.list[pl.count++].device = sc->device;
+	}
+
+	probe_devices(&pl);
+
 	/* Go through all found config file sections */
 	for (i = 0; i < cfgdata->count; i++) {
 		sc = cfgdata->list[i];
-		if (!sc) continue;
+		if ( (!sc) || (!sc->device) ) continue;
 
 		bi = malloc(sizeof(*bi));
 		if (NULL == bi) {
 			DPRINTF("Can't allocate memory for new bootconf item");
+			free(pl.list);
 			return -1;
 		}
 		
-		devscan(sc->device, fl, &dev);
+		log_msg(lg, "Checking device '%s'", sc->device);
+		probe = find_probed_device(&pl, sc->device);
 
-		bi->device = strdup(dev.device);
-		bi->fstype = dev.fstype;
+		bi->device = strdup(sc->device);
+		bi->fstype = check_probed_device(probe);
 
 		bi->dtype = DVT_UNKNOWN;
 		for (dt = dtypes; dt->dtype != DVT_UNKNOWN; dt++) {
@@ -161,6 +537,7 @@ int addto_bootcfg(struct bootconf_t *bc, struct charlist *fl,
 			new_list = realloc( bc->list, bc->size * sizeof(*(bc->list)) );
 			if (NULL == new_list) {
 				DPRINTF("Can't resize boot structure");
+				free(pl.list);
 				return -1;
 			}
 
@@ -169,6 +546,7 @@ int addto_bootcfg(struct bootconf_t *bc, struct charlist *fl,
 
 	} /* for */
 
+	free(pl.list);
 	return 0;
 }
 
@@ -216,39 +594,14 @@ void print_bootcfg(struct bootconf_t *bc)
 
 
 /* Detect FS type on device and returt pointer to static structure from fstype.c */
-const char *detect_fstype(char *device, struct charlist *fl)
+const char *detect_fstype(char *device)
 {
-	int fd;
-	const char *fstype;
-
-	fd = open(device, O_RDONLY);
-	if (fd < 0) {
-		log_msg(lg, "+ can't open device '%s': %s", device, ERRMSG);
-		return NULL;
-	}
-
-	if ( 0 != identify_fs(fd, &fstype, NULL, 0) ) {
-		close(fd);
-		log_msg(lg, "+ can't identify FS type");
-		return NULL;
-	}
-	close(fd);
-
-	log_msg(lg, "+ FS type '%s' detected", fstype);
+	struct devprobe_t p;
 
-	/* Check that FS is known */
-	if (in_charlist(fl, fstype) < 0) {
+	p.device = device;
+	probe_device(&p);
 
-		/* whitelist 'ubi', we assume it is ubifs */
-		if (!strncmp(fstype, "ubi",3)) {
-			log_msg(lg, "+ found %s container: assume ubifs", fstype);
-		} else {
-			log_msg(lg, "+ FS %s is not supported by kernel", fstype);
-		return NULL;
-		}
-	}
-
-	return(fstype);
+	return check_probed_device(&p);
 }
 
 
@@ -301,23 +654,16 @@ int get_bootinfo(struct cfgdata_t *cfgdata)
 	return -1;
 }
 
-int devscan_open(struct charlist **fslist)
+int devscan_open(void)
 {
-	struct charlist *fl;
-
-    /* Get a list of all filesystems registered in the kernel */
-	fl = scan_filesystems();
-	if (NULL == fl) {
-		return -1;
-	}
-
-	*fslist = fl;
+	/* Kernel may have got new filesystems (modules) since last scan */
+	fs_cache_reset();
 	return 0;
 }
 
-int devscan(char *device, struct charlist *fslist, struct device_t *dev)
+int devscan(char *device, struct device_t *dev)
 {
-	dev->fstype = detect_fstype(device, fslist);
+	dev->fstype = detect_fstype(device);
 	if (NULL == dev->fstype) {
 		return -1;
 	}
@@ -329,3 +675,111 @@ int devscan(char *device, struct charlist *fslist, struct device_t *dev)
 
 
 
+
+
+/* Return count of devices that are not present yet */
+static int devices_missing(char **devices, int count)
+{
+	struct stat sinfo;
+	int i, missing = 0;
+
+	for (i = 0; i < count; i++) {
+		if (NULL == devices[i]) continue;
+		if (-1 == stat(devices[i], &sinfo)) ++missing;
+	}
+
+	return missing;
+}
+
+/* Open kernel uevents socket. Return -1 on error */
+static int open_uevent_socket(void)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) return -1;
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_pid = 0;		/* Let kernel assign address */
+	snl.nl_groups = 1;	/* Kernel events group */
+
+	if (-1 == bind(fd, (struct sockaddr *)&snl, sizeof(snl))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Open inotify watching for new nodes in /dev. Return -1 on error */
+static int open_dev_inotify(void)
+{
+	int fd;
+
+	fd = inotify_init();
+	if (fd < 0) return -1;
+
+	if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_MOVED_TO) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Wait up to 'timeout' milliseconds until all devices appear */
+int devscan_wait(char **devices, int count, int timeout)
+{
+	/* Re-check devices periodically anyway. Node may appear a bit
+	 * later than uevent is received */
+	const int recheck = 100;
+	char buf[2048];
+	struct pollfd pfd;
+	unsigned long long start;
+	int elapsed, missing, wait;
+	char *source;
+
+	start = get_time_us();
+
+	/* Listen for events before first check to not miss anything */
+	source = "uevent";
+	pfd.fd = open_uevent_socket();
+	if (pfd.fd < 0) {
+		source = "inotify";
+		pfd.fd = open_dev_inotify();
+		if (pfd.fd < 0) source = "polling";
+	}
+	pfd.events = POLLIN;
+
+	for (;;) {
+		missing = devices_missing(devices, count);
+		elapsed = (get_time_us() - start) / 1000;
+		if ( (0 == missing) || (elapsed >= timeout) ) break;
+
+		wait = timeout - elapsed;
+		if (wait > recheck) wait = recheck;
+
+		if (pfd.fd < 0) {
+			usleep(wait * 1000);
+		} else if (poll(&pfd, 1, wait) > 0) {
+			/* Drain events. We only care that something happened */
+			while (read(pfd.fd, buf, sizeof(buf)) > 0) {
+				if (-1 == poll(&pfd, 1, 0) || !(pfd.revents & POLLIN))
+					break;
+			}
+		}
+	}
+
+	if (pfd.fd >= 0) close(pfd.fd);
+
+	if (missing) {
+		log_msg(lg, "+ %d device(s) still missing after %d ms (%s)",
+				missing, elapsed, source);
+	} else {
+		log_msg(lg, "+ waited %d ms for devices (%s)", elapsed, source);
+	}
+
+	return missing;
+}
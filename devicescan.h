@@ -70,10 +70,10 @@ extern char *machine_kernel;
 extern char *default_kernels[];
 
 /* Prepare devicescan loop */
-int devscan_open(struct charlist **fslist);
+int devscan_open(void);
 
-/* Get next device (fp & fslist in, dev out) */
-int devscan(char *device, struct charlist *fslist, struct device_t *dev);
+/* Get next device (device in, dev out) */
+int devscan(char *device, struct device_t *dev);
 
 /* Allocate bootconf structure */
 struct bootconf_t *create_bootcfg(unsigned int size);
@@ -82,12 +82,15 @@ struct bootconf_t *create_bootcfg(unsigned int size);
 void free_bootcfg(struct bootconf_t *bc);
 
 /* Import values from cfgdata and boot to bootconf */
-int addto_bootcfg(struct bootconf_t *bc, struct charlist *fl,
-		struct cfgdata_t *cfgdata);
+int addto_bootcfg(struct bootconf_t *bc, struct cfgdata_t *cfgdata);
 
 /* Check and parse config file */
 int get_bootinfo(struct cfgdata_t *cfgdata);
 
+/* Wait up to 'timeout' milliseconds until all 'count' devices appear.
+ * Return count of devices that are still missing */
+int devscan_wait(char **devices, int count, int timeout);
+
 #ifdef DEBUG
 /* Print bootconf structure */
 void print_bootcfg(struct bootconf_t *bc);
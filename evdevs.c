@@ -133,6 +133,9 @@ int inputs_init(kx_inputs *inputs, unsigned int size)
 	inputs->count = 0;
 	FD_ZERO(&(inputs->fdset));
 	inputs->maxfd = -1;
+#ifdef USE_TIMEOUT
+	inputs->deadline = 0;
+#endif
 
 	inputs->fdtypes = malloc(size * sizeof(*(inputs->fdtypes)));
 	inputs->fds = malloc(size * sizeof(*(inputs->fds)));
@@ -344,20 +347,33 @@ int inputs_process_evdev(int fd)
 
 
 /* Read and process events */
-enum actions_t inputs_process(kx_inputs *inputs)
+enum actions_t inputs_process(kx_inputs *inputs, int wait_ms)
 {
 	fd_set fds;
-	int i, fd, nready;
+	int i, fd, nready, wake = 0;
 	enum actions_t action = A_NONE;
 	struct timeval timeout;
+	unsigned long long left;
 
-	timeout.tv_usec = 0;
 #ifdef USE_TIMEOUT
-	timeout.tv_sec = USE_TIMEOUT;
+	unsigned long long now = get_time_us();
+
+	/* Countdown goes on when we are woken up without input */
+	if (0 == inputs->deadline)
+		inputs->deadline = now + USE_TIMEOUT * 1000000ULL;
+	left = (inputs->deadline > now) ? inputs->deadline - now : 0;
 #else
-	timeout.tv_sec = 60;	// exit after timeout to allow to do something above
+	left = 60 * 1000000ULL;	// exit after timeout to allow to do something above
 #endif
 
+	/* Caller wants to do something earlier */
+	if ( (wait_ms >= 0) && (wait_ms * 1000ULL < left) ) {
+		left = wait_ms * 1000ULL;
+		wake = 1;
+	}
+	timeout.tv_sec = left / 1000000;
+	timeout.tv_usec = left % 1000000;
+
 	if (0 == inputs->count) return A_ERROR;		/* A_EXIT ? */
 
 	fds = inputs->fdset;
@@ -372,14 +388,21 @@ enum actions_t inputs_process(kx_inputs *inputs)
 			return A_ERROR;
 		}
 	} else if (0 == nready) {	// timeout reached
+		if (wake) return A_NONE;
 #ifdef USE_TIMEOUT
 		log_msg(lg, "Timeout reached!");
+		inputs->deadline = 0;
 		return A_TIMEOUT;
 #else
 		return A_NONE;
 #endif
 	}
 
+#ifdef USE_TIMEOUT
+	/* User is here. Start countdown again */
+	inputs->deadline = 0;
+#endif
+
 	/* Check fds */
 	for (i = 0; i < inputs->count; i++) {
 		fd = inputs->fds[i];
@@ -402,3 +425,19 @@ enum actions_t inputs_process(kx_inputs *inputs)
 
 	return action;
 }
+
+
+/* Check without waiting that some input is ready to be processed */
+int inputs_ready(kx_inputs *inputs)
+{
+	fd_set fds;
+	struct timeval timeout;
+
+	if (0 == inputs->count) return 0;
+
+	fds = inputs->fdset;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 0;
+
+	return (select(inputs->maxfd, &fds, NULL, NULL, &timeout) > 0);
+}
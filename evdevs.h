@@ -65,6 +65,9 @@ typedef struct {
 	kx_input_type *fdtypes;
 	fd_set fdset;
 	int maxfd;
+#ifdef USE_TIMEOUT
+	unsigned long long deadline;	/* End of timeout in us (0 - not started) */
+#endif
 } kx_inputs;
 
 
@@ -86,8 +89,12 @@ void inputs_close(kx_inputs *inputs);
 /* Prepare inputs for processing */
 int inputs_preprocess(kx_inputs *inputs);
 
-/* Read and process events */
-enum actions_t inputs_process(kx_inputs *inputs);
+/* Read and process events. Return A_NONE after 'wait_ms' milliseconds
+ * without input (-1 - wait for timeout) */
+enum actions_t inputs_process(kx_inputs *inputs, int wait_ms);
+
+/* Check without waiting that some input is ready to be processed */
+int inputs_ready(kx_inputs *inputs);
 
 
 #endif //_HAVE_EVDEVS_H_
@@ -21,478 +21,4299 @@
 
 #ifdef USE_FBMENU
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef USE_FB_THREADS
+#include <pthread.h>
+#endif
+#ifdef USE_FB_DRM
+#include <poll.h>
+#include <drm/drm.h>
+#endif
 
 #include "fb.h"
 
+/* Maximum count of separate changed rectangles between renders */
+#define FB_MAX_DAMAGE	8
 
-static unsigned int compose_color (kx_rgba rgba) {
+/* Lower bpp modes are switched to supported ones */
+#ifdef USE_8BPP
+#define FB_MIN_BPP		8
+#else
+#define FB_MIN_BPP		16
+#endif
 
-	kx_ccomp r, g, b, a;
-	kx_ccomp c1, c2, c3;
-	kx_rgba color;
+#ifdef USE_FB_PAN
+/* Presentation modes */
+enum fb_present_t {
+	FB_PRESENT_COPY = 0,	/* Copy backbuffer from RAM to videomemory */
+	FB_PRESENT_PAN			/* Update hidden page and pan to it */
+};
+#endif
 
-	rgba2comp(rgba, &r, &g, &b, &a);
+/* Copy 'length' bytes from RAM to framebuffer memory */
+typedef void (*copy_mem_func)(char *src, char *dst, int length);
 
-	switch (fb.bpp) {
+#ifdef USE_FB_ROTATE
+/* Copy rectangle of unrotated backbuffer to rotated buffer 'dst' */
+typedef void (*rotate_rect_func)(kx_rect *r, char *dst);
+#endif
 
-		case 16:
-			if (RGB == fb.rgbmode)
-				color = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
-			else
-				color = ((b >> 3) << 11) | ((g >> 2) << 5) | (r >> 3);
-			break;
+#ifdef USE_FB_DRM
+/* Dumb buffer scanned out by KMS */
+struct fb_drm_buffer_t {
+	__u32 handle;		/* GEM handle of buffer */
+	__u32 fb_id;		/* KMS framebuffer on it */
+	__u64 size;
+	char *map;
+};
+#endif
 
-		case 18:
-			if (RGB == fb.rgbmode) {
+/* Framebuffer device. Its backbuffer is 'screen' surface */
+typedef struct FB {
+	int fd;
+	int type;
+	int visual;
+	int width, height;
+	int stride;
+	char *data;
+	char *base;
+	kx_surface screen;
+
+	int copy_width;		/* Narrowest safe RAM-to-FB transfer in bytes */
+	copy_mem_func copy_mem;
+
+	int screensize;
+	int angle;
+	int real_width, real_height;
+
+	enum RGBMode rgbmode;
+	int red_offset;
+	int red_length;
+	int green_offset;
+	int green_length;
+	int blue_offset;
+	int blue_length;
+	kx_pixel_format format;
+	const kx_primitives *primitives;	/* Primitives of format for 4 angles */
+
+	kx_rect damage[FB_MAX_DAMAGE];	/* Changed areas in backbuffer coordinates */
+	int damage_count;
+
+#ifdef USE_FB_ROTATE
+	int rotate;		/* Backbuffer is unrotated, rotation is done when shown */
+	rotate_rect_func rotate_rect;
+#endif
+#ifdef USE_FB_PAN
+	enum fb_present_t present;	/* How backbuffer is shown */
+	int pan_copy;		/* Backbuffer is in RAM and is copied into hidden page */
+	int page;		/* Shown videomemory page (0 or 1) */
+	int vsync;		/* Wait for vertical sync after panning */
+	struct fb_var_screeninfo pan_var;
+	kx_rect stale[FB_MAX_DAMAGE];	/* Hidden page areas older than shown ones */
+	int stale_count;
+#endif
+#ifdef USE_FB_DRM
+	int drm;		/* Device is KMS one. Pages are dumb buffers */
+	struct fb_drm_buffer_t drm_buf[2];
+	__u32 drm_connector, drm_crtc;
+	int drm_pipe;		/* Index of CRTC */
+	struct drm_mode_modeinfo drm_mode;
+	struct drm_mode_crtc drm_saved;	/* CRTC state restored on exit */
+#endif
+#ifdef USE_FB_MEMORY
+	char *dump_path;	/* Save every shown frame to this PPM file */
+#endif
+#ifdef USE_ANIMATION
+	int no_vsync;		/* Driver can't wait for vertical retrace */
+#endif
+} FB;
 
-				c1 = (r >> 2) | ((g & 0x0C) << 4);
-				c2 = ((g & 0xF0) >> 4) | ((b & 0x3C) << 2);
-				c3 = (b & 0xC0) >> 6;
-			}
-			else {
-				c1 = (b >> 2) | ((g & 0x0C) << 4);
-			        c2 = ((g & 0xF0) >> 4) | ((r & 0x3C) << 2);
-				c3 = (r & 0xC0) >> 6;
-			}
+static FB fb;
 
-			color = (uint32_t)c1 << 16 | (uint32_t)c2 << 8 | (uint32_t)c3;
-			break;
-		case 24:
-		case 32:
-			if (RGB == fb.rgbmode)
-				color = (uint32_t)r << 16 | (uint32_t)g << 8 | (uint32_t)b;
-			else
-				color = (uint32_t)b << 16 | (uint32_t)g << 8 | (uint32_t)r;
-			break;
-		default:
-			color = rgba;
-			break;
-	}
+static void fb_glyph_cache_flush();
+static void fb_put_span(char *dst, const char *src, int n, char *buf);
+#ifdef USE_FB_MIRROR
+static void fb_present_mirrors();
+static void fb_update_mirrors();
+static void fb_close_mirrors();
+#endif
+#ifdef USE_FB_DRM
+#ifdef USE_FB_PAN
+static int fb_drm_flip();
+#endif
+static void fb_drm_close();
+#ifdef USE_ANIMATION
+static int fb_drm_wait_vblank();
+#endif
+#endif
+
+#ifdef USE_8BPP
+/* RGB565 cache key of RGB888 color */
+#define FB_RGB565(c)	( (((c) >> 8) & 0xF800) | (((c) >> 5) & 0x07E0) \
+						| (((c) >> 3) & 0x001F) )
 
-	/* add alpha channel */
-	color = (a << 24) | color;
+#ifdef USE_SPLASH
+static void fb_set_palette(const uint32_t *colors, int count);
+#endif
 
-	return color;
+/* Palette index of RGB565 color. Cache is filled when palette is built,
+ * so it is only read while drawing, by several threads too */
+static inline unsigned int fb_palette_index(const kx_pixel_format *f,
+		unsigned int key)
+{
+	return f->nearest[key] - 1;
 }
+#endif
 
-static inline void
-fb_respect_angle(int x, int y, int *dx, int *dy, int *nx)
+/* Compose pixel value of RGBA color. Alpha is not stored */
+static inline unsigned int compose_color(const kx_pixel_format *f,
+		kx_rgba rgba)
 {
-/*	// Not sure about this check. IMHO programmer should do this check in his head
-	if (x < 0 || x > fb.width - 1 || y < 0 || y > fb.height - 1) {
-		*dx = 0;
-		*dy = 0;
-		if (nx) *nx = 0;
-		return;
-	}
-*/
-	switch (fb.angle) {
-	case 270:
-		*dy = x;
-		*dx = fb.real_width - y - 1;
-		if (nx) *nx = fb.stride;
-		break;
-	case 180:
-		*dx = fb.real_width - x - 1;
-		*dy = fb.real_height - y - 1;
-		if (nx) *nx = -fb.byte_pp;
-		break;
-	case 90:
-		*dx = y;
-		*dy = fb.real_height - x - 1;
-		if (nx) *nx = -fb.stride;
-		break;
-	case 0:
-	default:
-		*dx = x;
-		*dy = y;
-		if (nx) *nx = fb.byte_pp;
-		break;
-	}
-/*	// Not sure about this check. IMHO programmer should do this check in his head
-	if (*dx < 0 || *dx > fb.real_width - 1 || *dy < 0 || *dy > fb.real_height - 1) {
-		*dx = 0;
-		*dy = 0;
-		if (nx) *nx = 0;
-		return;
-	}
-*/
+	unsigned int c;
+
+	c = f->red[rgba >> 24] | f->green[(rgba >> 16) & 0xFF]
+			| f->blue[(rgba >> 8) & 0xFF];
+#ifdef USE_8BPP
+	if (FB_CONVERT_PALETTE == f->convert) return fb_palette_index(f, c);
+#endif
+	return c;
 }
 
 /**************************************************************************
- * Pixel plotting routines
+ * Drawing primitives specialized for every bpp and angle.
+ * Coordinates are screen ones and should be already clipped.
  */
-#ifdef USE_32BPP
-static void
-fb_plot_pixel_32bpp(int x, int y, kx_rgba color)
-{
-	static char *offset;
-	static int ox, oy;
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 2);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+/* Store composed color to pixel at 'p' */
+#define FB_STORE_32(p, c)	( *(uint32_t *)(p) = (uint32_t)(c) )
+#define FB_STORE_24(p, c)	do { (p)[0] = (c); (p)[1] = (c) >> 8; \
+								(p)[2] = (c) >> 16; } while (0)
+#define FB_STORE_16(p, c)	( *(uint16_t *)(p) = (uint16_t)(c) )
+#define FB_STORE_8(p, c)	( *(unsigned char *)(p) = (unsigned char)(c) )
 
-	*(volatile uint32_t *) offset = (uint32_t) color;
-}
-#endif
+/* Copy one native pixel from 's' to 'p' */
+#define FB_COPY_32(p, s)	( *(uint32_t *)(p) = *(const uint32_t *)(s) )
+#define FB_COPY_24(p, s)	do { (p)[0] = (s)[0]; (p)[1] = (s)[1]; \
+								(p)[2] = (s)[2]; } while (0)
+#define FB_COPY_16(p, s)	( *(uint16_t *)(p) = *(const uint16_t *)(s) )
+#define FB_COPY_8(p, s)		( *(p) = *(s) )
 
-#ifdef USE_24BPP
-static void
-fb_plot_pixel_24bpp(int x, int y, kx_rgba color)
+/* Wide stores of replicated pixels may alias pixels of any size */
+typedef uint64_t __attribute__((__may_alias__)) fb_wide_t;
+
+/*
+ * Fill 'n' pixels at 'p' by composed color 'c'. Color is replicated into
+ * 64-bit pattern which is stored by aligned words. Head and tail are
+ * stored by pixels.
+ */
+static inline void fb_fill_32(char *p, uint32_t c, int n)
 {
-	static char *offset;
-	static int ox, oy;
+	fb_wide_t w;
+
+	if ( (n > 0) && ((unsigned long)p & 4) ) {
+		FB_STORE_32(p, c);
+		p += 4;
+		--n;
+	}
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	w = (uint64_t)c << 32 | c;
+	for (; n >= 4; n -= 4) {
+		((fb_wide_t *)p)[0] = w;
+		((fb_wide_t *)p)[1] = w;
+		p += 16;
+	}
+	if (n >= 2) {
+		*(fb_wide_t *)p = w;
+		p += 8;
+		n -= 2;
+	}
 
-	*(volatile char *) (offset) = (color & 0x000000FF);
-	*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-	*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
+	if (n > 0) FB_STORE_32(p, c);
 }
-#endif
 
-#ifdef USE_18BPP
-static void
-fb_plot_pixel_18bpp(int x, int y, kx_rgba color)
+/* 8 pixels of 24bpp are stored as three 64-bit words */
+static inline void fb_fill_24(char *p, uint32_t c, int n)
 {
-	static char *offset;
-	static int ox, oy;
-
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	union {
+		unsigned char b[24];
+		uint64_t w[3];
+	} pattern;
+	int i;
 
-	*(volatile char *) (offset) = (color & 0x000000FF);
-	*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-	*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
-}
-#endif
+	for (; (n > 0) && ((unsigned long)p & 7); n--) {
+		FB_STORE_24(p, c);
+		p += 3;
+	}
 
-#ifdef USE_16BPP
-static void
-fb_plot_pixel_16bpp(int x, int y, kx_rgba color)
-{
-	static char *offset;
-	static int ox, oy;
+	if (n >= 8) {
+		for (i = 0; i < 24; i += 3)
+			FB_STORE_24(pattern.b + i, c);
 
-	fb_respect_angle(x, y, &ox, &oy, NULL);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 1);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+		for (; n >= 8; n -= 8) {
+			((fb_wide_t *)p)[0] = pattern.w[0];
+			((fb_wide_t *)p)[1] = pattern.w[1];
+			((fb_wide_t *)p)[2] = pattern.w[2];
+			p += 24;
+		}
+	}
 
-	*(volatile uint16_t *) offset = (uint16_t) color;
+	for (; n > 0; n--) {
+		FB_STORE_24(p, c);
+		p += 3;
+	}
 }
-#endif
 
-/**************************************************************************
- * Horizontal line drawing routines
- */
-#ifdef USE_32BPP
-static void
-fb_draw_hline_32bpp(int x, int y, int length, kx_rgba color)
+static inline void fb_fill_16(char *p, uint32_t c, int n)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	fb_wide_t w;
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 2);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	for (; (n > 0) && ((unsigned long)p & 7); n--) {
+		FB_STORE_16(p, c);
+		p += 2;
+	}
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+	w = (c & 0xFFFF) * 0x0001000100010001ULL;
+	for (; n >= 8; n -= 8) {
+		((fb_wide_t *)p)[0] = w;
+		((fb_wide_t *)p)[1] = w;
+		p += 16;
+	}
+	if (n >= 4) {
+		*(fb_wide_t *)p = w;
+		p += 8;
+		n -= 4;
+	}
 
-	for(; oy > 0; oy--) {
-		*(volatile uint32_t *) offset = color;
-		offset += nx;
+	for (; n > 0; n--) {
+		FB_STORE_16(p, c);
+		p += 2;
 	}
 }
-#endif
 
-#ifdef USE_24BPP
-static void
-fb_draw_hline_24bpp(int x, int y, int length, kx_rgba color)
+static inline void fb_fill_8(char *p, uint32_t c, int n)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	fb_wide_t w;
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	for (; (n > 0) && ((unsigned long)p & 7); n--) {
+		FB_STORE_8(p, c);
+		p++;
+	}
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+	w = (c & 0xFF) * 0x0101010101010101ULL;
+	for (; n >= 16; n -= 16) {
+		((fb_wide_t *)p)[0] = w;
+		((fb_wide_t *)p)[1] = w;
+		p += 16;
+	}
+	if (n >= 8) {
+		*(fb_wide_t *)p = w;
+		p += 8;
+		n -= 8;
+	}
 
-	for(; oy > 0; oy--) {
-		*(volatile char *) (offset) = (color & 0x000000FF);
-		*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-		*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
-		offset += nx;
+	for (; n > 0; n--) {
+		FB_STORE_8(p, c);
+		p++;
 	}
 }
-#endif
 
-#ifdef USE_18BPP
-static void
-fb_draw_hline_18bpp(int x, int y, int length, kx_rgba color)
-{
-	static char *offset;
-	static int ox, oy, nx;
+/* Load composed color from native pixel at 's' */
+#define FB_LOAD_32(s)	( *(const uint32_t *)(s) )
+#define FB_LOAD_24(s)	( (uint32_t)(unsigned char)(s)[0] \
+						| (uint32_t)(unsigned char)(s)[1] << 8 \
+						| (uint32_t)(unsigned char)(s)[2] << 16 )
+#define FB_LOAD_16(s)	( *(const uint16_t *)(s) )
+#define FB_LOAD_8(s)	( (uint32_t)*(const unsigned char *)(s) )
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox + (ox << 1));
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+/* Scale opacity 0..255 to 0..256 to get exact colors on both ends */
+#define FB_OPACITY(v)	( (v) + ((v) >> 7) )
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+/*
+ * Source-over blending in fixed point. Opacity 'o' is 0..256.
+ * Channels are spread over 32-bit word with gaps wide enough for
+ * multiplication results, so one multiplication mixes several channels.
+ */
+static inline uint32_t fb_mix_888(uint32_t c, uint32_t d, unsigned int o)
+{
+	uint32_t rb, g;
 
-	for(; oy > 0; oy--) {
-		*(volatile char *) (offset) = (color & 0x000000FF);
-		*(volatile char *) (offset + 1) = (color & 0x0000FF00) >> 8;
-		*(volatile char *) (offset + 2) = (color & 0x00FF0000) >> 16;
-		offset += nx;
-	}
+	rb = ( (c & 0xFF00FF) * o + (d & 0xFF00FF) * (256 - o) ) >> 8;
+	g = ( (c & 0x00FF00) * o + (d & 0x00FF00) * (256 - o) ) >> 8;
+
+	return (rb & 0xFF00FF) | (g & 0x00FF00);
 }
-#endif
 
-#ifdef USE_16BPP
-static void
-fb_draw_hline_16bpp(int x, int y, int length, kx_rgba color)
+static inline void fb_blend_32(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	static char *offset;
-	static int ox, oy, nx;
+	uint32_t d = *(uint32_t *)p;
 
-	fb_respect_angle(x, y, &ox, &oy, &nx);
-	offset = fb.backbuffer + oy * fb.stride + (ox << 1);
-	if (offset > (fb.backbuffer + fb.screensize - fb.byte_pp)) return;
+	*(uint32_t *)p = (d & 0xFF000000) | fb_mix_888(c, d, o);
+}
 
-	if (length > fb.width - x)
-		oy = fb.width - x;
-	else
-		oy = length;
+static inline void fb_blend_24(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
+{
+	uint32_t d = FB_LOAD_24(p);
 
-	for(; oy > 0; oy--) {
-		*(volatile uint16_t *) offset = (uint16_t) color;
-		offset += nx;
-	}
+	d = fb_mix_888(c, d, o);
+	FB_STORE_24(p, d);
 }
-#endif
-
-/*
- * NOTE: klibc uses 8bit transfers that breaks image on tosa
- * So we will use own memcpy.
- * We can use uint32_t transfers because of screen dimensions
- * are always even numbers: (W/2*2)*(H/2*2) = (W*H/4)*4
- */
 
-void
-fb_memcpy(char *src, char *dst, int length)
+static inline void fb_blend_16(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	static USE_FB_TRANS_TYPE *s, *d;
-	static int n;
+	uint32_t d = *(uint16_t *)p;
 
-	s = (USE_FB_TRANS_TYPE *)src;
-	d = (USE_FB_TRANS_TYPE *)dst;
-	n = USE_FB_TRANS_LENGTH(length);
+	/* 565 is unpacked to 00000GGGGGG00000RRRRR000000BBBBB */
+	c = ( (c & 0xFFFF) | (c << 16) ) & 0x07E0F81F;
+	d = ( d | (d << 16) ) & 0x07E0F81F;
+	o = (o + 4) >> 3;	/* 5 bits of opacity are enough here */
 
-	while (n--) {
-		*(d++) = *(s++);
-	}
+	d = ( (c * o + d * (32 - o)) >> 5 ) & 0x07E0F81F;
+	*(uint16_t *)p = (uint16_t)(d | (d >> 16));
 }
 
-/* Move backbuffer contents to videomemory */
-void fb_render()
+#ifdef USE_8BPP
+/* Palette entries are mixed as RGB888 colors and result is looked up */
+static inline void fb_blend_8(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	fb_memcpy(fb.backbuffer, fb.data, fb.screensize);
+	uint32_t d;
+
+	d = fb_mix_888(f->palette[c & 0xFF], f->palette[FB_LOAD_8(p)], o);
+	FB_STORE_8(p, fb_palette_index(f, FB_RGB565(d)));
 }
+#endif
 
-/* Save backbuffer contents to further usage */
-char *fb_dump()
+/*
+ * Blending of any channel layout (18bpp, 555, 10-bit channels etc).
+ * Every channel is mixed in place in 64 bits, bits of pixel that are
+ * not in any channel are kept.
+ */
+static inline uint32_t fb_mix_any(const kx_pixel_format *f, uint32_t c,
+		uint32_t d, unsigned int o)
 {
-	char *dump;
+	const uint32_t *m = f->mask;
+	uint32_t v;
+	int i;
 
-	dump = malloc(fb.screensize);
-	if (NULL == dump) return NULL;
+	v = d & ~(m[0] | m[1] | m[2]);
+	for (i = 0; i < 3; i++)
+		v |= (uint32_t)( ( (uint64_t)(c & m[i]) * o
+				+ (uint64_t)(d & m[i]) * (256 - o) ) >> 8 ) & m[i];
 
-	fb_memcpy(fb.backbuffer, dump, fb.screensize);
-	return dump;
+	return v;
 }
 
-/* Restore saved backbuffer */
-void fb_restore(char *dump)
+static inline void fb_blend_any_32(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	if (NULL == dump) return;
-	fb_memcpy(dump, fb.backbuffer, fb.screensize);
+	*(uint32_t *)p = fb_mix_any(f, c, *(uint32_t *)p, o);
 }
 
-
-void fb_destroy()
+static inline void fb_blend_any_24(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	if (fb.fd >= 0)
-		close(fb.fd);
-	if(fb.backbuffer)
-		free(fb.backbuffer);
+	uint32_t d = FB_LOAD_24(p);
+
+	d = fb_mix_any(f, c, d, o);
+	FB_STORE_24(p, d);
 }
 
-int
-attempt_to_change_pixel_format(struct fb_var_screeninfo *fb_var)
+static inline void fb_blend_any_16(const kx_pixel_format *f, char *p,
+		uint32_t c, unsigned int o)
 {
-	/* By default the framebuffer driver may have set an oversized
-	 * yres_virtual to support VT scrolling via the panning interface.
-	 *
-	 * We don't try and maintain this since it's more likely that we
-	 * will fail to increase the bpp if the driver's pre allocated
-	 * framebuffer isn't large enough.
-	 */
-	fb_var->yres_virtual = fb_var->yres;
+	*(uint16_t *)p = (uint16_t)fb_mix_any(f, c, *(uint16_t *)p, o);
+}
 
-	/* First try setting an 8,8,8,0 pixel format so we don't have to do
-	 * any conversions while drawing. */
+/* Offset in pixels of surface 's' of its point for 'B' bytes per pixel */
+#define FB_OFFSET_0(s, x, y, B)		( (y) * (s)->stride + (x) * (B) )
+#define FB_OFFSET_90(s, x, y, B)	( ((s)->real_height - (x) - 1) * (s)->stride \
+										+ (y) * (B) )
+#define FB_OFFSET_180(s, x, y, B)	( ((s)->real_height - (y) - 1) * (s)->stride \
+										+ ((s)->real_width - (x) - 1) * (B) )
+#define FB_OFFSET_270(s, x, y, B)	( (x) * (s)->stride \
+										+ ((s)->real_width - (y) - 1) * (B) )
+
+/* Offset of top left corner of surface rectangle */
+#define FB_RECT_OFFSET_0(s, x, y, w, h, B)		FB_OFFSET_0(s, x, y, B)
+#define FB_RECT_OFFSET_90(s, x, y, w, h, B)	FB_OFFSET_90(s, (x) + (w) - 1, y, B)
+#define FB_RECT_OFFSET_180(s, x, y, w, h, B)	\
+		FB_OFFSET_180(s, (x) + (w) - 1, (y) + (h) - 1, B)
+#define FB_RECT_OFFSET_270(s, x, y, w, h, B)	\
+		FB_OFFSET_270(s, x, (y) + (h) - 1, B)
+
+/* Rectangle width and height are swapped in pixels */
+#define FB_RECT_SWAP_0		0
+#define FB_RECT_SWAP_90		1
+#define FB_RECT_SWAP_180	0
+#define FB_RECT_SWAP_270	1
+
+/* Pixels offset change when surface x grows by 1 */
+#define FB_XSTEP_0(s, B)		(B)
+#define FB_XSTEP_90(s, B)		(-(s)->stride)
+#define FB_XSTEP_180(s, B)		(-(B))
+#define FB_XSTEP_270(s, B)		((s)->stride)
+
+/* Pixels offset change when surface y grows by 1 */
+#define FB_YSTEP_0(s, B)		((s)->stride)
+#define FB_YSTEP_90(s, B)		(B)
+#define FB_YSTEP_180(s, B)		(-(s)->stride)
+#define FB_YSTEP_270(s, B)		(-(B))
+
+#define FB_DEFINE_PRIMITIVES(bits, B, angle) \
+static void fb_plot_pixel_##bits##_##angle(kx_surface *s, int x, int y, \
+		kx_rgba color) \
+{ \
+	char *p = s->pixels + FB_OFFSET_##angle(s, x, y, B); \
+	FB_STORE_##bits(p, color); \
+} \
+\
+static void fb_draw_hline_##bits##_##angle(kx_surface *s, int x, int y, \
+		int length, kx_rgba color) \
+{ \
+	char *p = s->pixels + FB_OFFSET_##angle(s, x, y, B); \
+	const int step = FB_XSTEP_##angle(s, B); \
+\
+	/* Line goes along pixels row in either direction */ \
+	if (step == (B)) { \
+		fb_fill_##bits(p, color, length); \
+		return; \
+	} \
+	if (step == -(B)) { \
+		fb_fill_##bits(p - (length - 1) * (B), color, length); \
+		return; \
+	} \
+\
+	for (; length > 0; length--) { \
+		FB_STORE_##bits(p, color); \
+		p += step; \
+	} \
+} \
+\
+static void fb_draw_rect_##bits##_##angle(kx_surface *s, int x, int y, \
+		int width, int height, kx_rgba color) \
+{ \
+	char *row = s->pixels \
+			+ FB_RECT_OFFSET_##angle(s, x, y, width, height, B); \
+	const int stride = s->stride; \
+	int t; \
+\
+	/* Solid rectangle is filled by pixels rows in any angle */ \
+	if (FB_RECT_SWAP_##angle) { \
+		t = width; \
+		width = height; \
+		height = t; \
+	} \
+\
+	for (; height > 0; height--) { \
+		fb_fill_##bits(row, color, width); \
+		row += stride; \
+	} \
+} \
+\
+static void fb_blit_span_##bits##_##angle(kx_surface *s, int x, int y, \
+		int length, const char *src) \
+{ \
+	char *p = s->pixels + FB_OFFSET_##angle(s, x, y, B); \
+	const int step = FB_XSTEP_##angle(s, B); \
+\
+	for (; length > 0; length--) { \
+		FB_COPY_##bits(p, src); \
+		src += (B); \
+		p += step; \
+	} \
+} \
+\
+static void fb_blit_runs_##bits##_##angle(kx_surface *s, int x, int y, \
+		const kx_run *runs, int count, const char *pixels, int stride) \
+{ \
+	const int step = FB_XSTEP_##angle(s, B); \
+	const char *src; \
+	char *p; \
+	int i; \
+\
+	for (; count > 0; count--, runs++) { \
+		p = s->pixels \
+				+ FB_OFFSET_##angle(s, x + runs->x, y + runs->y, B); \
+		src = pixels + runs->y * stride + runs->x * (B); \
+		for (i = runs->length; i > 0; i--) { \
+			FB_COPY_##bits(p, src); \
+			src += (B); \
+			p += step; \
+		} \
+	} \
+}
 
-	fb_var->bits_per_pixel = 32;
+/* Blending primitives. 'mix' names blending of pixel format stored as
+ * 'bits' bpp pixels */
+#define FB_DEFINE_BLEND_PRIMITIVES(mix, bits, B, angle) \
+static void fb_blend_rect_##mix##_##angle(kx_surface *s, int x, int y, \
+		int width, int height, kx_rgba color, int opacity) \
+{ \
+	const kx_pixel_format *f = s->format; \
+	char *row = s->pixels + FB_OFFSET_##angle(s, x, y, B); \
+	const int step = FB_XSTEP_##angle(s, B); \
+	const int row_step = FB_YSTEP_##angle(s, B); \
+	const unsigned int o = FB_OPACITY(opacity); \
+	char *p; \
+	int i; \
+\
+	for (; height > 0; height--) { \
+		p = row; \
+		for (i = width; i > 0; i--) { \
+			fb_blend_##mix(f, p, color, o); \
+			p += step; \
+		} \
+		row += row_step; \
+	} \
+} \
+\
+static void fb_blend_span_##mix##_##angle(kx_surface *s, int x, int y, \
+		int length, const char *src, const unsigned char *opacity) \
+{ \
+	const kx_pixel_format *f = s->format; \
+	char *p = s->pixels + FB_OFFSET_##angle(s, x, y, B); \
+	const int step = FB_XSTEP_##angle(s, B); \
+\
+	for (; length > 0; length--) { \
+		fb_blend_##mix(f, p, FB_LOAD_##bits(src), FB_OPACITY(*opacity)); \
+		src += (B); \
+		opacity++; \
+		p += step; \
+	} \
+} \
+\
+static void fb_blend_runs_##mix##_##angle(kx_surface *s, int x, int y, \
+		const kx_run *runs, int count, const char *pixels, int stride, \
+		const unsigned char *opacity) \
+{ \
+	for (; count > 0; count--, runs++) { \
+		fb_blend_span_##mix##_##angle(s, x + runs->x, y + runs->y, \
+				runs->length, pixels + runs->y * stride + runs->x * (B), \
+				opacity); \
+		opacity += runs->length; \
+	} \
+}
 
-	fb_var->red.offset = 0;
-	fb_var->red.length = 8;
+#define FB_DEFINE_ALL_ANGLES(bits, B) \
+	FB_DEFINE_PRIMITIVES(bits, B, 0) \
+	FB_DEFINE_PRIMITIVES(bits, B, 90) \
+	FB_DEFINE_PRIMITIVES(bits, B, 180) \
+	FB_DEFINE_PRIMITIVES(bits, B, 270)
 
-	fb_var->green.offset = 8;
-	fb_var->green.length = 8;
+#define FB_DEFINE_BLEND_ALL_ANGLES(mix, bits, B) \
+	FB_DEFINE_BLEND_PRIMITIVES(mix, bits, B, 0) \
+	FB_DEFINE_BLEND_PRIMITIVES(mix, bits, B, 90) \
+	FB_DEFINE_BLEND_PRIMITIVES(mix, bits, B, 180) \
+	FB_DEFINE_BLEND_PRIMITIVES(mix, bits, B, 270)
 
-	fb_var->blue.offset = 16;
-	fb_var->blue.length = 8;
+#define FB_PRIMITIVES(bits, mix, angle) { \
+	fb_plot_pixel_##bits##_##angle, fb_draw_hline_##bits##_##angle, \
+	fb_draw_rect_##bits##_##angle, fb_blit_span_##bits##_##angle, \
+	fb_blit_runs_##bits##_##angle, fb_blend_rect_##mix##_##angle, \
+	fb_blend_span_##mix##_##angle, fb_blend_runs_##mix##_##angle }
 
-	fb_var->transp.offset = 0;
-	fb_var->transp.length = 0;
+#define FB_PRIMITIVES_ALL_ANGLES(bits, mix) { \
+	FB_PRIMITIVES(bits, mix, 0), FB_PRIMITIVES(bits, mix, 90), \
+	FB_PRIMITIVES(bits, mix, 180), FB_PRIMITIVES(bits, mix, 270) }
 
-	if ((ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == 0) && (32 == fb_var->bits_per_pixel)) {
-		log_msg(lg, "Switched to a 32bpp mode");
-		return 1;
-	} else {
-		log_msg(lg, "Failed to switch to a 32bpp mode, trying 16bpp");
-	}
 
-	/* Otherwise try a 16bpp 5,6,5 format */
+/* Every bpp has primitives blending common channel layouts fast and
+ * primitives blending any layout. 18bpp pixels are stored as 24bpp ones
+ * and always blended as any layout */
+#ifdef USE_32BPP
+FB_DEFINE_ALL_ANGLES(32, 4)
+FB_DEFINE_BLEND_ALL_ANGLES(32, 32, 4)
+FB_DEFINE_BLEND_ALL_ANGLES(any_32, 32, 4)
+static const kx_primitives fb_primitives_32[4] =
+		FB_PRIMITIVES_ALL_ANGLES(32, 32);
+static const kx_primitives fb_primitives_any_32[4] =
+		FB_PRIMITIVES_ALL_ANGLES(32, any_32);
+#endif
 
-	fb_var->bits_per_pixel = 16;
+#if defined(USE_24BPP) || defined(USE_18BPP)
+FB_DEFINE_ALL_ANGLES(24, 3)
+FB_DEFINE_BLEND_ALL_ANGLES(any_24, 24, 3)
+static const kx_primitives fb_primitives_any_24[4] =
+		FB_PRIMITIVES_ALL_ANGLES(24, any_24);
+#endif
 
-	fb_var->red.offset = 11;
-	fb_var->red.length = 5;
+#ifdef USE_24BPP
+FB_DEFINE_BLEND_ALL_ANGLES(24, 24, 3)
+static const kx_primitives fb_primitives_24[4] =
+		FB_PRIMITIVES_ALL_ANGLES(24, 24);
+#endif
 
-	fb_var->green.offset = 5;
-	fb_var->green.length = 6;
+#ifdef USE_16BPP
+FB_DEFINE_ALL_ANGLES(16, 2)
+FB_DEFINE_BLEND_ALL_ANGLES(16, 16, 2)
+FB_DEFINE_BLEND_ALL_ANGLES(any_16, 16, 2)
+static const kx_primitives fb_primitives_16[4] =
+		FB_PRIMITIVES_ALL_ANGLES(16, 16);
+static const kx_primitives fb_primitives_any_16[4] =
+		FB_PRIMITIVES_ALL_ANGLES(16, any_16);
+#endif
 
-	fb_var->blue.offset = 0;
-	fb_var->blue.length = 5;
+#ifdef USE_8BPP
+FB_DEFINE_ALL_ANGLES(8, 1)
+FB_DEFINE_BLEND_ALL_ANGLES(8, 8, 1)
+static const kx_primitives fb_primitives_8[4] =
+		FB_PRIMITIVES_ALL_ANGLES(8, 8);
+#endif
 
-	fb_var->transp.offset = 0;
-	fb_var->transp.length = 0;
+#ifdef USE_FB_ROTATE
+/*
+ * Rotation of unrotated backbuffer while presenting.
+ * Backbuffer column becomes row of videomemory. Rectangle is processed by
+ * small tiles so source rows of tile stay in cache while destination
+ * is written sequentially.
+ */
+#define FB_ROTATE_TILE	16
 
-	if ((ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == 0) && (16 == fb_var->bits_per_pixel)) {
-		log_msg(lg, "Switched to a 16bpp mode");
-		return 1;
-	} else {
-		log_msg(lg, "Failed to switch to a 16bpp mode, giving up");
+/* Copy 'n' pixels of backbuffer column to videomemory row */
+static inline void fb_column_to_row_32(char *d, const char *s, int sstep,
+		int n)
+{
+	for (; n > 0; n--) {
+		FB_COPY_32(d, s);
+		d += 4;
+		s += sstep;
 	}
+}
 
-	return 0;
+static inline void fb_column_to_row_24(char *d, const char *s, int sstep,
+		int n)
+{
+	for (; n > 0; n--) {
+		FB_COPY_24(d, s);
+		d += 3;
+		s += sstep;
+	}
 }
 
-#ifdef DEBUG
-void print_fb()
+static inline void fb_column_to_row_16(char *d, const char *s, int sstep,
+		int n)
 {
-	log_msg(lg, "Framebuffer structure");
-	log_msg(lg, "Descriptor: %d", fb.fd);
-	log_msg(lg, "Type: %d", fb.type);
-	log_msg(lg, "Visual: %d", fb.visual);
-	log_msg(lg, "Width: %d, height: %d", fb.width, fb.height);
-	log_msg(lg, "Real width: %d, real height: %d", fb.real_width, fb.real_height);
-	log_msg(lg, "BPP: %d, depth: %d", fb.bpp, fb.depth);
-	log_msg(lg, "Stride: %d", fb.stride);
+	/* Join pixels pairs into 32-bit transfers */
+	union {
+		uint32_t w;
+		uint16_t h[2];
+	} u;
+
+	if ( (n > 0) && ((unsigned long)d & 2) ) {
+		FB_COPY_16(d, s);
+		d += 2;
+		s += sstep;
+		--n;
+	}
+	for (; n > 1; n -= 2) {
+		u.h[0] = *(const uint16_t *)s;
+		u.h[1] = *(const uint16_t *)(s + sstep);
+		*(uint32_t *)d = u.w;
+		d += 4;
+		s += 2 * sstep;
+	}
+	for (; n > 0; n--) {
+		FB_COPY_16(d, s);
+		d += 2;
+		s += sstep;
+	}
+}
 
-	log_msg(lg, "Screensize: %d", fb.screensize);
-	log_msg(lg, "Angle: %d", fb.angle);
+static inline void fb_column_to_row_8(char *d, const char *s, int sstep,
+		int n)
+{
+	/* Join 4 pixels into 32-bit transfers */
+	union {
+		uint32_t w;
+		char b[4];
+	} u;
+
+	for (; (n > 0) && ((unsigned long)d & 3); n--) {
+		FB_COPY_8(d, s);
+		d++;
+		s += sstep;
+	}
+	for (; n > 3; n -= 4) {
+		u.b[0] = s[0];
+		u.b[1] = s[sstep];
+		u.b[2] = s[2 * sstep];
+		u.b[3] = s[3 * sstep];
+		*(uint32_t *)d = u.w;
+		d += 4;
+		s += 4 * sstep;
+	}
+	for (; n > 0; n--) {
+		FB_COPY_8(d, s);
+		d++;
+		s += sstep;
+	}
+}
 
-	log_msg(lg, "RGBmode: %d", fb.rgbmode);
-	log_msg(lg, "Red offset: %d, red length: %d", fb.red_offset, fb.red_length);
-	log_msg(lg, "Green offset: %d, green length: %d", fb.green_offset, fb.green_length);
-	log_msg(lg, "Blue offset: %d, blue length: %d", fb.blue_offset, fb.blue_length);
+/*
+ * Rotated pixels are stored to videomemory in place when every store is
+ * as wide as fb.copy_width: 32bpp rows and 16/8bpp rows joined into
+ * aligned 32-bit words. Other rows are rotated into scratch and written
+ * by copy engine
+ */
+#define FB_DEFINE_ROTATE(bits, B) \
+static void fb_rotate_rect_##bits(kx_rect *r, char *dst) \
+{ \
+	int tx, ty, tw, th, x, sstep; \
+	const int narrow = (0 != (B) % fb.copy_width); \
+	uint32_t row[FB_ROTATE_TILE + 2], buf[FB_ROTATE_TILE + 4]; \
+	const char *s; \
+	char *d; \
+\
+	for (ty = r->y; ty < r->y + r->height; ty += FB_ROTATE_TILE) { \
+		th = r->y + r->height - ty; \
+		if (th > FB_ROTATE_TILE) th = FB_ROTATE_TILE; \
+\
+		for (tx = r->x; tx < r->x + r->width; tx += FB_ROTATE_TILE) { \
+			tw = r->x + r->width - tx; \
+			if (tw > FB_ROTATE_TILE) tw = FB_ROTATE_TILE; \
+\
+			for (x = tx; x < tx + tw; x++) { \
+				if (90 == fb.angle) { \
+					d = dst + (fb.real_height - x - 1) * fb.stride \
+							+ ty * (B); \
+					s = fb.screen.pixels + ty * fb.screen.stride \
+							+ x * (B); \
+					sstep = fb.screen.stride; \
+				} else { \
+					d = dst + x * fb.stride \
+							+ (fb.real_width - ty - th) * (B); \
+					s = fb.screen.pixels \
+							+ (ty + th - 1) * fb.screen.stride + x * (B); \
+					sstep = -fb.screen.stride; \
+				} \
+				if ( narrow && ( (3 == (B)) \
+						|| (0 != (((unsigned long)d | (th * (B))) & 3)) ) ) \
+				{ \
+					fb_column_to_row_##bits((char *)row, s, sstep, th); \
+					fb_put_span(d, (char *)row, th * (B), (char *)buf); \
+				} else { \
+					fb_column_to_row_##bits(d, s, sstep, th); \
+				} \
+			} \
+		} \
+	} \
 }
+
+#ifdef USE_32BPP
+FB_DEFINE_ROTATE(32, 4)
+#endif
+#if defined(USE_24BPP) || defined(USE_18BPP)
+FB_DEFINE_ROTATE(24, 3)
+#endif
+#ifdef USE_16BPP
+FB_DEFINE_ROTATE(16, 2)
 #endif
+#ifdef USE_8BPP
+FB_DEFINE_ROTATE(8, 1)
+#endif
+#endif	/* USE_FB_ROTATE */
 
-int fb_new(int angle)
+/* Primitives of pixel format for 4 angles. Return NULL if unsupported */
+static const kx_primitives *fb_format_primitives(const kx_pixel_format *f)
 {
-	struct fb_var_screeninfo fb_var;
-	struct fb_fix_screeninfo fb_fix;
-	int off;
-	char *fbdev;
+	switch (f->depth) {
+#ifdef USE_32BPP
+	case 32:
+		return f->generic ? fb_primitives_any_32 : fb_primitives_32;
+#endif
+#ifdef USE_24BPP
+	case 24:
+		return f->generic ? fb_primitives_any_24 : fb_primitives_24;
+#endif
+#ifdef USE_18BPP
+	case 18:
+		return fb_primitives_any_24;
+#endif
+#ifdef USE_16BPP
+	case 16:
+		return f->generic ? fb_primitives_any_16 : fb_primitives_16;
+#endif
+#ifdef USE_8BPP
+	case 8:
+		return fb_primitives_8;
+#endif
+	default:
+		return NULL;
+	}
+}
 
-	fbdev = getenv("FBDEV");
-	if (fbdev == NULL)
-		fbdev = "/dev/fb0";
+/* Choose primitives for current depth. Return -1 if unsupported */
+static int fb_select_primitives()
+{
+	fb.primitives = fb_format_primitives(&fb.format);
+	if (NULL == fb.primitives) return -1;
 
-	memset(&fb, 0, sizeof(FB));
+#ifdef USE_FB_ROTATE
+	switch (fb.format.byte_pp) {
+#ifdef USE_32BPP
+	case 4:
+		fb.rotate_rect = fb_rotate_rect_32;
+		break;
+#endif
+#if defined(USE_24BPP) || defined(USE_18BPP)
+	case 3:
+		fb.rotate_rect = fb_rotate_rect_24;
+		break;
+#endif
+#ifdef USE_16BPP
+	case 2:
+		fb.rotate_rect = fb_rotate_rect_16;
+		break;
+#endif
+#ifdef USE_8BPP
+	case 1:
+		fb.rotate_rect = fb_rotate_rect_8;
+		break;
+#endif
+	}
+#endif
 
-	fb.fd = -1;
+	return 0;
+}
 
-	if ((fb.fd = open(fbdev, O_RDWR)) < 0) {
-		log_msg(lg, "Error opening /dev/fb0: %s", ERRMSG);
-		goto fail;
+/* Primitives of format 'p' drawing with given angle */
+static const kx_primitives *fb_angle_primitives(const kx_primitives *p,
+		int angle)
+{
+	switch (angle) {
+	case 90:
+		return p + 1;
+	case 180:
+		return p + 2;
+	case 270:
+		return p + 3;
+	default:
+		return p;
+	}
+}
+
+/**************************************************************************
+ * RAM-to-FB copy engines.
+ * NOTE: klibc uses 8bit transfers that breaks image on tosa
+ * So we will use own memcpy. Transfers narrower than fb.copy_width are
+ * never used. Callers pass pointers and length aligned to fb.copy_width
+ * or use fb_put_span(). Frames reach videomemory through engines. Only
+ * rotated mirrors, clearing of mirrors and drawing into hidden page when
+ * fb.copy_width is 1 store pixels by primitives.
+ */
+
+static void fb_copy_8(char *src, char *dst, int length)
+{
+	while (length--) *(dst++) = *(src++);
+}
+
+static void fb_copy_16(char *src, char *dst, int length)
+{
+	uint16_t *s = (uint16_t *)src, *d = (uint16_t *)dst;
+	int n = length >> 1;
+
+	while (n--) *(d++) = *(s++);
+}
+
+static void fb_copy_32(char *src, char *dst, int length)
+{
+	uint32_t *s = (uint32_t *)src, *d = (uint32_t *)dst;
+	int n = length >> 2;
+
+	while (n--) *(d++) = *(s++);
+}
+
+/* Copy by narrowest safe transfers. Used for heads and tails */
+static void fb_copy_safe(char *src, char *dst, int length)
+{
+	switch (fb.copy_width) {
+	case 1:
+		fb_copy_8(src, dst, length);
+		break;
+	case 2:
+		fb_copy_16(src, dst, length);
+		break;
+	default:
+		fb_copy_32(src, dst, length);
+		break;
+	}
+}
+
+/* Copy safe head of buffer until 'dst' is aligned to 'align' bytes.
+ * Return count of copied bytes */
+static inline int fb_copy_head(char *src, char *dst, int length, int align)
+{
+	int n = (-(unsigned long)dst) & (align - 1);
+
+	if (n > length) n = length;
+	fb_copy_safe(src, dst, n);
+	return n;
+}
+
+/* 32-byte bursts of 32-bit words */
+static void fb_copy_burst32(char *src, char *dst, int length)
+{
+	uint32_t *s, *d;
+	int n;
+
+	if (((unsigned long)src ^ (unsigned long)dst) & 3) {
+		fb_copy_safe(src, dst, length);
+		return;
+	}
+
+	n = fb_copy_head(src, dst, length, 4);
+	s = (uint32_t *)(src + n);
+	d = (uint32_t *)(dst + n);
+	length -= n;
+
+	for (; length >= 32; length -= 32) {
+		d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; d[3] = s[3];
+		d[4] = s[4]; d[5] = s[5]; d[6] = s[6]; d[7] = s[7];
+		s += 8;
+		d += 8;
+	}
+
+	fb_copy_safe((char *)s, (char *)d, length);
+}
+
+/* 32-byte bursts of 64-bit words */
+static void fb_copy_burst64(char *src, char *dst, int length)
+{
+	fb_wide_t *s, *d;
+	int n;
+
+	if (((unsigned long)src ^ (unsigned long)dst) & 7) {
+		fb_copy_burst32(src, dst, length);
+		return;
+	}
+
+	n = fb_copy_head(src, dst, length, 8);
+	s = (fb_wide_t *)(src + n);
+	d = (fb_wide_t *)(dst + n);
+	length -= n;
+
+	for (; length >= 32; length -= 32) {
+		d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; d[3] = s[3];
+		s += 4;
+		d += 4;
+	}
+
+	fb_copy_safe((char *)s, (char *)d, length);
+}
+
+#ifdef __SSE2__
+/* Streaming stores bypass cache. Good for write-combined videomemory */
+static void fb_copy_sse2(char *src, char *dst, int length)
+{
+	__m128i *d;
+	int n;
+
+	n = fb_copy_head(src, dst, length, 16);
+	src += n;
+	d = (__m128i *)(dst + n);
+	length -= n;
+
+	for (; length >= 64; length -= 64) {
+		_mm_stream_si128(d, _mm_loadu_si128((__m128i *)src));
+		_mm_stream_si128(d + 1, _mm_loadu_si128((__m128i *)src + 1));
+		_mm_stream_si128(d + 2, _mm_loadu_si128((__m128i *)src + 2));
+		_mm_stream_si128(d + 3, _mm_loadu_si128((__m128i *)src + 3));
+		src += 64;
+		d += 4;
+	}
+	_mm_sfence();
+
+	fb_copy_safe(src, (char *)d, length);
+}
+#endif
+
+struct fb_copy_engine_t {
+	const char *name;
+	int width;		/* Narrowest transfer in bytes */
+	copy_mem_func copy;
+};
+
+static const struct fb_copy_engine_t fb_copy_engines[] = {
+	{ "8", 1, fb_copy_8 },
+	{ "16", 2, fb_copy_16 },
+	{ "32", 4, fb_copy_32 },
+	{ "burst32", 4, fb_copy_burst32 },
+	{ "burst64", 4, fb_copy_burst64 },
+#ifdef __SSE2__
+	{ "sse2", 4, fb_copy_sse2 },
+#endif
+	{ NULL, 0, NULL }
+};
+
+/* Bytes copied by every engine during calibration */
+#define FB_CALIBRATE_SIZE	(64 * 1024)
+
+/*
+ * Choose RAM-to-FB copy engine. Engine may be forced by FBCOPY variable
+ * (can be passed on kernel cmdline). Otherwise every safe engine copies
+ * part of shown screen to itself and fastest one wins.
+ */
+static void fb_select_copy()
+{
+	const struct fb_copy_engine_t *e, *best;
+	unsigned long long t, min_t, best_t;
+	char *name, *scratch;
+	int size, i;
+
+	/* Wider transfers are always safe but narrower ones are not */
+	for (e = fb_copy_engines; e->width < fb.copy_width; e++);
+	best = e;
+	fb.copy_mem = e->copy;
+
+	name = getenv("FBCOPY");
+	if (name) {
+		for (e = best; NULL != e->name; e++) {
+			if (!strcmp(name, e->name)) {
+				fb.copy_mem = e->copy;
+				log_msg(lg, "Copy engine: %s (forced)", e->name);
+				return;
+			}
+		}
+		log_msg(lg, "Copy engine '%s' is unknown or unsafe", name);
+	}
+
+	size = (fb.screensize < FB_CALIBRATE_SIZE) ? fb.screensize
+			: FB_CALIBRATE_SIZE;
+	scratch = malloc(size);
+	if (NULL == scratch) {
+		log_msg(lg, "Copy engine: %s", best->name);
+		return;
+	}
+
+	/* Shown image is not changed by copying it to itself */
+	fb_copy_safe(fb.data, scratch, size);
+	fb_copy_safe(scratch, fb.data, size);
+
+	best_t = 0;
+	for (e = best; NULL != e->name; e++) {
+		/* Take best of several tries to skip interruptions */
+		min_t = 0;
+		for (i = 0; i < 4; i++) {
+			t = get_time_us();
+			e->copy(scratch, fb.data, size);
+			t = get_time_us() - t;
+			if (0 == t) t = 1;
+			if ( (0 == min_t) || (t < min_t) ) min_t = t;
+		}
+
+		log_msg(lg, "+ %s: %llu MB/s", e->name, size / min_t);
+		if ( (0 == best_t) || (min_t < best_t) ) {
+			best_t = min_t;
+			best = e;
+		}
+	}
+
+	free(scratch);
+	fb.copy_mem = best->copy;
+	log_msg(lg, "Copy engine: %s, %llu MB/s", best->name, size / best_t);
+}
+
+/*
+ * Copy 'n' bytes from RAM to videomemory by copy engine. Words of
+ * fb.copy_width cut by ends of span are completed from videomemory first.
+ * 'buf' is word aligned scratch of 'n' + 2 * fb.copy_width bytes
+ */
+static void fb_put_span(char *dst, const char *src, int n, char *buf)
+{
+	const int w = fb.copy_width;
+	const int head = (unsigned long)dst & (w - 1);
+	const int length = (head + n + w - 1) & ~(w - 1);
+
+	dst -= head;
+	if (0 != head)
+		fb.copy_mem(dst, buf, w);
+	if (0 != ((head + n) & (w - 1)))
+		fb.copy_mem(dst + length - w, buf + length - w, w);
+	memcpy(buf + head, src, n);
+	fb.copy_mem(buf, dst, length);
+}
+
+/**************************************************************************
+ * Clipping and damage tracking
+ */
+
+/* Intersect rectangle with clipping one of surface. Return 0 if nothing left */
+static int fb_clip_rect(const kx_surface *s, int *x, int *y,
+		int *width, int *height)
+{
+	const kx_rect *clip = &s->clip;
+
+	if (*x < clip->x) {
+		*width -= clip->x - *x;
+		*x = clip->x;
+	}
+	if (*y < clip->y) {
+		*height -= clip->y - *y;
+		*y = clip->y;
+	}
+	if (*x + *width > clip->x + clip->width)
+		*width = clip->x + clip->width - *x;
+	if (*y + *height > clip->y + clip->height)
+		*height = clip->y + clip->height - *y;
+
+	return ( (*width > 0) && (*height > 0) );
+}
+
+/* Convert rectangle from drawing to pixels (rotated) coordinates of surface */
+static void fb_surface_rect(const kx_surface *s, kx_rect *r)
+{
+	int t;
+
+	switch (s->angle) {
+	case 270:
+		t = r->x;
+		r->x = s->real_width - r->y - r->height;
+		r->y = t;
+		break;
+	case 180:
+		r->x = s->real_width - r->x - r->width;
+		r->y = s->real_height - r->y - r->height;
+		return;
+	case 90:
+		t = r->y;
+		r->y = s->real_height - r->x - r->width;
+		r->x = t;
+		break;
+	case 0:
+	default:
+		return;
+	}
+
+	/* Swap dimensions for 90 and 270 */
+	t = r->width;
+	r->width = r->height;
+	r->height = t;
+}
+
+#ifdef USE_FB_MIRROR
+/* Convert rectangle in pixels to surface coordinates. This is reverse
+ * of fb_surface_rect() */
+static void fb_drawing_rect(const kx_surface *s, kx_rect *r)
+{
+	int t;
+
+	switch (s->angle) {
+	case 270:
+		t = r->y;
+		r->y = s->real_width - r->x - r->width;
+		r->x = t;
+		break;
+	case 180:
+		r->x = s->real_width - r->x - r->width;
+		r->y = s->real_height - r->y - r->height;
+		return;
+	case 90:
+		t = r->x;
+		r->x = s->real_height - r->y - r->height;
+		r->y = t;
+		break;
+	case 0:
+	default:
+		return;
+	}
+
+	t = r->width;
+	r->width = r->height;
+	r->height = t;
+}
+#endif
+
+void fb_set_clip(kx_surface *s, int x, int y, int width, int height)
+{
+	s->clip.x = 0;
+	s->clip.y = 0;
+	s->clip.width = s->width;
+	s->clip.height = s->height;
+
+	/* Clipping rectangle can't exceed surface */
+	if (!fb_clip_rect(s, &x, &y, &width, &height)) {
+		width = 0;
+		height = 0;
+	}
+
+	s->clip.x = x;
+	s->clip.y = y;
+	s->clip.width = width;
+	s->clip.height = height;
+}
+
+void fb_reset_clip(kx_surface *s)
+{
+	fb_set_clip(s, 0, 0, s->width, s->height);
+}
+
+/* Check that rectangles are overlapped or adjacent */
+static inline int fb_rects_touch(kx_rect *a, kx_rect *b)
+{
+	return ( (a->x <= b->x + b->width) && (b->x <= a->x + a->width)
+		&& (a->y <= b->y + b->height) && (b->y <= a->y + a->height) );
+}
+
+/* Extend rectangle 'a' to cover rectangle 'b' too */
+static void fb_rects_union(kx_rect *a, kx_rect *b)
+{
+	int x2, y2;
+
+	x2 = a->x + a->width;
+	if (b->x + b->width > x2) x2 = b->x + b->width;
+	y2 = a->y + a->height;
+	if (b->y + b->height > y2) y2 = b->y + b->height;
+
+	if (b->x < a->x) a->x = b->x;
+	if (b->y < a->y) a->y = b->y;
+	a->width = x2 - a->x;
+	a->height = y2 - a->y;
+}
+
+void fb_damage(int x, int y, int width, int height)
+{
+	kx_rect r;
+	int i;
+
+	if (!fb_clip_rect(&fb.screen, &x, &y, &width, &height)) return;
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	fb_surface_rect(&fb.screen, &r);
+
+	/* Merge with touched rectangles. Repeat because union may grow */
+	i = 0;
+	while (i < fb.damage_count) {
+		if (fb_rects_touch(&r, &fb.damage[i])) {
+			fb_rects_union(&r, &fb.damage[i]);
+			fb.damage[i] = fb.damage[--fb.damage_count];
+			i = 0;
+		} else {
+			++i;
+		}
+	}
+
+	/* No free place. Collapse everything into one rectangle */
+	if (FB_MAX_DAMAGE == fb.damage_count) {
+		for (i = 0; i < fb.damage_count; i++)
+			fb_rects_union(&r, &fb.damage[i]);
+		fb.damage_count = 0;
+	}
+
+	fb.damage[fb.damage_count++] = r;
+}
+
+#ifdef USE_FB_THREADS
+/**************************************************************************
+ * Banded rendering
+ *
+ * Large passes are split into horizontal bands processed by persistent
+ * worker threads. Caller processes first band itself and waits for others.
+ */
+
+/* Maximum number of threads including caller */
+#define FB_MAX_THREADS		8
+/* Threads used automatically on multi-core systems */
+#define FB_AUTO_THREADS		4
+/* Rectangles smaller than this are processed by caller alone */
+#define FB_BAND_MIN_PIXELS	(32 * 1024)
+/* Bands start at multiples of this row count */
+#define FB_BAND_ALIGN		16
+
+/* Process 'band' of 'bands' of job described by 'arg' */
+typedef void (*fb_job_func)(void *arg, int band, int bands);
+
+struct fb_pool_t {
+	pthread_mutex_t lock;
+	pthread_cond_t start;		/* New job is posted */
+	pthread_cond_t done;		/* Last worker finished its band */
+	pthread_t workers[FB_MAX_THREADS - 1];
+	int count;			/* Threads including caller */
+	unsigned int job_no;		/* Incremented for every posted job */
+	int pending;			/* Workers still busy with current job */
+	int quit;
+	fb_job_func job;
+	void *arg;
+};
+
+static struct fb_pool_t fb_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.count = 1,
+};
+
+static void *fb_worker(void *p)
+{
+	int band = (int)(long)p;
+	unsigned int job_no = 0;	/* Job may be posted before thread starts */
+
+	pthread_mutex_lock(&fb_pool.lock);
+	for (;;) {
+		while ( (job_no == fb_pool.job_no) && !fb_pool.quit )
+			pthread_cond_wait(&fb_pool.start, &fb_pool.lock);
+		if (fb_pool.quit) break;
+		job_no = fb_pool.job_no;
+		pthread_mutex_unlock(&fb_pool.lock);
+
+		fb_pool.job(fb_pool.arg, band, fb_pool.count);
+
+		pthread_mutex_lock(&fb_pool.lock);
+		if (0 == --fb_pool.pending)
+			pthread_cond_signal(&fb_pool.done);
+	}
+	pthread_mutex_unlock(&fb_pool.lock);
+
+	return NULL;
+}
+
+/* Stop and join all workers */
+static void fb_pool_stop()
+{
+	int i;
+
+	pthread_mutex_lock(&fb_pool.lock);
+	fb_pool.quit = 1;
+	pthread_cond_broadcast(&fb_pool.start);
+	pthread_mutex_unlock(&fb_pool.lock);
+
+	for (i = 0; i < fb_pool.count - 1; i++)
+		pthread_join(fb_pool.workers[i], NULL);
+
+	fb_pool.count = 1;
+	fb_pool.quit = 0;
+}
+
+/*
+ * Start workers. Count may be forced by FBTHREADS variable. Otherwise
+ * they are used on multi-core systems when screen has more than
+ * USE_FB_THREADS pixels.
+ */
+static void fb_pool_start()
+{
+	char *p;
+	long n;
+
+	p = getenv("FBTHREADS");
+	if (p) {
+		n = strtol(p, NULL, 10);
+	} else if (fb.real_width * fb.real_height > USE_FB_THREADS) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > FB_AUTO_THREADS) n = FB_AUTO_THREADS;
+	} else {
+		n = 1;
+	}
+	if (n > FB_MAX_THREADS) n = FB_MAX_THREADS;
+
+	fb_pool.job_no = 0;
+	for (fb_pool.count = 1; fb_pool.count < n; fb_pool.count++) {
+		if (0 != pthread_create(&fb_pool.workers[fb_pool.count - 1], NULL,
+				fb_worker, (void *)(long)fb_pool.count))
+		{
+			log_msg(lg, "Can't create rendering thread");
+			break;
+		}
+	}
+
+	if (fb_pool.count > 1)
+		log_msg(lg, "Rendering by %d threads", fb_pool.count);
+}
+
+/* Run job on all threads and wait until every band is processed */
+static void fb_run_bands(fb_job_func job, void *arg)
+{
+	if (1 == fb_pool.count) {
+		job(arg, 0, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&fb_pool.lock);
+	fb_pool.job = job;
+	fb_pool.arg = arg;
+	fb_pool.pending = fb_pool.count - 1;
+	++fb_pool.job_no;
+	pthread_cond_broadcast(&fb_pool.start);
+	pthread_mutex_unlock(&fb_pool.lock);
+
+	job(arg, 0, fb_pool.count);
+
+	pthread_mutex_lock(&fb_pool.lock);
+	while (fb_pool.pending > 0)
+		pthread_cond_wait(&fb_pool.done, &fb_pool.lock);
+	pthread_mutex_unlock(&fb_pool.lock);
+}
+
+/* Take rows of 'band' of 'bands' from rectangle. Return 0 if band is empty */
+static int fb_band_rect(kx_rect *r, int band, int bands)
+{
+	int step, y;
+
+	step = (r->height + bands - 1) / bands;
+	step = (step + FB_BAND_ALIGN - 1) & ~(FB_BAND_ALIGN - 1);
+	y = band * step;
+	if (y >= r->height) return 0;
+
+	r->y += y;
+	r->height -= y;
+	if (r->height > step) r->height = step;
+	return 1;
+}
+#endif	/* USE_FB_THREADS */
+
+/* Copy one rectangle (in real coordinates) between screen sized buffers */
+static void fb_copy_rect(kx_rect *r, char *src, char *dst)
+{
+	int start, end, offset, i;
+
+	/* Align row part to RAM-to-FB transfer size */
+	start = (r->x * fb.format.byte_pp) & ~(fb.copy_width - 1);
+	end = ((r->x + r->width) * fb.format.byte_pp + fb.copy_width - 1)
+			& ~(fb.copy_width - 1);
+	if (end > fb.stride) end = fb.stride;
+
+	offset = r->y * fb.stride;
+
+	/* Whole rows can be moved at once */
+	if ( (0 == start) && (fb.stride == end) ) {
+		fb.copy_mem(src + offset, dst + offset, r->height * fb.stride);
+		return;
+	}
+
+	offset += start;
+	for (i = 0; i < r->height; i++) {
+		fb.copy_mem(src + offset, dst + offset, end - start);
+		offset += fb.stride;
+	}
+}
+
+#ifdef USE_FB_THREADS
+/* Rectangle moved to videomemory by bands */
+struct fb_present_job_t {
+	kx_rect r;
+	char *src, *dst;
+};
+
+static void fb_copy_band(void *arg, int band, int bands)
+{
+	struct fb_present_job_t *j = arg;
+	kx_rect r = j->r;
+
+	if (fb_band_rect(&r, band, bands))
+		fb_copy_rect(&r, j->src, j->dst);
+}
+#endif
+
+/* Copy changed rectangle of backbuffer to videomemory */
+static void fb_present_rect(kx_rect *r, char *src, char *dst)
+{
+#ifdef USE_FB_THREADS
+	struct fb_present_job_t j;
+
+	if ( (fb_pool.count > 1) && (r->width * r->height >= FB_BAND_MIN_PIXELS) ) {
+		j.r = *r;
+		j.src = src;
+		j.dst = dst;
+		fb_run_bands(fb_copy_band, &j);
+		return;
+	}
+#endif
+	fb_copy_rect(r, src, dst);
+}
+
+#ifdef USE_FB_PAN
+/* Check that rectangles have common pixels */
+static inline int fb_rects_overlap(kx_rect *a, kx_rect *b)
+{
+	return ( (a->x < b->x + b->width) && (b->x < a->x + a->width)
+		&& (a->y < b->y + b->height) && (b->y < a->y + a->height) );
+}
+
+/* Check that rectangle 'a' covers whole rectangle 'b' */
+static inline int fb_rect_covers(kx_rect *a, kx_rect *b)
+{
+	return ( (a->x <= b->x) && (a->y <= b->y)
+		&& (a->x + a->width >= b->x + b->width)
+		&& (a->y + a->height >= b->y + b->height) );
+}
+#endif
+
+/*
+ * Bring screen area up to date before drawing on it or reading it.
+ * In panning mode backbuffer lacks changes of last shown frame. Take them
+ * from shown page unless area will be fully overwritten ('opaque' drawing).
+ */
+static void fb_sync_screen(int x, int y, int width, int height, int opaque)
+{
+#ifdef USE_FB_PAN
+	kx_rect r;
+	int i;
+
+	if (0 == fb.stale_count) return;
+	/* Backbuffer in RAM is never shown and is always up to date */
+	if (fb.pan_copy) return;
+#ifdef USE_FB_ROTATE
+	if (fb.rotate) return;
+#endif
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	fb_surface_rect(&fb.screen, &r);
+
+	i = 0;
+	while (i < fb.stale_count) {
+		if (fb_rects_overlap(&r, &fb.stale[i])) {
+			if ( !(opaque && fb_rect_covers(&r, &fb.stale[i])) )
+				fb_copy_rect(&fb.stale[i], fb.data, fb.screen.pixels);
+			fb.stale[i] = fb.stale[--fb.stale_count];
+		} else {
+			++i;
+		}
+	}
+#endif
+}
+
+/* Prepare area of surface for drawing. Changes of screen are tracked.
+ * Return 0 when area is outside of clipping rectangle */
+static int fb_prepare_rect(kx_surface *s, int x, int y, int width,
+		int height, int opaque)
+{
+	if (!fb_clip_rect(s, &x, &y, &width, &height)) return 0;
+	if (s->screen) {
+		fb_sync_screen(x, y, width, height, opaque);
+		fb_damage(x, y, width, height);
+	}
+	return 1;
+}
+
+#ifdef USE_FB_PAN
+/* Videomemory of hidden page */
+static inline char *fb_hidden_page()
+{
+#ifdef USE_FB_DRM
+	if (fb.drm) return fb.drm_buf[fb.page ^ 1].map;
+#endif
+	return fb.data + ((fb.page ^ 1) - fb.page) * fb.screensize;
+}
+
+/* Show hidden videomemory page. Return -1 on error */
+static int fb_pan_page()
+{
+	__u32 crtc = 0;
+
+#ifdef USE_FB_DRM
+	if (fb.drm) return fb_drm_flip();
+#endif
+
+	fb.pan_var.xoffset = 0;
+	fb.pan_var.yoffset = (fb.page ^ 1) * fb.real_height;
+	if (-1 == ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.pan_var)) {
+		log_msg(lg, "Can't pan framebuffer: %s", ERRMSG);
+		return -1;
+	}
+	fb.page ^= 1;
+
+	/* Don't touch previous page until it is really hidden */
+	if (fb.vsync && (-1 == ioctl(fb.fd, FBIO_WAITFORVSYNC, &crtc))) {
+		log_msg(lg, "Can't wait for vsync, disabled: %s", ERRMSG);
+		fb.vsync = 0;
+	}
+
+	return 0;
+}
+
+/* Show backbuffer page and make shown page a new backbuffer */
+static void fb_flip()
+{
+	char *p;
+
+	/* Shown page should not have areas older than shown ones */
+	fb_sync_screen(0, 0, fb.width, fb.height, 0);
+
+	if (-1 == fb_pan_page()) return;
+
+	p = fb.data;
+	fb.data = fb.screen.pixels;
+	fb.screen.pixels = p;
+
+	/* Just shown changes are missing in new backbuffer */
+	memcpy(fb.stale, fb.damage, fb.damage_count * sizeof(*(fb.damage)));
+	fb.stale_count = fb.damage_count;
+}
+
+/* Copy changes of backbuffer in RAM into hidden page and show it */
+static void fb_flip_copy()
+{
+	char *dst = fb_hidden_page();
+	int i;
+
+	/* Hidden page lacks changes of shown one too */
+	for (i = 0; i < fb.stale_count; i++)
+		fb_present_rect(&fb.stale[i], fb.screen.pixels, dst);
+	for (i = 0; i < fb.damage_count; i++)
+		fb_present_rect(&fb.damage[i], fb.screen.pixels, dst);
+
+	if (-1 == fb_pan_page()) return;
+	fb.data = dst;
+	memcpy(fb.stale, fb.damage, fb.damage_count * sizeof(*(fb.damage)));
+	fb.stale_count = fb.damage_count;
+}
+#endif
+
+#ifdef USE_FB_ROTATE
+#ifdef USE_FB_THREADS
+static void fb_rotate_band(void *arg, int band, int bands)
+{
+	struct fb_present_job_t *j = arg;
+	kx_rect r = j->r;
+
+	if (fb_band_rect(&r, band, bands))
+		fb.rotate_rect(&r, j->dst);
+}
+#endif
+
+/* Rotate changed rectangle of backbuffer into videomemory */
+static void fb_rotate_present_rect(kx_rect *r, char *dst)
+{
+#ifdef USE_FB_THREADS
+	struct fb_present_job_t j;
+
+	/* Bands are backbuffer rows aligned to rotation tiles */
+	if ( (fb_pool.count > 1) && (r->width * r->height >= FB_BAND_MIN_PIXELS) ) {
+		j.r = *r;
+		j.dst = dst;
+		fb_run_bands(fb_rotate_band, &j);
+		return;
+	}
+#endif
+	fb.rotate_rect(r, dst);
+}
+
+/* Rotate changed parts of unrotated backbuffer into videomemory */
+static void fb_present_rotated()
+{
+	kx_rect r;
+	char *dst = fb.data;
+	int i;
+
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) {
+		/* Draw into hidden page. It lacks changes of shown one too */
+		dst = fb_hidden_page();
+		for (i = 0; i < fb.stale_count; i++) {
+			r = fb.stale[i];
+			fb_rotate_present_rect(&r, dst);
+		}
+	}
+#endif
+
+	for (i = 0; i < fb.damage_count; i++) {
+		r = fb.damage[i];
+		fb_rotate_present_rect(&r, dst);
+	}
+
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) {
+		if (-1 == fb_pan_page()) return;
+		fb.data = dst;
+		memcpy(fb.stale, fb.damage, fb.damage_count * sizeof(*(fb.damage)));
+		fb.stale_count = fb.damage_count;
+	}
+#endif
+}
+#endif
+
+/* Move changed parts of backbuffer to videomemory */
+void fb_render()
+{
+	int i;
+
+	if (0 == fb.damage_count) return;
+
+#ifdef USE_FB_MIRROR
+	/* Backbuffer is read before it is flipped */
+	fb_present_mirrors();
+#endif
+
+#ifdef USE_FB_ROTATE
+	if (fb.rotate) {
+		fb_present_rotated();
+	} else
+#endif
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) {
+		if (fb.pan_copy)
+			fb_flip_copy();
+		else
+			fb_flip();
+	} else
+#endif
+	for (i = 0; i < fb.damage_count; i++)
+		fb_present_rect(&fb.damage[i], fb.screen.pixels, fb.data);
+
+	fb.damage_count = 0;
+
+#ifdef USE_FB_MEMORY
+	/* Keep last shown frame for inspection */
+	if (fb.dump_path) fb_save_ppm(fb.dump_path);
+#endif
+}
+
+#ifdef USE_ANIMATION
+/* Wait for vertical retrace before rendering. Return -1 if it is unknown */
+int fb_wait_vsync()
+{
+	__u32 crtc = 0;
+
+#ifdef USE_FB_PAN
+	/* Pages are flipped on retrace already */
+	if (FB_PRESENT_PAN == fb.present)
+		return (fb.vsync ? 0 : -1);
+#endif
+
+	if ( (fb.fd < 0) || fb.no_vsync ) return -1;
+
+#ifdef USE_FB_DRM
+	if (fb.drm) return fb_drm_wait_vblank();
+#endif
+
+	if (-1 == ioctl(fb.fd, FBIO_WAITFORVSYNC, &crtc)) {
+		log_msg(lg, "Can't wait for vsync: %s", ERRMSG);
+		fb.no_vsync = 1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/**************************************************************************
+ * Surfaces
+ */
+
+/* Set up surface of 'width' x 'height' drawing size in framebuffer format */
+static void fb_surface_init(kx_surface *s, char *pixels, int width,
+		int height, int stride, int angle)
+{
+	s->pixels = pixels;
+	s->width = width;
+	s->height = height;
+	s->stride = stride;
+	s->angle = angle;
+	if ( (90 == angle) || (270 == angle) ) {
+		s->real_width = height;
+		s->real_height = width;
+	} else {
+		s->real_width = width;
+		s->real_height = height;
+	}
+	s->format = &fb.format;
+	s->draw = fb_angle_primitives(fb.primitives, angle);
+	s->screen = 0;
+	fb_reset_clip(s);
+}
+
+/* Create offscreen surface in framebuffer pixel format */
+kx_surface *fb_surface_new(int width, int height)
+{
+	kx_surface *s;
+	int stride, rows, angle = fb.screen.angle;
+
+	if ( (width <= 0) || (height <= 0) || (NULL == fb.primitives) )
+		return NULL;
+
+	/* Same orientation as screen allows copying rows between them */
+	if ( (90 == angle) || (270 == angle) ) {
+		stride = (height * fb.format.byte_pp + 3) & ~3;
+		rows = width;
+	} else {
+		stride = (width * fb.format.byte_pp + 3) & ~3;
+		rows = height;
+	}
+
+	s = malloc(sizeof(*s) + stride * rows);
+	if (NULL == s) {
+		DPRINTF("Can't allocate memory for surface");
+		return NULL;
+	}
+
+	fb_surface_init(s, (char *)(s + 1), width, height, stride, angle);
+	return s;
+}
+
+/* Free offscreen surface */
+void fb_surface_destroy(kx_surface *s)
+{
+	dispose(s);
+}
+
+/* Copy 'n' pixels. Backbuffer may be in videomemory so don't use memcpy */
+static void fb_copy_pixels(char *dst, const char *src, int n)
+{
+	switch (fb.format.byte_pp) {
+	case 4:
+		while (n--) {
+			FB_COPY_32(dst, src);
+			dst += 4;
+			src += 4;
+		}
+		break;
+	case 2:
+		while (n--) {
+			FB_COPY_16(dst, src);
+			dst += 2;
+			src += 2;
+		}
+		break;
+	default:
+		n *= fb.format.byte_pp;
+		while (n--) *(dst++) = *(src++);
+		break;
+	}
+}
+
+/* Read 'n' pixels of surface row starting at (x, y) into 'dst' */
+static void fb_read_span(kx_surface *s, int x, int y, int n, char *dst)
+{
+	const int B = s->format->byte_pp;
+	int offset, step;
+
+	switch (s->angle) {
+	case 90:
+		offset = FB_OFFSET_90(s, x, y, B);
+		step = FB_XSTEP_90(s, B);
+		break;
+	case 180:
+		offset = FB_OFFSET_180(s, x, y, B);
+		step = FB_XSTEP_180(s, B);
+		break;
+	case 270:
+		offset = FB_OFFSET_270(s, x, y, B);
+		step = FB_XSTEP_270(s, B);
+		break;
+	default:
+		fb_copy_pixels(dst, s->pixels + FB_OFFSET_0(s, x, y, B), n);
+		return;
+	}
+
+	for (; n > 0; n--) {
+		fb_copy_pixels(dst, s->pixels + offset, 1);
+		dst += B;
+		offset += step;
+	}
+}
+
+/* Copy rectangle between surfaces */
+void fb_blit(kx_surface *dst, int x, int y, kx_surface *src,
+		int sx, int sy, int width, int height)
+{
+	const int B = fb.format.byte_pp;
+	kx_rect sr, dr;
+	char *s, *d, *row;
+	int i, n, dx, dy, sstep, dstep;
+
+	/* Source rectangle should be inside of source surface */
+	if (sx < 0) {
+		width += sx;
+		x -= sx;
+		sx = 0;
+	}
+	if (sy < 0) {
+		height += sy;
+		y -= sy;
+		sy = 0;
+	}
+	if (sx + width > src->width) width = src->width - sx;
+	if (sy + height > src->height) height = src->height - sy;
+
+	dx = x;
+	dy = y;
+	if (!fb_clip_rect(dst, &x, &y, &width, &height)) return;
+	sx += x - dx;
+	sy += y - dy;
+
+	if (src->screen) fb_sync_screen(sx, sy, width, height, 0);
+	fb_prepare_rect(dst, x, y, width, height, 1);
+
+	/* Equally rotated surfaces have same pixels rectangles. Copy by rows */
+	sr.x = sx; sr.y = sy;
+	sr.width = width; sr.height = height;
+	fb_surface_rect(src, &sr);
+	dr.x = x; dr.y = y;
+	dr.width = width; dr.height = height;
+	fb_surface_rect(dst, &dr);
+
+	/* Pixel rows moved to other rows of same surface don't overlap */
+	if ( (src->angle == dst->angle) && ( (src != dst) || (sr.y != dr.y) ) ) {
+		s = src->pixels + sr.y * src->stride + sr.x * B;
+		d = dst->pixels + dr.y * dst->stride + dr.x * B;
+		n = sr.width * B;
+		height = sr.height;
+		sstep = src->stride;
+		dstep = dst->stride;
+
+		/* Go upwards when rows are moved down on same surface */
+		if ( (src == dst) && (dr.y > sr.y) ) {
+			s += (height - 1) * sstep;
+			d += (height - 1) * dstep;
+			sstep = -sstep;
+			dstep = -dstep;
+		}
+
+		if (0 != ( ((unsigned long)s | (unsigned long)d | n
+				| src->stride | dst->stride) & (fb.copy_width - 1) ))
+		{
+			/* Can't use RAM-to-FB engine */
+			for (; height > 0; height--) {
+				fb_copy_pixels(d, s, sr.width);
+				s += sstep;
+				d += dstep;
+			}
+			return;
+		}
+
+		if ( (src != dst) && (n == src->stride) && (n == dst->stride) ) {
+			n *= height;	/* Whole rows are copied at once */
+			height = 1;
+		}
+		for (; height > 0; height--) {
+			fb.copy_mem(s, d, n);
+			s += sstep;
+			d += dstep;
+		}
+		return;
+	}
+
+	/* Otherwise rows are read into temporary buffer first */
+	row = malloc(width * B);
+	if (NULL == row) {
+		DPRINTF("Can't allocate memory for blit row");
+		return;
+	}
+
+	for (i = 0; i < height; i++) {
+		/* Go upwards when rows are moved down on same surface */
+		dy = ( (src == dst) && (y > sy) ) ? height - 1 - i : i;
+		fb_read_span(src, sx, sy + dy, width, row);
+		dst->draw->blit_span(dst, x, y + dy, width, row);
+	}
+
+	free(row);
+}
+
+#ifdef USE_FB_THREADS
+/* Area of surface drawn by bands */
+struct fb_draw_job_t {
+	kx_surface *s;
+	kx_rect area;
+	fb_band_func draw;
+	void *arg;
+};
+
+static void fb_draw_band(void *arg, int band, int bands)
+{
+	struct fb_draw_job_t *j = arg;
+	kx_surface view = *j->s;
+	kx_rect r = j->area;
+
+	if (!fb_band_rect(&r, band, bands)) return;
+
+	/* Changes of screen are already tracked by caller */
+	view.screen = 0;
+	view.clip = r;
+	j->draw(&view, j->arg);
+}
+#endif
+
+void fb_draw_bands(kx_surface *s, int x, int y, int width, int height,
+		int opaque, fb_band_func draw, void *arg)
+{
+	kx_rect clip = s->clip;
+#ifdef USE_FB_THREADS
+	struct fb_draw_job_t j;
+#endif
+
+	if (!fb_clip_rect(s, &x, &y, &width, &height)) return;
+
+#ifdef USE_FB_THREADS
+	if ( (fb_pool.count > 1) && (width * height >= FB_BAND_MIN_PIXELS) ) {
+		fb_prepare_rect(s, x, y, width, height, opaque);
+		j.s = s;
+		j.area.x = x;
+		j.area.y = y;
+		j.area.width = width;
+		j.area.height = height;
+		j.draw = draw;
+		j.arg = arg;
+		fb_run_bands(fb_draw_band, &j);
+		return;
+	}
+#endif
+
+	fb_set_clip(s, x, y, width, height);
+	draw(s, arg);
+	s->clip = clip;
+}
+
+
+/**************************************************************************
+ * Layers
+ *
+ * Every pixel row of layer is a list of runs. Run starts with header word
+ * holding its length. Fill run has one more word with composed color.
+ * Literal run (FB_LAYER_LITERAL flag) is followed by its native pixels
+ * padded to whole words.
+ */
+
+#define FB_LAYER_LITERAL	0x80000000U
+/* Shorter runs of equal pixels are kept in literal runs */
+#define FB_LAYER_MIN_FILL	8
+
+/* Load composed color of native pixel */
+static inline uint32_t fb_load_pixel(const char *p, int byte_pp)
+{
+	switch (byte_pp) {
+	case 4:
+		return FB_LOAD_32(p);
+	case 3:
+		return FB_LOAD_24(p);
+	case 1:
+		return FB_LOAD_8(p);
+	default:
+		return FB_LOAD_16(p);
+	}
+}
+
+/* Store composed color to pixel in native format */
+static inline void fb_store_pixel(char *p, kx_rgba color, int byte_pp)
+{
+	switch (byte_pp) {
+	case 4:
+		FB_STORE_32(p, color);
+		break;
+	case 3:
+		FB_STORE_24(p, color);
+		break;
+	case 1:
+		FB_STORE_8(p, color);
+		break;
+	default:
+		FB_STORE_16(p, color);
+		break;
+	}
+}
+
+/* Fill 'n' pixels at 'p' by composed color */
+static inline void fb_fill_pixels(char *p, uint32_t c, int n, int byte_pp)
+{
+	switch (byte_pp) {
+	case 4:
+		fb_fill_32(p, c, n);
+		break;
+	case 3:
+		fb_fill_24(p, c, n);
+		break;
+	case 1:
+		fb_fill_8(p, c, n);
+		break;
+	default:
+		fb_fill_16(p, c, n);
+		break;
+	}
+}
+
+/* Encode 'n' native pixels into runs. Return number of used words */
+static int fb_layer_encode(const char *p, int n, int byte_pp, uint32_t *out)
+{
+	int i, j, k, lit, count;
+	uint32_t c;
+	char *bytes;
+
+	k = 0;
+	lit = -1;	/* Index of open literal run */
+	count = 0;
+	for (i = 0; i < n; i = j) {
+		c = fb_load_pixel(p + i * byte_pp, byte_pp);
+		for (j = i + 1; (j < n)
+				&& (fb_load_pixel(p + j * byte_pp, byte_pp) == c); j++);
+
+		if (j - i >= FB_LAYER_MIN_FILL) {
+			if (lit >= 0) {
+				k = lit + 1 + (count * byte_pp + 3) / 4;
+				lit = -1;
+			}
+			out[k++] = j - i;
+			out[k++] = c;
+			continue;
+		}
+
+		if (lit < 0) {
+			lit = k;
+			count = 0;
+		}
+		bytes = (char *)(out + lit + 1);
+		memcpy(bytes + count * byte_pp, p + i * byte_pp, (j - i) * byte_pp);
+		count += j - i;
+		out[lit] = FB_LAYER_LITERAL | count;
+	}
+
+	if (lit >= 0) {
+		/* Padding is zeroed so equal rows have equal words */
+		bytes = (char *)(out + lit + 1);
+		for (i = count * byte_pp; i & 3; i++) bytes[i] = 0;
+		k = lit + 1 + (count * byte_pp + 3) / 4;
+	}
+
+	return k;
+}
+
+kx_layer *fb_layer_new(kx_surface *s)
+{
+	const int B = s->format->byte_pp;
+	kx_layer *l;
+	uint32_t *buf;
+	int y, n, prev_n = 0;
+
+	l = malloc(sizeof(*l));
+	if (NULL == l) {
+		DPRINTF("Can't allocate layer");
+		return NULL;
+	}
+
+	l->width = s->width;
+	l->height = s->height;
+	l->angle = s->angle;
+	l->real_width = s->real_width;
+	l->real_height = s->real_height;
+	l->rows = malloc(s->real_height * sizeof(*(l->rows)));
+	l->size = sizeof(*l) + s->real_height * sizeof(*(l->rows));
+
+	/* Worst case is literal run after every fill run */
+	buf = malloc((3 * s->real_width + 2) * sizeof(*buf));
+	if ( (NULL == l->rows) || (NULL == buf) ) {
+		DPRINTF("Can't allocate layer rows");
+		dispose(buf);
+		dispose(l->rows);
+		free(l);
+		return NULL;
+	}
+
+	if (s->screen) fb_sync_screen(0, 0, s->width, s->height, 0);
+
+	for (y = 0; y < s->real_height; y++) {
+		n = fb_layer_encode(s->pixels + y * s->stride, s->real_width, B, buf);
+
+		/* Equal neighbour rows share runs */
+		if ( (y > 0) && (n == prev_n)
+				&& !memcmp(l->rows[y - 1], buf, n * sizeof(*buf)) )
+		{
+			l->rows[y] = l->rows[y - 1];
+			continue;
+		}
+
+		l->rows[y] = malloc(n * sizeof(*buf));
+		if (NULL == l->rows[y]) {
+			DPRINTF("Can't allocate layer row");
+			l->real_height = y;
+			fb_layer_destroy(l);
+			free(buf);
+			return NULL;
+		}
+		memcpy(l->rows[y], buf, n * sizeof(*buf));
+		l->size += n * sizeof(*buf);
+		prev_n = n;
+	}
+
+	free(buf);
+	return l;
+}
+
+void fb_layer_destroy(kx_layer *l)
+{
+	int y;
+
+	if (NULL == l) return;
+
+	for (y = 0; y < l->real_height; y++) {
+		if ( (0 == y) || (l->rows[y] != l->rows[y - 1]) )
+			free(l->rows[y]);
+	}
+	free(l->rows);
+	free(l);
+}
+
+void fb_draw_layer(kx_surface *s, kx_layer *l, int x, int y, int width,
+		int height)
+{
+	const int B = s->format->byte_pp;
+	const uint32_t *w;
+	kx_rect r;
+	char *d;
+	int i, px, n, a, b;
+
+	if ( (NULL == l) || (l->angle != s->angle) || (l->width != s->width)
+			|| (l->height != s->height) )
+		return;
+
+	if (!fb_clip_rect(s, &x, &y, &width, &height)) return;
+	fb_prepare_rect(s, x, y, width, height, 1);
+
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	fb_surface_rect(s, &r);
+
+	for (i = r.y; i < r.y + r.height; i++) {
+		d = s->pixels + i * s->stride;
+		w = l->rows[i];
+		for (px = 0; px < r.x + r.width; px += n) {
+			n = w[0] & ~FB_LAYER_LITERAL;
+
+			/* Part of run inside of rectangle */
+			a = (px > r.x) ? px : r.x;
+			b = (px + n < r.x + r.width) ? px + n : r.x + r.width;
+
+			if (w[0] & FB_LAYER_LITERAL) {
+				if (a < b)
+					fb_copy_pixels(d + a * B,
+							(const char *)(w + 1) + (a - px) * B, b - a);
+				w += 1 + (n * B + 3) / 4;
+			} else {
+				if (a < b) fb_fill_pixels(d + a * B, w[1], b - a, B);
+				w += 2;
+			}
+		}
+	}
+}
+
+#ifdef USE_SPLASH
+/* Packed layer starts with header. Palette and rows follow it. Every row is
+ * count of words and its runs. Zero count repeats previous row */
+#define FB_LAYER_MAGIC		"KXLAYER1"
+
+struct fb_layer_header_t {
+	char magic[8];
+	int32_t width, height;		/* Screen size in drawing coordinates */
+	int32_t real_width, real_height;
+	int32_t angle;			/* Orientation of layer pixels */
+	int32_t rotation;		/* Rotation of screen */
+	int32_t bpp;
+	uint32_t mask[3];		/* Bits of red, green and blue */
+	int32_t palette_size;	/* Palette entries following header */
+};
+
+/* Count words of row runs covering 'width' pixels. Return -1 when runs
+ * don't fit into 'max' words */
+static int fb_layer_row_words(const uint32_t *w, int width, int byte_pp,
+		int max)
+{
+	int px, n, k = 0;
+
+	for (px = 0; px < width; px += n) {
+		if (k >= max) return -1;
+		n = w[k] & ~FB_LAYER_LITERAL;
+		if ( (0 == n) || (n > width - px) ) return -1;
+		if (w[k] & FB_LAYER_LITERAL)
+			k += 1 + (n * byte_pp + 3) / 4;
+		else
+			k += 2;
+	}
+
+	return (k > max) ? -1 : k;
+}
+
+char *fb_layer_pack(kx_layer *l, int *size)
+{
+	const int B = fb.format.byte_pp;
+	struct fb_layer_header_t *h;
+	uint32_t *w;
+	char *data;
+	int y, n, len;
+
+	/* Header, palette and row counts */
+	len = sizeof(*h) + l->real_height * sizeof(uint32_t);
+#ifdef USE_8BPP
+	if (FB_CONVERT_PALETTE == fb.format.convert)
+		len += fb.format.palette_size * sizeof(uint32_t);
+#endif
+	for (y = 0; y < l->real_height; y++) {
+		if ( (y > 0) && (l->rows[y] == l->rows[y - 1]) ) continue;
+		len += fb_layer_row_words(l->rows[y], l->real_width, B,
+				3 * l->real_width + 2)
+				* sizeof(uint32_t);
+	}
+
+	data = malloc(len);
+	if (NULL == data) {
+		DPRINTF("Can't allocate memory for packed layer");
+		return NULL;
+	}
+
+	h = (struct fb_layer_header_t *)data;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, FB_LAYER_MAGIC, sizeof(h->magic));
+	h->width = l->width;
+	h->height = l->height;
+	h->real_width = l->real_width;
+	h->real_height = l->real_height;
+	h->angle = l->angle;
+	h->rotation = fb.angle;
+	h->bpp = fb.format.bpp;
+	memcpy(h->mask, fb.format.mask, sizeof(h->mask));
+
+	w = (uint32_t *)(h + 1);
+#ifdef USE_8BPP
+	/* Indexes have meaning only with their palette */
+	if (FB_CONVERT_PALETTE == fb.format.convert) {
+		h->palette_size = fb.format.palette_size;
+		memcpy(w, fb.format.palette, h->palette_size * sizeof(*w));
+		w += h->palette_size;
+	}
+#endif
+
+	for (y = 0; y < l->real_height; y++) {
+		if ( (y > 0) && (l->rows[y] == l->rows[y - 1]) ) {
+			*(w++) = 0;
+			continue;
+		}
+		n = fb_layer_row_words(l->rows[y], l->real_width, B,
+				3 * l->real_width + 2);
+		*(w++) = n;
+		memcpy(w, l->rows[y], n * sizeof(*w));
+		w += n;
+	}
+
+	*size = len;
+	return data;
+}
+
+kx_layer *fb_layer_unpack(const char *data, int size)
+{
+	const int B = fb.format.byte_pp;
+	const struct fb_layer_header_t *h = (const struct fb_layer_header_t *)data;
+	const uint32_t *w, *end;
+#ifdef USE_8BPP
+	const uint32_t *palette;
+#endif
+	kx_layer *l;
+	int y, n;
+
+	if ( (size < (int)sizeof(*h))
+			|| memcmp(h->magic, FB_LAYER_MAGIC, sizeof(h->magic)) )
+	{
+		log_msg(lg, "Packed layer is damaged");
+		return NULL;
+	}
+
+	if ( (h->width != fb.screen.width) || (h->height != fb.screen.height)
+			|| (h->real_width != fb.screen.real_width)
+			|| (h->real_height != fb.screen.real_height)
+			|| (h->angle != fb.screen.angle) || (h->rotation != fb.angle)
+			|| (h->bpp != fb.format.bpp)
+			|| memcmp(h->mask, fb.format.mask, sizeof(h->mask)) )
+	{
+		log_msg(lg, "Packed layer is made for other screen (%dx%d, %d bpp, angle %d)",
+				h->width, h->height, h->bpp, h->rotation);
+		return NULL;
+	}
+
+	w = (const uint32_t *)(h + 1);
+	end = (const uint32_t *)(data + size);
+	if ( (h->palette_size < 0) || (h->palette_size > end - w) ) {
+		log_msg(lg, "Packed layer is damaged");
+		return NULL;
+	}
+#ifdef USE_8BPP
+	if ( (FB_CONVERT_PALETTE == fb.format.convert)
+			&& ( (h->palette_size <= 0) || (h->palette_size > 256) ) )
+	{
+		log_msg(lg, "Packed layer is made for other screen (palette)");
+		return NULL;
+	}
+	palette = w;
+	if ( (FB_CONVERT_PALETTE != fb.format.convert) && (h->palette_size > 0) ) {
+#else
+	if (h->palette_size > 0) {
+#endif
+		log_msg(lg, "Packed layer is made for other screen (palette)");
+		return NULL;
+	}
+	w += h->palette_size;
+
+	l = malloc(sizeof(*l));
+	if (NULL == l) {
+		DPRINTF("Can't allocate layer");
+		return NULL;
+	}
+	l->width = h->width;
+	l->height = h->height;
+	l->angle = h->angle;
+	l->real_width = h->real_width;
+	l->real_height = 0;
+	l->rows = malloc(h->real_height * sizeof(*(l->rows)));
+	l->size = sizeof(*l) + h->real_height * sizeof(*(l->rows));
+	if (NULL == l->rows) {
+		DPRINTF("Can't allocate layer rows");
+		free(l);
+		return NULL;
+	}
+
+	for (y = 0; y < h->real_height; y++) {
+		if (w >= end) goto damaged;
+		n = *(w++);
+
+		if (0 == n) {
+			if (0 == y) goto damaged;
+			l->rows[y] = l->rows[y - 1];
+			l->real_height = y + 1;
+			continue;
+		}
+
+		/* Runs should cover row exactly */
+		if ( (n < 0) || (n > end - w)
+				|| (fb_layer_row_words(w, l->real_width, B, n) != n) )
+			goto damaged;
+
+		l->rows[y] = malloc(n * sizeof(*w));
+		if (NULL == l->rows[y]) {
+			DPRINTF("Can't allocate layer row");
+			fb_layer_destroy(l);
+			return NULL;
+		}
+		memcpy(l->rows[y], w, n * sizeof(*w));
+		l->size += n * sizeof(*w);
+		l->real_height = y + 1;
+		w += n;
+	}
+
+#ifdef USE_8BPP
+	/* Indexes of layer are valid with saved palette only */
+	if (FB_CONVERT_PALETTE == fb.format.convert)
+		fb_set_palette(palette, h->palette_size);
+#endif
+
+	return l;
+
+damaged:
+	log_msg(lg, "Packed layer is damaged");
+	fb_layer_destroy(l);
+	return NULL;
+}
+#endif
+
+void fb_destroy()
+{
+#ifdef USE_FB_THREADS
+	fb_pool_stop();
+#endif
+	fb_glyph_cache_flush();
+#ifdef USE_FB_MIRROR
+	fb_close_mirrors();
+#endif
+#ifdef USE_FB_DRM
+	/* Shows previous picture and unmaps pages */
+	if (fb.drm) fb_drm_close();
+#endif
+
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) {
+		/* Return to first page */
+		if (0 != fb.page) {
+			fb.pan_var.yoffset = 0;
+			ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.pan_var);
+		}
+		/* Backbuffer in videomemory is not freed */
+		if (fb.pan_copy) free(fb.screen.pixels);
+#ifdef USE_FB_ROTATE
+		else if (fb.rotate) free(fb.screen.pixels);	/* Unrotated one is in RAM */
+#endif
+		fb.screen.pixels = NULL;
+		fb.pan_copy = 0;
+	}
+#endif
+	if (fb.fd >= 0)
+		close(fb.fd);
+#ifdef USE_FB_MEMORY
+	else if (fb.base)
+		free(fb.base);	/* Memory framebuffer */
+	fb.base = NULL;
+#endif
+	if(fb.screen.pixels)
+		free(fb.screen.pixels);
+	fb.screen.pixels = NULL;
+	fb.primitives = NULL;
+#ifdef USE_8BPP
+	dispose(fb.format.nearest);
+	fb.format.nearest = NULL;
+#endif
+}
+
+#if defined(USE_FB_MEMORY) || defined(USE_FB_MIRROR)
+/* Scale channel of pixel to 8 bits */
+static inline unsigned char fb_channel_value(uint32_t v, int offset, int length)
+{
+	v = (v >> offset) & ((1U << length) - 1);
+	return (length > 8) ? v >> (length - 8) : v << (8 - length);
+}
+
+/* RGBA color of composed pixel value. This is reverse of compose_color() */
+static kx_rgba fb_pixel_color(const kx_pixel_format *f, uint32_t v)
+{
+#ifdef USE_8BPP
+	if (FB_CONVERT_PALETTE == f->convert)
+		return f->palette[v & 0xFF] << 8;
+#endif
+	return comp2rgba(fb_channel_value(v, f->offset[0], f->length[0]),
+			fb_channel_value(v, f->offset[1], f->length[1]),
+			fb_channel_value(v, f->offset[2], f->length[2]), 0);
+}
+#endif
+
+#ifdef USE_FB_MEMORY
+/* Save pixels of 'f' format to PPM file */
+static int fb_save_pixels(const char *path, const char *data, int width,
+		int height, int stride, const kx_pixel_format *fmt)
+{
+	FILE *f;
+	unsigned char *row;
+	kx_rgba c;
+	int x, y;
+
+	row = malloc(width * 3);
+	if (NULL == row) {
+		DPRINTF("Can't allocate memory for PPM row");
+		return -1;
+	}
+
+	f = fopen(path, "w");
+	if (NULL == f) {
+		log_msg(lg, "Can't open '%s': %s", path, ERRMSG);
+		free(row);
+		return -1;
+	}
+
+	fprintf(f, "P6\n%d %d\n255\n", width, height);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			c = fb_pixel_color(fmt, fb_load_pixel(data + y * stride
+					+ x * fmt->byte_pp, fmt->byte_pp));
+			row[x * 3] = c >> 24;
+			row[x * 3 + 1] = c >> 16;
+			row[x * 3 + 2] = c >> 8;
+		}
+		fwrite(row, 3, width, f);
+	}
+
+	fclose(f);
+	free(row);
+	return 0;
+}
+
+/* Save shown framebuffer contents to PPM file */
+int fb_save_ppm(const char *path)
+{
+	return fb_save_pixels(path, fb.data, fb.real_width, fb.real_height,
+			fb.stride, &fb.format);
+}
+#endif
+
+#ifdef USE_FB_PAN
+/* Ask for second page in videomemory and check that panning works.
+ * Return 1 when panning may be used. Otherwise screen mode is left as
+ * it was */
+static int fb_setup_pan(struct fb_var_screeninfo *fb_var,
+		struct fb_fix_screeninfo *fb_fix)
+{
+	struct fb_var_screeninfo var, orig_var = *fb_var;
+	struct fb_fix_screeninfo orig_fix = *fb_fix;
+	int changed = 0;
+
+	if (fb_var->yres_virtual < 2 * fb_var->yres) {
+		var = *fb_var;
+		var.yres_virtual = 2 * var.yres;
+		var.xoffset = 0;
+		var.yoffset = 0;
+		if (-1 == ioctl(fb.fd, FBIOPUT_VSCREENINFO, &var)) {
+			log_msg(lg, "Can't set double virtual height: %s", ERRMSG);
+			return 0;
+		}
+		changed = 1;
+
+		/* Driver may adjust anything. Reread all info */
+		if ( (-1 == ioctl(fb.fd, FBIOGET_VSCREENINFO, fb_var))
+			|| (-1 == ioctl(fb.fd, FBIOGET_FSCREENINFO, fb_fix)) )
+		{
+			log_msg(lg, "Error getting framebuffer info: %s", ERRMSG);
+			goto restore;
+		}
+	}
+
+	if ( (fb_var->yres_virtual < 2 * fb_var->yres)
+		|| (fb_fix->smem_len < 2 * fb_fix->line_length * fb_var->yres) )
+	{
+		log_msg(lg, "No room for second framebuffer page");
+		goto restore;
+	}
+
+	if ( (0 == fb_fix->ypanstep) || (0 != fb_var->yres % fb_fix->ypanstep) ) {
+		log_msg(lg, "Framebuffer can't be panned by page height");
+		goto restore;
+	}
+
+	/* Check that panning really works */
+	fb.pan_var = *fb_var;
+	fb.pan_var.xoffset = 0;
+	fb.pan_var.yoffset = 0;
+	if (-1 == ioctl(fb.fd, FBIOPAN_DISPLAY, &fb.pan_var)) {
+		log_msg(lg, "Framebuffer panning is not supported: %s", ERRMSG);
+		goto restore;
+	}
+
+	return 1;
+
+restore:
+	/* Single page mode should see screen as it was before us */
+	*fb_var = orig_var;
+	*fb_fix = orig_fix;
+	if (!changed) return 0;
+
+	if ( (-1 == ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var))
+		|| (-1 == ioctl(fb.fd, FBIOGET_VSCREENINFO, fb_var))
+		|| (-1 == ioctl(fb.fd, FBIOGET_FSCREENINFO, fb_fix)) )
+	{
+		log_msg(lg, "Can't restore framebuffer mode: %s", ERRMSG);
+	}
+	return 0;
+}
+#endif
+
+int
+attempt_to_change_pixel_format(struct fb_var_screeninfo *fb_var)
+{
+	/* By default the framebuffer driver may have set an oversized
+	 * yres_virtual to support VT scrolling via the panning interface.
+	 *
+	 * We don't try and maintain this since it's more likely that we
+	 * will fail to increase the bpp if the driver's pre allocated
+	 * framebuffer isn't large enough.
+	 */
+	fb_var->yres_virtual = fb_var->yres;
+
+	/* First try setting an 8,8,8,0 pixel format so we don't have to do
+	 * any conversions while drawing. */
+
+	fb_var->bits_per_pixel = 32;
+
+	fb_var->red.offset = 0;
+	fb_var->red.length = 8;
+
+	fb_var->green.offset = 8;
+	fb_var->green.length = 8;
+
+	fb_var->blue.offset = 16;
+	fb_var->blue.length = 8;
+
+	fb_var->transp.offset = 0;
+	fb_var->transp.length = 0;
+
+	if ((ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == 0) && (32 == fb_var->bits_per_pixel)) {
+		log_msg(lg, "Switched to a 32bpp mode");
+		return 1;
+	} else {
+		log_msg(lg, "Failed to switch to a 32bpp mode, trying 16bpp");
+	}
+
+	/* Otherwise try a 16bpp 5,6,5 format */
+
+	fb_var->bits_per_pixel = 16;
+
+	fb_var->red.offset = 11;
+	fb_var->red.length = 5;
+
+	fb_var->green.offset = 5;
+	fb_var->green.length = 6;
+
+	fb_var->blue.offset = 0;
+	fb_var->blue.length = 5;
+
+	fb_var->transp.offset = 0;
+	fb_var->transp.length = 0;
+
+	if ((ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == 0) && (16 == fb_var->bits_per_pixel)) {
+		log_msg(lg, "Switched to a 16bpp mode");
+		return 1;
+	} else {
+#ifdef USE_8BPP
+		log_msg(lg, "Failed to switch to a 16bpp mode, trying 8bpp");
+#else
+		log_msg(lg, "Failed to switch to a 16bpp mode, giving up");
+#endif
+	}
+
+#ifdef USE_8BPP
+	/* At last try 8bpp with palette */
+	fb_var->bits_per_pixel = 8;
+	fb_var->grayscale = 0;
+
+	if ((ioctl(fb.fd, FBIOPUT_VSCREENINFO, fb_var) == 0) && (8 == fb_var->bits_per_pixel)) {
+		log_msg(lg, "Switched to a 8bpp mode");
+		return 1;
+	} else {
+		log_msg(lg, "Failed to switch to a 8bpp mode, giving up");
+	}
+#endif
+
+	return 0;
+}
+
+#ifdef DEBUG
+void print_fb()
+{
+	log_msg(lg, "Framebuffer structure");
+	log_msg(lg, "Descriptor: %d", fb.fd);
+	log_msg(lg, "Type: %d", fb.type);
+	log_msg(lg, "Visual: %d", fb.visual);
+	log_msg(lg, "Width: %d, height: %d", fb.width, fb.height);
+	log_msg(lg, "Real width: %d, real height: %d", fb.real_width, fb.real_height);
+	log_msg(lg, "BPP: %d, depth: %d", fb.format.bpp, fb.format.depth);
+	log_msg(lg, "Stride: %d", fb.stride);
+
+	log_msg(lg, "Screensize: %d", fb.screensize);
+	log_msg(lg, "Angle: %d", fb.angle);
+
+	log_msg(lg, "RGBmode: %d", fb.rgbmode);
+	log_msg(lg, "Red offset: %d, red length: %d", fb.red_offset, fb.red_length);
+	log_msg(lg, "Green offset: %d, green length: %d", fb.green_offset, fb.green_length);
+	log_msg(lg, "Blue offset: %d, blue length: %d", fb.blue_offset, fb.blue_length);
+	log_msg(lg, "Conversion: %d, generic blending: %d", fb.format.convert,
+			fb.format.generic);
+}
+#endif
+
+/* Open framebuffer device and map its memory */
+static int fb_open_device(char *fbdev)
+{
+	struct fb_var_screeninfo fb_var;
+	struct fb_fix_screeninfo fb_fix;
+	int off, pages;
+
+	if ((fb.fd = open(fbdev, O_RDWR)) < 0) {
+		log_msg(lg, "Error opening %s: %s", fbdev, ERRMSG);
+		return -1;
 	}
 
 	if (ioctl(fb.fd, FBIOGET_VSCREENINFO, &fb_var) == -1) {
 		log_msg(lg, "Error getting variable framebuffer info: %s", ERRMSG);
-		goto fail;
+		return -1;
+	}
+
+	if (fb_var.bits_per_pixel < FB_MIN_BPP)
+	{
+		log_msg(lg,
+			"Error, no support for %i bpp frame buffers\n"
+			"Trying to change pixel format...",
+			fb_var.bits_per_pixel);
+		if (!attempt_to_change_pixel_format(&fb_var))
+			return -1;
+	}
+	if (ioctl (fb.fd, FBIOGET_VSCREENINFO, &fb_var) == -1)
+	{
+		log_msg(lg, "Error getting variable framebuffer info (2): %s", ERRMSG);
+		return -1;
+	}
+
+	/* NB: It looks like the fbdev concept of fixed vs variable screen info is
+	 * broken. The line_length is part of the fixed info but it can be changed
+	 * if you set a new pixel format. */
+	if (ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb_fix) == -1) {
+		log_msg(lg, "Error getting fixed framebuffer info: %s", ERRMSG);
+		return -1;
+	}
+
+#ifdef USE_FB_PAN
+	if (fb_setup_pan(&fb_var, &fb_fix))
+		fb.present = FB_PRESENT_PAN;
+#endif
+
+	fb.real_width = fb.width = fb_var.xres;
+	fb.real_height = fb.height = fb_var.yres;
+	fb.format.bpp = fb_var.bits_per_pixel;
+	fb.format.byte_pp = fb.format.bpp >> 3;
+	fb.stride = fb_fix.line_length;
+	fb.type = fb_fix.type;
+	fb.visual = fb_fix.visual;
+
+	fb.screensize = fb.stride * fb.height;
+
+	fb.red_offset = fb_var.red.offset;
+	fb.red_length = fb_var.red.length;
+	fb.green_offset = fb_var.green.offset;
+	fb.green_length = fb_var.green.length;
+	fb.blue_offset = fb_var.blue.offset;
+	fb.blue_length = fb_var.blue.length;
+
+	pages = 1;
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) pages = 2;
+#endif
+
+	fb.base = (char *) mmap((caddr_t) NULL,
+				 /*fb_fix.smem_len */
+				 fb.stride * fb.height * pages,
+				 PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fb.fd, 0);
+
+	if (fb.base == (char *) -1) {
+		fb.base = NULL;
+		log_msg(lg, "Error cannot mmap framebuffer: %s", ERRMSG);
+		return -1;
+	}
+
+	off =
+	    (unsigned long) fb_fix.smem_start %
+	    (unsigned long) getpagesize();
+
+	fb.data = fb.base + off;
+
+	return 0;
+}
+
+#ifdef USE_FB_DRM
+/**************************************************************************
+ * DRM/KMS
+ *
+ * Kernels without fbdev emulation are driven by KMS ioctls. First connected
+ * connector is shown in its preferred mode from dumb buffers. Two buffers
+ * are pages of panning mode and are flipped on vertical retrace.
+ */
+
+/* Cards tried when FBDEV is not set */
+#define FB_DRM_CARD			"/dev/dri/card"
+#define FB_DRM_CARDS		4
+/* Longest wait for page flip completion in milliseconds */
+#define FB_DRM_FLIP_TIMEOUT	1000
+
+/* Ask connector for its modes and encoders. Return count of modes or -1 */
+static int fb_drm_get_connector(struct drm_mode_get_connector *conn,
+		struct drm_mode_modeinfo **modes, __u32 **encoders)
+{
+	__u32 count_modes, count_encoders;
+
+	conn->count_props = 0;
+	count_modes = conn->count_modes;
+	count_encoders = conn->count_encoders;
+	*modes = calloc(count_modes + 1, sizeof(**modes));
+	*encoders = calloc(count_encoders + 1, sizeof(**encoders));
+	if ( (NULL == *modes) || (NULL == *encoders) ) {
+		DPRINTF("Can't allocate memory for connector info");
+		return -1;
+	}
+	conn->modes_ptr = (unsigned long)*modes;
+	conn->encoders_ptr = (unsigned long)*encoders;
+
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETCONNECTOR, conn))
+		return -1;
+
+	/* Lists could grow in between. Only known part is filled */
+	if (conn->count_encoders > count_encoders)
+		conn->count_encoders = count_encoders;
+	if (conn->count_modes > count_modes)
+		conn->count_modes = count_modes;
+	return conn->count_modes;
+}
+
+/* Find CRTC able to drive connector. Return -1 if there is none */
+static int fb_drm_find_crtc(struct drm_mode_get_connector *conn,
+		__u32 *encoders, __u32 *crtcs, int count_crtcs)
+{
+	struct drm_mode_get_encoder enc;
+	unsigned int i;
+	int j;
+
+	/* Keep CRTC that is already used by connector */
+	if (0 != conn->encoder_id) {
+		memset(&enc, 0, sizeof(enc));
+		enc.encoder_id = conn->encoder_id;
+		if ( (0 == ioctl(fb.fd, DRM_IOCTL_MODE_GETENCODER, &enc))
+				&& (0 != enc.crtc_id) )
+		{
+			for (j = 0; j < count_crtcs; j++) {
+				if (crtcs[j] != enc.crtc_id) continue;
+				fb.drm_crtc = crtcs[j];
+				fb.drm_pipe = j;
+				return 0;
+			}
+		}
+	}
+
+	for (i = 0; i < conn->count_encoders; i++) {
+		memset(&enc, 0, sizeof(enc));
+		enc.encoder_id = encoders[i];
+		if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETENCODER, &enc))
+			continue;
+		for (j = 0; j < count_crtcs; j++) {
+			if (!(enc.possible_crtcs & (1U << j))) continue;
+			fb.drm_crtc = crtcs[j];
+			fb.drm_pipe = j;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Choose connected connector, its mode and CRTC. Return -1 on error */
+static int fb_drm_find_output()
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_modeinfo *modes = NULL;
+	__u32 *crtcs = NULL, *connectors = NULL, *encoders = NULL;
+	int i, j, count_crtcs, ret = -1;
+
+	memset(&res, 0, sizeof(res));
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETRESOURCES, &res)) {
+		log_msg(lg, "Can't get KMS resources: %s", ERRMSG);
+		return -1;
+	}
+
+	count_crtcs = res.count_crtcs;
+	crtcs = calloc(res.count_crtcs + 1, sizeof(*crtcs));
+	connectors = calloc(res.count_connectors + 1, sizeof(*connectors));
+	if ( (NULL == crtcs) || (NULL == connectors) ) {
+		DPRINTF("Can't allocate memory for KMS resources");
+		goto out;
+	}
+	res.count_fbs = 0;
+	res.count_encoders = 0;
+	res.crtc_id_ptr = (unsigned long)crtcs;
+	res.connector_id_ptr = (unsigned long)connectors;
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETRESOURCES, &res)) {
+		log_msg(lg, "Can't get KMS resources: %s", ERRMSG);
+		goto out;
+	}
+	if ((int)res.count_crtcs < count_crtcs) count_crtcs = res.count_crtcs;
+
+	for (i = 0; (i < (int)res.count_connectors) && (-1 == ret); i++) {
+		/* Counts are asked first. It probes connector too */
+		memset(&conn, 0, sizeof(conn));
+		conn.connector_id = connectors[i];
+		if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
+			continue;
+		if ( (DRM_MODE_CONNECTED != conn.connection)
+				|| (0 == conn.count_modes) )
+			continue;
+
+		if ( (fb_drm_get_connector(&conn, &modes, &encoders) > 0)
+				&& (0 == fb_drm_find_crtc(&conn, encoders, crtcs,
+						count_crtcs)) )
+		{
+			/* Preferred mode or first one */
+			fb.drm_mode = modes[0];
+			for (j = 0; j < (int)conn.count_modes; j++) {
+				if (modes[j].type & DRM_MODE_TYPE_PREFERRED) {
+					fb.drm_mode = modes[j];
+					break;
+				}
+			}
+			fb.drm_connector = conn.connector_id;
+			ret = 0;
+		}
+
+		dispose(modes);
+		dispose(encoders);
+		modes = NULL;
+		encoders = NULL;
+	}
+
+	if (-1 == ret)
+		log_msg(lg, "No connected output with free CRTC");
+
+out:
+	dispose(crtcs);
+	dispose(connectors);
+	return ret;
+}
+
+/* Create dumb buffer of mode size with KMS framebuffer on it and map it.
+ * Return -1 on error */
+static int fb_drm_create_buffer(struct fb_drm_buffer_t *b, int bpp)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_fb_cmd cmd;
+	struct drm_mode_map_dumb map;
+
+	memset(&create, 0, sizeof(create));
+	create.width = fb.drm_mode.hdisplay;
+	create.height = fb.drm_mode.vdisplay;
+	create.bpp = bpp;
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+		log_msg(lg, "Can't create dumb buffer: %s", ERRMSG);
+		return -1;
+	}
+	b->handle = create.handle;
+	b->size = create.size;
+	fb.stride = create.pitch;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.width = create.width;
+	cmd.height = create.height;
+	cmd.pitch = create.pitch;
+	cmd.bpp = bpp;
+	cmd.depth = (32 == bpp) ? 24 : bpp;
+	cmd.handle = create.handle;
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_ADDFB, &cmd)) {
+		log_msg(lg, "Can't add KMS framebuffer: %s", ERRMSG);
+		return -1;
+	}
+	b->fb_id = cmd.fb_id;
+
+	memset(&map, 0, sizeof(map));
+	map.handle = create.handle;
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_MAP_DUMB, &map)) {
+		log_msg(lg, "Can't prepare dumb buffer mapping: %s", ERRMSG);
+		return -1;
+	}
+
+	b->map = (char *) mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fb.fd, map.offset);
+	if (MAP_FAILED == b->map) {
+		b->map = NULL;
+		log_msg(lg, "Error cannot mmap dumb buffer: %s", ERRMSG);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Show KMS framebuffer on our output by mode setting */
+static int fb_drm_set_crtc(__u32 fb_id)
+{
+	struct drm_mode_crtc crtc;
+
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = fb.drm_crtc;
+	crtc.fb_id = fb_id;
+	crtc.set_connectors_ptr = (unsigned long)&fb.drm_connector;
+	crtc.count_connectors = 1;
+	crtc.mode = fb.drm_mode;
+	crtc.mode_valid = 1;
+
+	return ioctl(fb.fd, DRM_IOCTL_MODE_SETCRTC, &crtc);
+}
+
+#ifdef USE_FB_PAN
+/* Wait until page flip is done. Return -1 if it is unknown */
+static int fb_drm_wait_flip()
+{
+	__u64 events[16];	/* Aligned for event structures */
+	struct drm_event *e;
+	struct pollfd pfd;
+	int n, i;
+
+	for (;;) {
+		pfd.fd = fb.fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		n = poll(&pfd, 1, FB_DRM_FLIP_TIMEOUT);
+		if (n > 0)
+			n = read(fb.fd, events, sizeof(events));
+		if (n <= 0) {
+			if ( (n < 0) && (EINTR == errno) ) continue;
+			return -1;
+		}
+
+		for (i = 0; i + (int)sizeof(*e) <= n; i += e->length) {
+			e = (struct drm_event *)((char *)events + i);
+			if (DRM_EVENT_FLIP_COMPLETE == e->type) return 0;
+			if (e->length < sizeof(*e)) break;
+		}
+	}
+}
+
+/* Show hidden dumb buffer on next vertical retrace. Return -1 on error */
+static int fb_drm_flip()
+{
+	struct drm_mode_crtc_page_flip flip;
+	const int page = fb.page ^ 1;
+
+	if (fb.vsync) {
+		memset(&flip, 0, sizeof(flip));
+		flip.crtc_id = fb.drm_crtc;
+		flip.fb_id = fb.drm_buf[page].fb_id;
+		flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+		if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip)) {
+			log_msg(lg, "Can't flip pages, mode setting is used: %s",
+					ERRMSG);
+			fb.vsync = 0;
+		} else {
+			/* Don't touch previous page until it is really hidden */
+			if (-1 == fb_drm_wait_flip()) {
+				log_msg(lg, "No page flip events, mode setting is used");
+				fb.vsync = 0;
+			}
+			fb.page = page;
+			return 0;
+		}
+	}
+
+	if (-1 == fb_drm_set_crtc(fb.drm_buf[page].fb_id)) {
+		log_msg(lg, "Can't set CRTC: %s", ERRMSG);
+		return -1;
+	}
+	fb.page = page;
+	return 0;
+}
+#endif
+
+#ifdef USE_ANIMATION
+/* Wait for vertical retrace of our CRTC. Return -1 if it is unknown */
+static int fb_drm_wait_vblank()
+{
+	union drm_wait_vblank vbl;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = _DRM_VBLANK_RELATIVE;
+	if (fb.drm_pipe > 1)
+		vbl.request.type |= (fb.drm_pipe << _DRM_VBLANK_HIGH_CRTC_SHIFT)
+				& _DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (1 == fb.drm_pipe)
+		vbl.request.type |= _DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = 1;
+
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_WAIT_VBLANK, &vbl)) {
+		log_msg(lg, "Can't wait for vblank: %s", ERRMSG);
+		fb.no_vsync = 1;
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/* Restore previous CRTC state and free dumb buffers */
+static void fb_drm_close()
+{
+	struct drm_mode_destroy_dumb destroy;
+	struct fb_drm_buffer_t *b;
+	int i;
+
+	if (fb.drm_saved.mode_valid && (0 != fb.drm_saved.fb_id)) {
+		fb.drm_saved.set_connectors_ptr = (unsigned long)&fb.drm_connector;
+		fb.drm_saved.count_connectors = 1;
+		ioctl(fb.fd, DRM_IOCTL_MODE_SETCRTC, &fb.drm_saved);
+	}
+
+	for (i = 0; i < 2; i++) {
+		b = &fb.drm_buf[i];
+		if (NULL != b->map)
+			munmap(b->map, b->size);
+		if (0 != b->fb_id)
+			ioctl(fb.fd, DRM_IOCTL_MODE_RMFB, &b->fb_id);
+		if (0 != b->handle) {
+			destroy.handle = b->handle;
+			ioctl(fb.fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		}
+	}
+	memset(fb.drm_buf, 0, sizeof(fb.drm_buf));
+	memset(&fb.drm_saved, 0, sizeof(fb.drm_saved));
+	fb.data = NULL;
+#ifdef USE_FB_PAN
+	fb.page = 0;
+#endif
+}
+
+/* Open KMS device and show dumb buffer on its connected output.
+ * Return -1 on error */
+static int fb_open_drm(char *path)
+{
+	struct drm_get_cap cap;
+	int i, pages = 1, bpp;
+
+	if ((fb.fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+		log_msg(lg, "Error opening %s: %s", path, ERRMSG);
+		return -1;
+	}
+	fb.drm = 1;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.capability = DRM_CAP_DUMB_BUFFER;
+	if ( (-1 == ioctl(fb.fd, DRM_IOCTL_GET_CAP, &cap)) || (0 == cap.value) ) {
+		log_msg(lg, "%s has no dumb buffers", path);
+		return -1;
+	}
+
+	if (-1 == fb_drm_find_output())
+		return -1;
+
+	/* Picture shown before us is returned on exit */
+	fb.drm_saved.crtc_id = fb.drm_crtc;
+	if (-1 == ioctl(fb.fd, DRM_IOCTL_MODE_GETCRTC, &fb.drm_saved))
+		memset(&fb.drm_saved, 0, sizeof(fb.drm_saved));
+
+	/* XRGB8888 and RGB565 are supported by dumb buffers everywhere */
+#ifdef USE_32BPP
+	bpp = 32;
+#else
+	bpp = 16;
+#endif
+#ifdef USE_FB_PAN
+	pages = 2;
+#endif
+	for (i = 0; i < pages; i++) {
+		if (-1 == fb_drm_create_buffer(&fb.drm_buf[i], bpp))
+			return -1;
+	}
+
+	if (-1 == fb_drm_set_crtc(fb.drm_buf[0].fb_id)) {
+		log_msg(lg, "Can't set CRTC: %s", ERRMSG);
+		return -1;
+	}
+
+	fb.real_width = fb.width = fb.drm_mode.hdisplay;
+	fb.real_height = fb.height = fb.drm_mode.vdisplay;
+	fb.format.bpp = bpp;
+	fb.format.byte_pp = bpp >> 3;
+	fb.type = FB_TYPE_PACKED_PIXELS;
+	fb.visual = FB_VISUAL_TRUECOLOR;
+	fb.screensize = fb.stride * fb.height;
+
+	if (32 == bpp) {
+		fb.red_offset = 16;
+		fb.red_length = 8;
+		fb.green_offset = 8;
+		fb.green_length = 8;
+		fb.blue_offset = 0;
+		fb.blue_length = 8;
+	} else {
+		fb.red_offset = 11;
+		fb.red_length = 5;
+		fb.green_offset = 5;
+		fb.green_length = 6;
+		fb.blue_offset = 0;
+		fb.blue_length = 5;
+	}
+
+	fb.data = fb.drm_buf[0].map;
+#ifdef USE_FB_PAN
+	fb.present = FB_PRESENT_PAN;
+#endif
+
+	log_msg(lg, "KMS on %s: connector %u, CRTC %u, %dx%d@%d, %d dumb buffers",
+			path, fb.drm_connector, fb.drm_crtc, fb.width, fb.height,
+			fb.drm_mode.vrefresh, pages);
+	return 0;
+}
+
+/* Open KMS device 'path' or first usable card when it is NULL. Fbdev
+ * device is opened instead when there is no KMS. Return -1 on error */
+static int fb_open_kms(char *path)
+{
+	char card[sizeof(FB_DRM_CARD) + 4];
+	char *p = path;
+	int i;
+
+	for (i = 0; i < FB_DRM_CARDS; i++) {
+		if (NULL == path) {
+			sprintf(card, FB_DRM_CARD "%d", i);
+			if (-1 == access(card, F_OK)) continue;
+			p = card;
+		}
+		if (0 == fb_open_drm(p))
+			return 0;
+
+		/* Forget failed device */
+		if (fb.fd >= 0) {
+			fb_drm_close();
+			close(fb.fd);
+		}
+		memset(&fb, 0, sizeof(FB));
+		fb.fd = -1;
+
+		if (NULL != path) break;
+	}
+
+	log_msg(lg, "KMS is not usable, falling back to fbdev");
+	return fb_open_device("/dev/fb0");
+}
+#endif
+
+#ifdef USE_FB_MEMORY
+/*
+ * Create framebuffer in memory. Spec is WIDTHxHEIGHTxBPP[:rgb|bgr][:angle]
+ * Angle from spec (if any) overrides one passed in 'angle'.
+ */
+static int fb_open_memory(char *spec, int *angle)
+{
+	char *p;
+	int bpp, bgr = 0;
+	int r_off, g_off, b_off, r_len, g_len, b_len;
+
+	if (3 != sscanf(spec, "%dx%dx%d", &fb.real_width, &fb.real_height, &bpp)) {
+		log_msg(lg, "Wrong memory framebuffer spec '%s'", spec);
+		return -1;
+	}
+
+	for (p = strchr(spec, ':'); NULL != p; p = strchr(p, ':')) {
+		++p;
+		if (!strncmp(p, "rgb", 3)) bgr = 0;
+		else if (!strncmp(p, "bgr", 3)) bgr = 1;
+		else *angle = atoi(p);
+	}
+
+	switch (bpp) {
+	case 16:
+		r_off = 11; g_off = 5; b_off = 0;
+		r_len = 5; g_len = 6; b_len = 5;
+		break;
+	case 18:
+		r_off = 12; g_off = 6; b_off = 0;
+		r_len = 6; g_len = 6; b_len = 6;
+		bpp = 24;	/* 18bpp is stored as 24bpp */
+		break;
+	case 24:
+	case 32:
+		r_off = 16; g_off = 8; b_off = 0;
+		r_len = 8; g_len = 8; b_len = 8;
+		break;
+	case 8:
+		/* Pseudocolor. Palette entries have 8-bit channels */
+		r_off = 0; g_off = 0; b_off = 0;
+		r_len = 8; g_len = 8; b_len = 8;
+		break;
+	default:
+		log_msg(lg, "Memory framebuffer can't have %d bpp", bpp);
+		return -1;
+	}
+
+	if ( (fb.real_width <= 0) || (fb.real_height <= 0) ) {
+		log_msg(lg, "Wrong memory framebuffer size %dx%d",
+				fb.real_width, fb.real_height);
+		return -1;
+	}
+
+	fb.width = fb.real_width;
+	fb.height = fb.real_height;
+	fb.format.bpp = bpp;
+	fb.format.byte_pp = fb.format.bpp >> 3;
+	fb.stride = (fb.real_width * fb.format.byte_pp + 3) & ~3;
+	fb.type = FB_TYPE_PACKED_PIXELS;
+	fb.visual = (8 == bpp) ? FB_VISUAL_PSEUDOCOLOR : FB_VISUAL_TRUECOLOR;
+	fb.screensize = fb.stride * fb.height;
+
+	fb.red_offset = (bgr ? b_off : r_off);
+	fb.red_length = r_len;
+	fb.green_offset = g_off;
+	fb.green_length = g_len;
+	fb.blue_offset = (bgr ? r_off : b_off);
+	fb.blue_length = b_len;
+
+	fb.base = calloc(1, fb.screensize);
+	if (NULL == fb.base) {
+		DPRINTF("Can't allocate memory for framebuffer");
+		return -1;
+	}
+	fb.data = fb.base;
+
+	log_msg(lg, "Using memory framebuffer '%s'", spec);
+	return 0;
+}
+#endif
+
+/* Fill lookup table of channel with 'length' bits at 'offset' */
+static void fb_channel_lut(uint32_t *lut, uint32_t *mask, int offset,
+		int length)
+{
+	uint32_t c;
+	int v;
+
+	*mask = ((1U << length) - 1) << offset;
+	for (v = 0; v < 256; v++) {
+		if (length > 8)
+			c = (uint32_t)v * ((1U << length) - 1) / 255;
+		else
+			c = v >> (8 - length);
+		lut[v] = c << offset;
+	}
+}
+
+#ifdef USE_8BPP
+/**************************************************************************
+ * Palette of 8bpp pseudocolor framebuffer.
+ * Colors are composed to RGB565 and converted to palette indexes by cache
+ * of nearest entries. Colors put into palette are cached at once, others
+ * are searched for every RGB565 color when palette is complete.
+ */
+
+/* Count of RGB565 colors */
+#define FB_PALETTE_KEYS		65536
+/* Levels of grey ramp and of color cube channels */
+#define FB_PALETTE_GREYS	16
+#define FB_PALETTE_CUBE		6
+/* Colors of pictures closer than this to palette entries are added
+ * only when palette has room after all other colors */
+#define FB_PALETTE_SPREAD	(9 * 8 * 8)
+
+/* RGB888 color of RGB565 cache key */
+static inline uint32_t fb_key_color(unsigned int key)
+{
+	uint32_t r = (key >> 11) & 0x1F, g = (key >> 5) & 0x3F, b = key & 0x1F;
+
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+	return (r << 16) | (g << 8) | b;
+}
+
+/* Distance of RGB888 colors. Eye is most sensitive to green */
+static inline int fb_color_distance(uint32_t a, uint32_t b)
+{
+	int dr = (int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF);
+	int dg = (int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF);
+	int db = (int)(a & 0xFF) - (int)(b & 0xFF);
+
+	return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
+/* Squared distance from channel value 'v' to nearest and farthest ends of
+ * 'lo'..'hi' range */
+static inline void fb_range_distance(int v, int lo, int hi, int *near,
+		int *far)
+{
+	int d;
+
+	d = (v < lo) ? lo - v : ( (v > hi) ? v - hi : 0 );
+	*near = d * d;
+	d = (v - lo > hi - v) ? v - lo : hi - v;
+	*far = d * d;
+}
+
+/*
+ * Cache nearest entries of all RGB565 colors not put into palette.
+ * RGB565 space is split into cells of 4x8x4 colors. Only entries which may
+ * be nearest for some color of cell are compared for its colors: entry
+ * is skipped when it is farther from whole cell than another entry is from
+ * farthest corner of cell. Lowest nearest entry is taken like by linear
+ * search over palette
+ */
+static void fb_palette_fill(kx_pixel_format *f)
+{
+	uint8_t cand[256];
+	int near[256];
+	int lo[3], hi[3], n[3], x[3];
+	int i, j, d, count, best, best_d, limit;
+	unsigned int cell, key;
+	uint32_t c;
+
+	for (cell = 0; cell < 512; cell++) {
+		/* Channel ranges of cell in RGB888 */
+		lo[0] = fb_key_color(((cell >> 6) << 13)) >> 16;
+		hi[0] = fb_key_color(((cell >> 6) << 13) | 0x1800) >> 16;
+		lo[1] = (fb_key_color(((cell >> 3) & 7) << 8) >> 8) & 0xFF;
+		hi[1] = (fb_key_color((((cell >> 3) & 7) << 8) | 0xE0) >> 8) & 0xFF;
+		lo[2] = fb_key_color((cell & 7) << 2) & 0xFF;
+		hi[2] = fb_key_color(((cell & 7) << 2) | 3) & 0xFF;
+
+		limit = 0x7FFFFFFF;
+		for (i = 0; i < f->palette_size; i++) {
+			c = f->palette[i];
+			fb_range_distance(c >> 16, lo[0], hi[0], &n[0], &x[0]);
+			fb_range_distance((c >> 8) & 0xFF, lo[1], hi[1], &n[1], &x[1]);
+			fb_range_distance(c & 0xFF, lo[2], hi[2], &n[2], &x[2]);
+			near[i] = 2 * n[0] + 4 * n[1] + 3 * n[2];
+			d = 2 * x[0] + 4 * x[1] + 3 * x[2];
+			if (d < limit) limit = d;
+		}
+
+		/* Candidates are sorted by distance to cell */
+		count = 0;
+		for (i = 0; i < f->palette_size; i++) {
+			if (near[i] > limit) continue;
+			for (j = count++; (j > 0) && (near[cand[j - 1]] > near[i]); j--)
+				cand[j] = cand[j - 1];
+			cand[j] = i;
+		}
+
+		for (i = 0; i < 128; i++) {
+			key = ((cell >> 6) << 13) | ((i >> 5) << 11)
+					| (((cell >> 3) & 7) << 8) | (((i >> 2) & 7) << 5)
+					| ((cell & 7) << 2) | (i & 3);
+			if (0 != f->nearest[key]) continue;
+
+			c = fb_key_color(key);
+			best = 0;
+			best_d = 0x7FFFFFFF;
+			for (j = 0; (j < count) && (near[cand[j]] <= best_d); j++) {
+				d = fb_color_distance(c, f->palette[cand[j]]);
+				if ( (d < best_d) || ((d == best_d) && (cand[j] < best)) ) {
+					best_d = d;
+					best = cand[j];
+				}
+			}
+			f->nearest[key] = best + 1;
+		}
+	}
+}
+
+/* Add RGB888 color unless palette has entry of same RGB565 color or
+ * entry closer than 'spread'. Return 1 if color is added */
+static int fb_palette_add(kx_pixel_format *f, uint32_t rgb, int spread)
+{
+	unsigned int key = FB_RGB565(rgb);
+	int i;
+
+	if ( (f->palette_size >= 256) || (0 != f->nearest[key]) ) return 0;
+
+	for (i = 0; (spread > 0) && (i < f->palette_size); i++) {
+		if (fb_color_distance(rgb, f->palette[i]) < spread) return 0;
+	}
+
+	f->palette[f->palette_size++] = rgb;
+	f->nearest[key] = f->palette_size;
+	return 1;
+}
+
+/* Compare colors counts for sorting by usage */
+static int fb_compare_usage(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	/* Count is kept in first word */
+	if (x[0] != y[0]) return (x[0] > y[0]) ? -1 : 1;
+	return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+static int fb_compare_colors(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* Add colors of pictures starting from most used ones. Return count of
+ * distinct colors of pictures */
+static int fb_palette_add_pictures(kx_pixel_format *f, kx_picture **pics,
+		int pic_count)
+{
+	uint32_t *colors, *usage;
+	int i, j, n, count;
+	unsigned int k;
+
+	n = 0;
+	for (i = 0; i < pic_count; i++) {
+		if ( (NULL != pics[i]) && (NULL != pics[i]->pixels) )
+			n += pics[i]->width * pics[i]->height;
+	}
+	if (0 == n) return 0;
+
+	colors = malloc(n * sizeof(*colors));
+	usage = malloc(2 * n * sizeof(*usage));
+	if ( (NULL == colors) || (NULL == usage) ) {
+		DPRINTF("Can't allocate memory for pictures colors");
+		dispose(colors);
+		dispose(usage);
+		return 0;
+	}
+
+	/* Colors of visible pixels */
+	n = 0;
+	for (i = 0; i < pic_count; i++) {
+		if ( (NULL == pics[i]) || (NULL == pics[i]->pixels) ) continue;
+		for (k = 0; k < pics[i]->width * pics[i]->height; k++) {
+			if (255 != rgba2a(pics[i]->pixels[k]))
+				colors[n++] = pics[i]->pixels[k] >> 8;
+		}
+	}
+
+	/* Count every distinct color */
+	qsort(colors, n, sizeof(*colors), fb_compare_colors);
+	count = 0;
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; (j < n) && (colors[j] == colors[i]); j++);
+		usage[2 * count] = j - i;
+		usage[2 * count + 1] = colors[i];
+		++count;
+	}
+	qsort(usage, count, 2 * sizeof(*usage), fb_compare_usage);
+
+	/* Distinct colors go first so palette covers all pictures */
+	for (i = 0; i < count; i++)
+		fb_palette_add(f, usage[2 * i + 1], FB_PALETTE_SPREAD);
+	for (i = 0; i < count; i++)
+		fb_palette_add(f, usage[2 * i + 1], 0);
+
+	free(colors);
+	free(usage);
+	return count;
+}
+
+/* Load palette into device */
+static void fb_load_palette(const kx_pixel_format *f, int fd)
+{
+	__u16 red[256], green[256], blue[256];
+	struct fb_cmap cmap;
+	int i;
+
+	if (fd < 0) return;
+
+	for (i = 0; i < f->palette_size; i++) {
+		/* Device takes 16-bit channels */
+		red[i] = ((f->palette[i] >> 16) & 0xFF) * 0x101;
+		green[i] = ((f->palette[i] >> 8) & 0xFF) * 0x101;
+		blue[i] = (f->palette[i] & 0xFF) * 0x101;
+	}
+
+	cmap.start = 0;
+	cmap.len = f->palette_size;
+	cmap.red = red;
+	cmap.green = green;
+	cmap.blue = blue;
+	cmap.transp = NULL;
+	if (-1 == ioctl(fd, FBIOPUTCMAP, &cmap))
+		log_msg(lg, "Can't set palette: %s", ERRMSG);
+}
+
+/* Fill palette of format. Return count of distinct pictures colors */
+static int fb_make_palette(kx_pixel_format *f, const kx_rgba *colors,
+		int count, kx_picture **pics, int pic_count)
+{
+	int i, r, g, b, n;
+	uint32_t v;
+
+	memset(f->nearest, 0, FB_PALETTE_KEYS * sizeof(*f->nearest));
+	f->palette_size = 0;
+
+	for (i = 0; i < count; i++)
+		fb_palette_add(f, colors[i] >> 8, 0);
+
+	/* Greys keep blending of black and white smooth */
+	for (i = 0; i < FB_PALETTE_GREYS; i++) {
+		v = i * 255 / (FB_PALETTE_GREYS - 1);
+		fb_palette_add(f, v * 0x010101, 0);
+	}
+
+	n = fb_palette_add_pictures(f, pics, pic_count);
+
+	/* Rest is for any other colors */
+	for (r = 0; r < FB_PALETTE_CUBE; r++)
+		for (g = 0; g < FB_PALETTE_CUBE; g++)
+			for (b = 0; b < FB_PALETTE_CUBE; b++) {
+				v = (r * 255 / (FB_PALETTE_CUBE - 1)) << 16
+						| (g * 255 / (FB_PALETTE_CUBE - 1)) << 8
+						| b * 255 / (FB_PALETTE_CUBE - 1);
+				fb_palette_add(f, v, 0);
+			}
+
+	fb_palette_fill(f);
+	return n;
+}
+
+/* Load changed palette into device and forget everything drawn by old one */
+static void fb_use_palette()
+{
+	fb_load_palette(&fb.format, fb.fd);
+
+	/* Glyphs are kept in palette indexes */
+	fb_glyph_cache_flush();
+#ifdef USE_FB_MIRROR
+	fb_update_mirrors();
+#endif
+}
+
+#ifdef USE_SPLASH
+/* Use palette of 'count' saved colors */
+static void fb_set_palette(const uint32_t *colors, int count)
+{
+	memcpy(fb.format.palette, colors, count * sizeof(*colors));
+	fb.format.palette_size = count;
+	memset(fb.format.nearest, 0, FB_PALETTE_KEYS * sizeof(*fb.format.nearest));
+	fb_palette_fill(&fb.format);
+	fb_use_palette();
+}
+#endif
+
+void fb_build_palette(const kx_rgba *colors, int count, kx_picture **pics,
+		int pic_count)
+{
+	int n;
+
+	if (FB_CONVERT_PALETTE != fb.format.convert) return;
+
+	n = fb_make_palette(&fb.format, colors, count, pics, pic_count);
+	fb_use_palette();
+
+	log_msg(lg, "Palette of %d colors for %d fixed and %d pictures colors",
+			fb.format.palette_size, count, n);
+}
+
+/* Set up palettized format. Return -1 if visual is not supported */
+static int fb_init_palette_format()
+{
+	kx_pixel_format *f = &fb.format;
+
+	if (FB_VISUAL_PSEUDOCOLOR != fb.visual) {
+		log_msg(lg, "Unsupported 8bpp visual %d", fb.visual);
+		return -1;
+	}
+
+	f->nearest = malloc(FB_PALETTE_KEYS * sizeof(*f->nearest));
+	if (NULL == f->nearest) {
+		DPRINTF("Can't allocate memory for palette cache");
+		return -1;
+	}
+
+	/* Colors are composed to RGB565 keys of cache */
+	fb_channel_lut(f->red, &f->mask[0], 11, 5);
+	fb_channel_lut(f->green, &f->mask[1], 5, 6);
+	fb_channel_lut(f->blue, &f->mask[2], 0, 5);
+	f->convert = FB_CONVERT_PALETTE;
+	f->generic = 0;
+
+	fb_make_palette(f, NULL, 0, NULL, 0);
+	fb_load_palette(f, fb.fd);
+	return 0;
+}
+#endif
+
+/* Build pixel format from channel offsets and lengths.
+ * Return -1 if format is unsupported */
+static int fb_init_format()
+{
+	kx_pixel_format *f = &fb.format;
+	int o[3] = { fb.red_offset, fb.green_offset, fb.blue_offset };
+	int l[3] = { fb.red_length, fb.green_length, fb.blue_length };
+	int i, bytes = 1;
+
+	f->depth = fb.red_length + fb.green_length + fb.blue_length;
+	if (18 != f->depth) f->depth = f->bpp;	/* according to some info 18bpp is reported as 24bpp */
+
+#ifdef USE_8BPP
+	if (8 == f->bpp) return fb_init_palette_format();
+#endif
+
+	for (i = 0; i < 3; i++) {
+		if ( (l[i] <= 0) || (l[i] > 24) || (o[i] < 0)
+				|| (o[i] + l[i] > fb.format.bpp) )
+		{
+			log_msg(lg, "Unsupported pixel format (offset %d, length %d)",
+					o[i], l[i]);
+			return -1;
+		}
+		/* Channel takes whole byte */
+		if ( (8 != l[i]) || (o[i] & 7) || (o[i] > 16) ) bytes = 0;
+	}
+
+	fb_channel_lut(f->red, &f->mask[0], o[0], l[0]);
+	fb_channel_lut(f->green, &f->mask[1], o[1], l[1]);
+	fb_channel_lut(f->blue, &f->mask[2], o[2], l[2]);
+	for (i = 0; i < 3; i++) {
+		f->offset[i] = o[i];
+		f->length[i] = l[i];
+	}
+
+	f->convert = FB_CONVERT_LUT;
+	if (bytes && (8 == o[1])) {
+		if ( (16 == o[0]) && (0 == o[2]) )
+			f->convert = FB_CONVERT_RGB888;
+		else if ( (0 == o[0]) && (16 == o[2]) )
+			f->convert = FB_CONVERT_BGR888;
+	}
+
+	/* Fast blending knows 565 and byte channels in lower 24 bits */
+	switch (fb.format.depth) {
+	case 16:
+		f->generic = !( (5 == o[1]) && (6 == l[1]) && (5 == l[0])
+				&& (5 == l[2]) && (0 == o[0] * o[2])
+				&& (11 == o[0] + o[2]) );
+		break;
+	case 24:
+	case 32:
+		f->generic = !bytes || (o[0] == o[1]) || (o[1] == o[2])
+				|| (o[0] == o[2]);
+		break;
+	default:
+		f->generic = 1;
+		break;
+	}
+
+	return 0;
+}
+
+#ifdef USE_FB_MIRROR
+/**************************************************************************
+ * Mirrors
+ *
+ * Framebuffers listed after main one in FBDEV show same picture. Scene is
+ * rendered once into backbuffer. Its changed areas are converted to
+ * format of every mirror, scaled by integer factor and written by mirror
+ * primitives in mirror orientation.
+ */
+
+/* Largest scale of picture on mirror */
+#define FB_MIRROR_MAX_SCALE	8
+/* Backbuffer pixels converted at once */
+#define FB_MIRROR_CHUNK		64
+
+/* Additional framebuffer showing copy of main one */
+struct fb_mirror_t {
+	int fd;
+	char *base;			/* Memory of memory framebuffer */
+	kx_pixel_format format;
+	kx_surface surface;		/* Videomemory in drawing orientation */
+	int scale;			/* Backbuffer pixel is shown as scale x scale square */
+	int left, top;			/* Position of picture on surface */
+	int same;			/* Backbuffer pixels need no conversion */
+	uint32_t *lut;		/* Mirror pixel of every 8/16bpp backbuffer pixel
+				   or mirror bits of every byte of wider one */
+#ifdef USE_FB_MEMORY
+	char *dump_path;	/* Save every shown frame to this PPM file */
+#endif
+};
+
+static struct fb_mirror_t fb_mirrors[USE_FB_MIRROR];
+static int fb_mirror_count;
+
+/* Mirror pixel of backbuffer pixel value of 'B' bytes */
+static inline uint32_t fb_mirror_color(struct fb_mirror_t *m, uint32_t v,
+		const int B)
+{
+	if (m->same) return v;
+	if (m->lut) {
+		if (B <= 2) return m->lut[v];
+		return m->lut[v & 0xff] | m->lut[256 + ((v >> 8) & 0xff)]
+				| m->lut[512 + ((v >> 16) & 0xff)] | m->lut[768 + (v >> 24)];
+	}
+	return compose_color(&m->format, fb_pixel_color(&fb.format, v));
+}
+
+/* Convert 'n' backbuffer pixels to mirror ones, each repeated 'k' times.
+ * Called with constant sizes to get loop for every pair of formats */
+static inline void fb_mirror_span(struct fb_mirror_t *m, const char *src,
+		int n, char *dst, const int B, const int MB, const int k)
+{
+	uint32_t v, c, last;
+	int j;
+
+	/* Neighbour pixels are mostly equal */
+	last = fb_load_pixel(src, B);
+	c = fb_mirror_color(m, last, B);
+	for (; n > 0; n--, src += B) {
+		v = fb_load_pixel(src, B);
+		if (v != last) {
+			c = fb_mirror_color(m, v, B);
+			last = v;
+		}
+		for (j = 0; j < k; j++, dst += MB)
+			fb_store_pixel(dst, c, MB);
+	}
+}
+
+static void fb_mirror_convert(struct fb_mirror_t *m, const char *src,
+		int n, char *dst)
+{
+	const int B = fb.format.byte_pp, MB = m->format.byte_pp;
+
+	if (1 == m->scale) {
+		if (m->same) {
+			memcpy(dst, src, n * B);
+			return;
+		}
+		switch (B * 8 + MB) {
+		case 2 * 8 + 2:
+			fb_mirror_span(m, src, n, dst, 2, 2, 1);
+			return;
+		case 2 * 8 + 4:
+			fb_mirror_span(m, src, n, dst, 2, 4, 1);
+			return;
+		case 4 * 8 + 2:
+			fb_mirror_span(m, src, n, dst, 4, 2, 1);
+			return;
+		case 4 * 8 + 4:
+			fb_mirror_span(m, src, n, dst, 4, 4, 1);
+			return;
+		}
+	}
+	fb_mirror_span(m, src, n, dst, B, MB, m->scale);
+}
+
+/* Show rectangle of backbuffer (in surface coordinates) on mirror */
+static void fb_mirror_rect(struct fb_mirror_t *m, kx_rect *r)
+{
+	char src[FB_MIRROR_CHUNK * 4];
+	char dst[FB_MIRROR_CHUNK * FB_MIRROR_MAX_SCALE * 4];
+	uint32_t buf[FB_MIRROR_CHUNK * FB_MIRROR_MAX_SCALE + 2];
+	kx_surface *s = &m->surface;
+	const int B = fb.format.byte_pp, MB = m->format.byte_pp;
+	const int k = m->scale;
+	/* Unrotated backbuffer is read in place. Rows of unrotated mirror
+	 * are written by copy engine, rotated one is drawn by its primitives */
+	const int read_direct = (0 == fb.screen.angle);
+	const int write_direct = (0 == s->angle);
+	int x, y, n, j, dx, dy, skip, length, left, right;
+	const char *p;
+	char *d;
+
+	/* Backbuffer columns shown on mirror */
+	left = r->x;
+	if (m->left + left * k + k <= 0) left = (-m->left) / k;
+	right = r->x + r->width;
+	if (m->left + right * k > s->width)
+		right = (s->width - m->left + k - 1) / k;
+	if (left >= right) return;
+
+	for (y = r->y; y < r->y + r->height; y++) {
+		dy = m->top + y * k;
+		if ( (dy + k <= 0) || (dy >= s->height) ) continue;
+
+		for (x = left; x < right; x += n) {
+			n = right - x;
+			if (n > FB_MIRROR_CHUNK) n = FB_MIRROR_CHUNK;
+
+			/* Part of scaled span inside of mirror */
+			dx = m->left + x * k;
+			skip = (dx < 0) ? -dx : 0;
+			length = n * k;
+			if (dx + length > s->width) length = s->width - dx;
+
+			if (read_direct) {
+				p = fb.screen.pixels + FB_OFFSET_0(&fb.screen, x, y, B);
+			} else {
+				fb_read_span(&fb.screen, x, y, n, src);
+				p = src;
+			}
+
+			fb_mirror_convert(m, p, n, dst);
+
+			for (j = 0; j < k; j++) {
+				if ( (dy + j < 0) || (dy + j >= s->height) ) continue;
+
+				if (write_direct) {
+					d = s->pixels + FB_OFFSET_0(s, dx + skip, dy + j, MB);
+					fb_put_span(d, dst + skip * MB, (length - skip) * MB,
+							(char *)buf);
+				} else {
+					s->draw->blit_span(s, dx + skip, dy + j, length - skip,
+							dst + skip * MB);
+				}
+			}
+		}
+	}
+}
+
+#ifdef USE_FB_THREADS
+/* Rectangle shown on mirror by bands */
+struct fb_mirror_job_t {
+	struct fb_mirror_t *m;
+	kx_rect r;
+};
+
+static void fb_mirror_band(void *arg, int band, int bands)
+{
+	struct fb_mirror_job_t *j = arg;
+	kx_rect r = j->r;
+
+	if (fb_band_rect(&r, band, bands))
+		fb_mirror_rect(j->m, &r);
+}
+#endif
+
+/* Show changed parts of backbuffer on all mirrors */
+static void fb_present_mirrors()
+{
+	struct fb_mirror_t *m;
+	kx_rect r;
+	int i, n;
+#ifdef USE_FB_THREADS
+	struct fb_mirror_job_t j;
+#endif
+
+	for (n = 0; n < fb_mirror_count; n++) {
+		m = &fb_mirrors[n];
+		for (i = 0; i < fb.damage_count; i++) {
+			r = fb.damage[i];
+			fb_drawing_rect(&fb.screen, &r);
+#ifdef USE_FB_THREADS
+			if ( (fb_pool.count > 1) && (r.width * r.height * m->scale
+					* m->scale >= FB_BAND_MIN_PIXELS) )
+			{
+				j.m = m;
+				j.r = r;
+				fb_run_bands(fb_mirror_band, &j);
+				continue;
+			}
+#endif
+			fb_mirror_rect(m, &r);
+		}
+#ifdef USE_FB_MEMORY
+		if (m->dump_path)
+			fb_save_pixels(m->dump_path, m->surface.pixels,
+					m->surface.real_width, m->surface.real_height,
+					m->surface.stride, &m->format);
+#endif
+	}
+}
+
+/* Prepare conversion of backbuffer pixels after main format change */
+static void fb_update_mirrors()
+{
+	struct fb_mirror_t *m;
+	uint32_t v, size;
+	int n, i;
+
+	for (n = 0; n < fb_mirror_count; n++) {
+		m = &fb_mirrors[n];
+
+		m->same = (m->format.byte_pp == fb.format.byte_pp)
+				&& !memcmp(m->format.mask, fb.format.mask,
+						sizeof(fb.format.mask))
+#ifdef USE_8BPP
+				&& (FB_CONVERT_PALETTE != m->format.convert)
+				&& (FB_CONVERT_PALETTE != fb.format.convert)
+#endif
+				;
+		if (m->same) continue;
+
+		if (fb.format.byte_pp <= 2) {
+			/* Every pixel value of 8 and 16bpp is converted at once */
+			size = 1U << (8 * fb.format.byte_pp);
+		} else {
+			/* Wider pixel is OR of mirror bits of its bytes when no
+			 * channel crosses byte boundary */
+#ifdef USE_8BPP
+			if (FB_CONVERT_PALETTE == m->format.convert) continue;
+#endif
+			for (i = 0; i < 3; i++) {
+				if (fb.format.offset[i] / 8 != (fb.format.offset[i]
+						+ fb.format.length[i] - 1) / 8) break;
+			}
+			if (i < 3) continue;
+			size = 4 * 256;
+		}
+
+		if (NULL == m->lut) {
+			m->lut = malloc(size * sizeof(*(m->lut)));
+			if (NULL == m->lut) {
+				DPRINTF("Can't allocate memory for mirror colors");
+				continue;
+			}
+		}
+
+		if (fb.format.byte_pp <= 2) {
+			for (v = 0; v < size; v++)
+				m->lut[v] = compose_color(&m->format,
+						fb_pixel_color(&fb.format, v));
+		} else {
+			/* Entry 256 * i + b is for byte i of value b */
+			for (v = 0; v < size; v++)
+				m->lut[v] = compose_color(&m->format, fb_pixel_color(
+						&fb.format, (v & 0xff) << (8 * (v >> 8))));
+		}
 	}
+}
 
-	if (fb_var.bits_per_pixel < 16)
+/* Open framebuffer for mirroring. Spec is DEVICE[:angle] or memory
+ * framebuffer spec. Return -1 on error */
+static int fb_open_mirror(char *spec)
+{
+	struct fb_mirror_t *m = &fb_mirrors[fb_mirror_count];
+	const kx_primitives *primitives = NULL;
+	kx_surface *s = &m->surface;
+	FB main = fb;
+	int angle = 0;
+	char *p;
+
+	/* Device is opened by same code as main one */
+	memset(&fb, 0, sizeof(FB));
+	fb.fd = -1;
+
+#ifdef USE_FB_MEMORY
+	if (!strncmp(spec, "mem:", 4)) {
+		if (-1 == fb_open_memory(spec + 4, &angle))
+			goto fail;
+	} else
+#endif
 	{
-		log_msg(lg,
-			"Error, no support for %i bpp frame buffers\n"
-			"Trying to change pixel format...",
-			fb_var.bits_per_pixel);
-		if (!attempt_to_change_pixel_format(&fb_var))
+		p = strchr(spec, ':');
+		if (NULL != p) {
+			*p = '\0';
+			angle = atoi(p + 1);
+		}
+		if (-1 == fb_open_device(spec))
 			goto fail;
 	}
-	if (ioctl (fb.fd, FBIOGET_VSCREENINFO, &fb_var) == -1)
-	{
-		log_msg(lg, "Error getting variable framebuffer info (2): %s", ERRMSG);
+
+	if (-1 == fb_init_format())
 		goto fail;
+
+	primitives = fb_format_primitives(&fb.format);
+	if (NULL == primitives) {
+		log_msg(lg, "Sorry, bpp (%d) and/or depth (%d) of mirror are not supported yet",
+				fb.format.bpp, fb.format.depth);
+		goto fail;
+	}
+
+	memset(m, 0, sizeof(*m));
+	m->fd = fb.fd;
+	if (fb.fd < 0) m->base = fb.base;
+	m->format = fb.format;
+
+	if ( (90 != angle) && (180 != angle) && (270 != angle) ) angle = 0;
+	s->pixels = fb.data;
+	s->real_width = fb.real_width;
+	s->real_height = fb.real_height;
+	s->width = (angle % 180) ? fb.real_height : fb.real_width;
+	s->height = (angle % 180) ? fb.real_width : fb.real_height;
+	s->stride = fb.stride;
+	s->angle = angle;
+	s->format = &m->format;
+	s->draw = fb_angle_primitives(primitives, angle);
+	s->clip.x = 0;
+	s->clip.y = 0;
+	s->clip.width = s->width;
+	s->clip.height = s->height;
+	s->screen = 0;
+
+	fb = main;
+
+	/* Picture is scaled to fit and centered. Bigger one is cropped */
+	m->scale = s->width / fb.width;
+	if (s->height / fb.height < m->scale) m->scale = s->height / fb.height;
+	if (m->scale < 1) m->scale = 1;
+	if (m->scale > FB_MIRROR_MAX_SCALE) m->scale = FB_MIRROR_MAX_SCALE;
+	m->left = (s->width - fb.width * m->scale) / 2;
+	m->top = (s->height - fb.height * m->scale) / 2;
+
+	s->draw->draw_rect(s, 0, 0, s->width, s->height,
+			compose_color(&m->format, comp2rgba(0, 0, 0, 0)));
+
+#ifdef USE_FB_MEMORY
+	if (fb.dump_path) {
+		/* Mirror frames are saved next to main ones */
+		m->dump_path = malloc(strlen(fb.dump_path) + 12);
+		if (NULL != m->dump_path)
+			sprintf(m->dump_path, "%s.%d", fb.dump_path, fb_mirror_count + 1);
+	}
+#endif
+
+	log_msg(lg, "Mirror %d: %dx%d, %d bpp, angle %d, scale %d",
+			fb_mirror_count + 1, s->real_width, s->real_height,
+			m->format.bpp, angle, m->scale);
+	++fb_mirror_count;
+	return 0;
+
+fail:
+	if (fb.fd >= 0)
+		close(fb.fd);
+	else
+		dispose(fb.base);
+#ifdef USE_8BPP
+	dispose(fb.format.nearest);
+#endif
+	fb = main;
+	return -1;
+}
+
+/* Open mirrors of comma separated list */
+static void fb_open_mirrors(char *list)
+{
+	char *p;
+
+	while ( (NULL != list) && (fb_mirror_count < USE_FB_MIRROR) ) {
+		p = strchr(list, ',');
+		if (NULL != p) *(p++) = '\0';
+		if (-1 == fb_open_mirror(list))
+			log_msg(lg, "Can't mirror to '%s'", list);
+		list = p;
 	}
 
-	/* NB: It looks like the fbdev concept of fixed vs variable screen info is
-	 * broken. The line_length is part of the fixed info but it can be changed
-	 * if you set a new pixel format. */
-	if (ioctl(fb.fd, FBIOGET_FSCREENINFO, &fb_fix) == -1) {
-		log_msg(lg, "Error getting fixed framebuffer info: %s", ERRMSG);
-		goto fail;
+	if ( (NULL != list) && ('\0' != *list) )
+		log_msg(lg, "Only %d mirrors are supported", USE_FB_MIRROR);
+
+	fb_update_mirrors();
+}
+
+/* Close all mirrors */
+static void fb_close_mirrors()
+{
+	struct fb_mirror_t *m;
+	int n;
+
+	for (n = 0; n < fb_mirror_count; n++) {
+		m = &fb_mirrors[n];
+		if (m->fd >= 0)
+			close(m->fd);
+		else
+			dispose(m->base);
+		dispose(m->lut);
+#ifdef USE_8BPP
+		dispose(m->format.nearest);
+#endif
+#ifdef USE_FB_MEMORY
+		dispose(m->dump_path);
+#endif
 	}
+	fb_mirror_count = 0;
+}
+#endif	/* USE_FB_MIRROR */
 
-	fb.real_width = fb.width = fb_var.xres;
-	fb.real_height = fb.height = fb_var.yres;
-	fb.bpp = fb_var.bits_per_pixel;
-	fb.byte_pp = fb.bpp >> 3;
-	fb.stride = fb_fix.line_length;
-	fb.type = fb_fix.type;
-	fb.visual = fb_fix.visual;
+kx_surface *fb_new(int angle)
+{
+	char *fbdev;
+	int back_stride, back_angle;
+#ifdef USE_FB_MIRROR
+	char *devs, *mirrors;
+#endif
+#ifdef USE_FB_DRM
+	int kms;
+#endif
 
-	fb.screensize = fb.stride * fb.height;
-	fb.backbuffer = malloc(fb.screensize);
+	fbdev = getenv("FBDEV");
+#ifdef USE_FB_DRM
+	/* Without FBDEV any KMS card is tried before /dev/fb0 */
+	kms = (NULL == fbdev);
+#endif
+	if (fbdev == NULL)
+		fbdev = "/dev/fb0";
 
-	fb.red_offset = fb_var.red.offset;
-	fb.red_length = fb_var.red.length;
-	fb.green_offset = fb_var.green.offset;
-	fb.green_length = fb_var.green.length;
-	fb.blue_offset = fb_var.blue.offset;
-	fb.blue_length = fb_var.blue.length;
+#ifdef USE_FB_MIRROR
+	/* Other framebuffers of comma separated list show copies */
+	devs = strdup(fbdev);
+	if (NULL == devs) {
+		DPRINTF("Can't allocate memory for framebuffers list");
+		return NULL;
+	}
+	fbdev = devs;
+	mirrors = strchr(devs, ',');
+	if (NULL != mirrors) *(mirrors++) = '\0';
+#endif
+
+	memset(&fb, 0, sizeof(FB));
+
+	fb.fd = -1;
 
-	fb.depth = fb.red_length + fb.green_length + fb.blue_length;
-	if (18 != fb.depth) fb.depth = fb.bpp;	/* according to some info 18bpp is reported as 24bpp */
+#ifdef USE_FB_MEMORY
+	if (!strncmp(fbdev, "mem:", 4)) {
+		if (-1 == fb_open_memory(fbdev + 4, &angle))
+			goto fail;
+	} else
+#endif
+#ifdef USE_FB_DRM
+	if (kms || !strncmp(fbdev, "/dev/dri/", 9)) {
+		if (-1 == fb_open_kms(kms ? NULL : fbdev))
+			goto fail;
+	} else
+#endif
+	if (-1 == fb_open_device(fbdev))
+		goto fail;
 
 	if ((fb.red_offset > fb.green_offset) && (fb.green_offset > fb.blue_offset)) {
 		fb.rgbmode = RGB;
@@ -502,22 +4323,15 @@ int fb_new(int angle)
 		fb.rgbmode = GENERIC;
 	}
 
-	fb.base = (char *) mmap((caddr_t) NULL,
-				 /*fb_fix.smem_len */
-				 fb.stride * fb.height,
-				 PROT_READ | PROT_WRITE,
-				 MAP_SHARED, fb.fd, 0);
+	if (-1 == fb_init_format())
+		goto fail;
 
-	if (fb.base == (char *) -1) {
-		log_msg(lg, "Error cannot mmap framebuffer: %s", ERRMSG);
+	if (-1 == fb_select_primitives()) {
+		/* We have no drawing functions for this mode ATM */
+		log_msg(lg, "Sorry, your bpp (%d) and/or depth (%d) are not supported yet", fb.format.bpp, fb.format.depth);
 		goto fail;
 	}
 
-	off =
-	    (unsigned long) fb_fix.smem_start %
-	    (unsigned long) getpagesize();
-
-	fb.data = fb.base + off;
 	fb.angle = angle;
 
 	switch (fb.angle) {
@@ -525,6 +4339,10 @@ int fb_new(int angle)
 	case 90:
 		fb.width = fb.real_height;
 		fb.height = fb.real_width;
+#ifdef USE_FB_ROTATE
+		/* Draw screen unrotated so drawing goes along backbuffer rows */
+		fb.rotate = 1;
+#endif
 		break;
 	case 180:
 	case 0:
@@ -532,141 +4350,470 @@ int fb_new(int angle)
 		break;
 	}
 
-#ifdef DEBUG
-	print_fb(fb);
+#ifdef USE_FB_MEMORY
+	fb.dump_path = getenv("FBDUMP");
 #endif
 
-	switch (fb.depth) {
-#ifdef USE_32BPP
-	case 32:
-		fb.plot_pixel = fb_plot_pixel_32bpp;
-		fb.draw_hline = fb_draw_hline_32bpp;
-		break;
-#endif
-#ifdef USE_24BPP
-	case 24:
-		fb.plot_pixel = fb_plot_pixel_24bpp;
-		fb.draw_hline = fb_draw_hline_24bpp;
-		break;
+	back_stride = fb.stride;
+	back_angle = fb.angle;
+
+#ifdef USE_FB_ROTATE
+	if (fb.rotate) {
+		back_stride = (fb.width * fb.format.byte_pp + 3) & ~3;
+		back_angle = 0;
+		fb.screen.pixels = malloc(back_stride * fb.height);
+		if (NULL == fb.screen.pixels) {
+			DPRINTF("Can't allocate memory for backbuffer");
+			goto fail;
+		}
+		log_msg(lg, "Backbuffer is rotated while presenting");
+	}
 #endif
-#ifdef USE_18BPP
-	case 18:
-		fb.plot_pixel = fb_plot_pixel_18bpp;
-		fb.draw_hline = fb_draw_hline_18bpp;
-		break;
+
+#ifdef USE_FB_PAN
+	if (FB_PRESENT_PAN == fb.present) {
+		fb.page = 0;
+		fb.vsync = 1;
+		/* Primitives access videomemory by any width. Draw into hidden
+		 * second page only when every width is safe. Otherwise changes
+		 * are copied to it by copy engine. Rotated backbuffer is in
+		 * RAM already */
+		if ( (NULL == fb.screen.pixels) && (1 != sizeof(USE_FB_TRANS_TYPE)) ) {
+			fb.screen.pixels = malloc(fb.screensize);
+			if (NULL == fb.screen.pixels) {
+				DPRINTF("Can't allocate memory for backbuffer");
+				goto fail;
+			}
+			fb.pan_copy = 1;
+		}
+		if (NULL == fb.screen.pixels)
+			fb.screen.pixels = fb_hidden_page();
+#ifdef USE_FB_DRM
+		if (fb.drm)
+			log_msg(lg, "Present mode: page flipping by KMS%s",
+					fb.pan_copy ? ", backbuffer in RAM" : "");
+		else
 #endif
-#ifdef USE_16BPP
-	case 16:
-		fb.plot_pixel = fb_plot_pixel_16bpp;
-		fb.draw_hline = fb_draw_hline_16bpp;
-		break;
+		log_msg(lg, "Present mode: page flipping by panning%s",
+				fb.pan_copy ? ", backbuffer in RAM" : "");
+	} else
 #endif
-	default:
-		/* We have no drawing functions for this mode ATM */
-		log_msg(lg, "Sorry, your bpp (%d) and/or depth (%d) are not supported yet", fb.bpp, fb.depth);
-		fb_destroy(fb);
-		return -1;
-		break;
+	{
+		if (NULL == fb.screen.pixels) {
+			fb.screen.pixels = malloc(fb.screensize);
+			if (NULL == fb.screen.pixels) {
+				DPRINTF("Can't allocate memory for backbuffer");
+				goto fail;
+			}
+		}
+		log_msg(lg, "Present mode: copy from backbuffer");
 	}
 
-	return 0;
+	fb_surface_init(&fb.screen, fb.screen.pixels, fb.width, fb.height,
+			back_stride, back_angle);
+	fb.screen.screen = 1;
+
+	fb.copy_width = sizeof(USE_FB_TRANS_TYPE);
+	fb_select_copy();
+
+#ifdef USE_FB_MIRROR
+	fb_open_mirrors(mirrors);
+	free(devs);
+#endif
+
+#ifdef USE_FB_THREADS
+	fb_pool_start();
+#endif
+
+#ifdef DEBUG
+	print_fb();
+#endif
+
+	/* Videomemory contents are unknown. Whole screen should be rendered */
+	fb_damage(0, 0, fb.width, fb.height);
+
+	return &fb.screen;
 
 fail:
+#ifdef USE_FB_MIRROR
+	free(devs);
+#endif
 	fb_destroy();
-	return -1;
+	return NULL;
+}
+
+/* Pixel format of framebuffer and all surfaces */
+const kx_pixel_format *fb_pixel_format()
+{
+	return &fb.format;
 }
 
 
 /**************************************************************************
  * Graphic primitives
  */
-void fb_plot_pixel(int x, int y, kx_rgba rgba)
+/* Opacity of color: 255 is opaque, 0 is fully transparent */
+#define fb_opacity(rgba)	( 255 - (int)rgba2a(rgba) )
+
+/* Draw horizontal line of composed color limited by clipping rectangle */
+static void fb_clipped_hline(kx_surface *s, int x, int y, int length,
+		kx_rgba color, int opacity)
+{
+	const kx_rect *clip = &s->clip;
+
+	if ( (y < clip->y) || (y >= clip->y + clip->height) ) return;
+
+	if (x < clip->x) {
+		length -= clip->x - x;
+		x = clip->x;
+	}
+	if (x + length > clip->x + clip->width)
+		length = clip->x + clip->width - x;
+
+	if (length <= 0) return;
+
+	if (255 == opacity)
+		s->draw->draw_hline(s, x, y, length, color);
+	else
+		s->draw->blend_rect(s, x, y, length, 1, color, opacity);
+}
+
+void fb_plot_pixel(kx_surface *s, int x, int y, kx_rgba rgba)
 {
 	kx_rgba color;
+	int opacity;
 
-	color = compose_color(rgba);
+	opacity = fb_opacity(rgba);
+	if (0 == opacity) return;
+	if (!fb_prepare_rect(s, x, y, 1, 1, 255 == opacity)) return;
 
-	fb.plot_pixel(x, y, color);
+	color = compose_color(s->format, rgba);
+
+	if (255 == opacity)
+		s->draw->plot_pixel(s, x, y, color);
+	else
+		s->draw->blend_rect(s, x, y, 1, 1, color, opacity);
 }
 
 
-void fb_draw_hline(int x, int y, int length, kx_rgba rgba)
+void fb_draw_hline(kx_surface *s, int x, int y, int length, kx_rgba rgba)
 {
 	kx_rgba color;
+	int opacity;
 
-	color = compose_color(rgba);
+	opacity = fb_opacity(rgba);
+	if (0 == opacity) return;
+	if (!fb_prepare_rect(s, x, y, length, 1, 255 == opacity)) return;
 
-	fb.draw_hline(x, y, length, color);
+	color = compose_color(s->format, rgba);
+
+	fb_clipped_hline(s, x, y, length, color, opacity);
 }
 
 
-void fb_draw_rect(int x, int y, int width, int height,
+void fb_draw_rect(kx_surface *s, int x, int y, int width, int height,
 		kx_rgba rgba)
 {
-	static int dy;
 	kx_rgba color;
+	int opacity;
+
+	opacity = fb_opacity(rgba);
+	if (0 == opacity) return;
+	if (!fb_prepare_rect(s, x, y, width, height, 255 == opacity)) return;
+	fb_clip_rect(s, &x, &y, &width, &height);
 
-	color = compose_color(rgba);
+	color = compose_color(s->format, rgba);
 
-	for (dy = y; dy < y+height; dy++)
-		fb.draw_hline(x, dy, width, color);
+	if (255 == opacity)
+		s->draw->draw_rect(s, x, y, width, height, color);
+	else
+		s->draw->blend_rect(s, x, y, width, height, color, opacity);
 }
 
 
-void fb_draw_rounded_rect(int x, int y, int width, int height,
-		kx_rgba rgba)
+void fb_draw_rounded_rect(kx_surface *s, int x, int y, int width,
+		int height, kx_rgba rgba)
 {
-	static int dy;
+	int dy, opacity;
 	kx_rgba color;
 
 	if (height < 4) return;
+	opacity = fb_opacity(rgba);
+	if (0 == opacity) return;
+	if (!fb_prepare_rect(s, x, y, width, height, 0)) return;
 
-	color = compose_color(rgba);
+	color = compose_color(s->format, rgba);
 
 	/* Top rounded part */
 	dy = y;
-	fb.draw_hline(x+2, dy++, width-4, color);
-	fb.draw_hline(x+1, dy++, width-2, color);
+	fb_clipped_hline(s, x+2, dy++, width-4, color, opacity);
+	fb_clipped_hline(s, x+1, dy++, width-2, color, opacity);
 
 	for (; dy < y+height-2; dy++)
-		fb.draw_hline(x, dy, width, color);
+		fb_clipped_hline(s, x, dy, width, color, opacity);
 
 	/* Bottom rounded part */
-	fb.draw_hline(x+1, dy++, width-2, color);
-	fb.draw_hline(x+2, dy++, width-4, color);
+	fb_clipped_hline(s, x+1, dy++, width-2, color, opacity);
+	fb_clipped_hline(s, x+2, dy++, width-4, color, opacity);
 }
 
 
 /* Font rendering code based on BOGL by Ben Pfaff */
 
-static int font_glyph(const Font * font, char wc, u_int32_t ** bitmap)
+/* Lookup glyph in font. Return glyph width or 0 if there is no glyph */
+static int font_glyph(const Font * font, unsigned char wc, u_int32_t ** bitmap)
 {
 	int mask = font->index_mask;
 	int i;
 
-	for (;;) {
-		for (i = font->offset[wc & mask]; font->index[i]; i += 2) {
-			if ((font->index[i] & ~mask) == (wc & ~mask)) {
-				if (bitmap != NULL)
-					*bitmap =
-					    &font->content[font->
-							   index[i + 1]];
-				return font->index[i] & mask;
-			}
+	for (i = font->offset[wc & mask]; font->index[i]; i += 2) {
+		if ((font->index[i] & ~mask) == (wc & ~mask)) {
+			if (bitmap != NULL)
+				*bitmap =
+				    &font->content[font->
+						   index[i + 1]];
+			return font->index[i] & mask;
 		}
 	}
+
+	if (bitmap != NULL) *bitmap = NULL;
 	return 0;
 }
 
+/*
+ * Font lookup tables and glyphs are shared by all surfaces. They are
+ * only added (atomically) while drawing, so text may be drawn by several
+ * threads at once. Nothing is freed until fb_destroy().
+ */
+
+/* Direct glyph lookup table of font */
+struct fb_font_index_t {
+	const Font *font;
+	int width[256];
+	u_int32_t *bitmap[256];
+	struct fb_glyph_t *glyph[256];	/* Last used glyph of every code */
+	struct fb_font_index_t *next;
+};
+
+static struct fb_font_index_t *fb_font_indexes = NULL;
+
+/* Return lookup table of font. Table is built on first call */
+static struct fb_font_index_t *fb_font_index(const Font *font)
+{
+	struct fb_font_index_t *fi;
+	int i;
+
+	for (fi = fb_font_indexes; NULL != fi; fi = fi->next) {
+		if (font == fi->font) return fi;
+	}
+
+	fi = malloc(sizeof(*fi));
+	if (NULL == fi) {
+		DPRINTF("Can't allocate memory for font index");
+		return NULL;
+	}
+
+	fi->font = font;
+	for (i = 0; i < 256; i++) {
+		fi->width[i] = font_glyph(font, i, &fi->bitmap[i]);
+		fi->glyph[i] = NULL;
+	}
+
+	/* Racing threads may add same font twice. Both tables are valid */
+	do {
+		fi->next = fb_font_indexes;
+	} while (!__sync_bool_compare_and_swap(&fb_font_indexes, fi->next, fi));
+
+	return fi;
+}
+
+/*
+ * Glyphs cache. Glyph is stored in framebuffer pixel format for every
+ * used color together with its coverage mask (font bitmap rows).
+ */
+#define FB_GLYPH_HASH_SIZE	256	/* Should be power of 2 */
+#define FB_GLYPH_CACHE_MAX	512	/* Glyphs are not cached when exceeded */
+
+struct fb_glyph_t {
+	const Font *font;
+	unsigned char code;
+	kx_rgba color;		/* Composed color */
+	int width;
+	int cached;			/* Glyph is in cache, otherwise caller frees it */
+	int run_count;
+	kx_run *runs;		/* Covered pixels */
+	char *pixels;		/* width * height native pixels */
+	struct fb_glyph_t *next;
+};
+
+static struct fb_glyph_t *fb_glyph_cache[FB_GLYPH_HASH_SIZE];
+static int fb_glyph_count = 0;
+
+/* Drop all cached glyphs. Nothing should be drawn at this time */
+static void fb_glyph_cache_flush()
+{
+	struct fb_glyph_t *g, *next;
+	struct fb_font_index_t *fi;
+	int i;
+
+	for (fi = fb_font_indexes; NULL != fi; fi = fi->next)
+		memset(fi->glyph, 0, sizeof(fi->glyph));
+
+	for (i = 0; i < FB_GLYPH_HASH_SIZE; i++) {
+		for (g = fb_glyph_cache[i]; NULL != g; g = next) {
+			next = g->next;
+			free(g);
+		}
+		fb_glyph_cache[i] = NULL;
+	}
+	fb_glyph_count = 0;
+}
+
+static inline unsigned int fb_glyph_hash(const Font *font, unsigned char code,
+		kx_rgba color)
+{
+	return ( ((unsigned long)font >> 4) ^ code ^ (color * 2654435761U) )
+			& (FB_GLYPH_HASH_SIZE - 1);
+}
+
+/* Count set bits */
+static inline int fb_count_bits(u_int32_t v)
+{
+	int n = 0;
+
+	for (; v; v &= v - 1) ++n;
+	return n;
+}
+
+/* Find glyph in cache or render it. Return NULL if font has no such glyph.
+ * Glyph which is not 'cached' should be freed by caller */
+static struct fb_glyph_t *fb_glyph_get(struct fb_font_index_t *fi,
+		unsigned char code, kx_rgba color, int byte_pp)
+{
+	struct fb_glyph_t *g, **head;
+	unsigned int hash;
+	int i, n, w, h, x, y, runs;
+	u_int32_t gl, mask;
+
+	if (0 == fi->width[code]) return NULL;
+
+	/* Text is mostly drawn by same color many times */
+	g = fi->glyph[code];
+	if ( (NULL != g) && (g->color == color) ) return g;
+
+	hash = fb_glyph_hash(fi->font, code, color);
+	head = &fb_glyph_cache[hash];
+	for (g = *head; NULL != g; g = g->next) {
+		if ( (g->font == fi->font) && (g->code == code)
+				&& (g->color == color) )
+		{
+			fi->glyph[code] = g;
+			return g;
+		}
+	}
+
+	w = fi->width[code];
+	h = fi->font->height;
+	n = w * h;
+
+	/* Only bits of glyph width are meaningful */
+	mask = (w >= 32) ? 0xFFFFFFFF : ~(0xFFFFFFFF >> w);
+
+	/* Count runs of set bits. Every run starts with 0->1 transition */
+	runs = 0;
+	for (y = 0; y < h; y++) {
+		gl = fi->bitmap[code][y] & mask;
+		runs += fb_count_bits(gl & ~(gl >> 1));
+	}
+
+	g = malloc(sizeof(*g) + runs * sizeof(kx_run) + n * byte_pp);
+	if (NULL == g) {
+		DPRINTF("Can't allocate memory for glyph");
+		return NULL;
+	}
+
+	g->font = fi->font;
+	g->code = code;
+	g->color = color;
+	g->width = w;
+	g->run_count = runs;
+	g->runs = (kx_run *)(g + 1);
+	g->pixels = (char *)(g->runs + runs);
+
+	/* 1-bit fonts have single color. Coverage is kept in runs */
+	for (i = 0; i < n; i++)
+		fb_store_pixel(g->pixels + i * byte_pp, color, byte_pp);
+
+	runs = 0;
+	for (y = 0; y < h; y++) {
+		gl = fi->bitmap[code][y] & mask;
+		x = 0;
+		while (gl) {
+			while (!(gl & 0x80000000)) {
+				gl <<= 1;
+				++x;
+			}
+			g->runs[runs].y = y;
+			g->runs[runs].x = x;
+			while (gl & 0x80000000) {
+				gl <<= 1;
+				++x;
+			}
+			g->runs[runs].length = x - g->runs[runs].x;
+			++runs;
+		}
+	}
+
+	/* Full cache is not flushed because other threads may draw its glyphs */
+	g->cached = (__sync_add_and_fetch(&fb_glyph_count, 1)
+			<= FB_GLYPH_CACHE_MAX);
+	if (!g->cached) return g;
+
+	do {
+		g->next = *head;
+	} while (!__sync_bool_compare_and_swap(head, g->next, g));
+	fi->glyph[code] = g;
+
+	return g;
+}
+
+/* Copy span of native pixels limited by clipping rectangle.
+ * Pixels are blended when 'opacity' is not NULL */
+static void fb_clipped_blit(kx_surface *s, int x, int y, int length,
+		const char *src, const unsigned char *opacity)
+{
+	const kx_rect *clip = &s->clip;
+
+	if ( (y < clip->y) || (y >= clip->y + clip->height) ) return;
+
+	if (x < clip->x) {
+		length -= clip->x - x;
+		src += (clip->x - x) * s->format->byte_pp;
+		if (NULL != opacity) opacity += clip->x - x;
+		x = clip->x;
+	}
+	if (x + length > clip->x + clip->width)
+		length = clip->x + clip->width - x;
+
+	if (length <= 0) return;
+
+	if (NULL == opacity)
+		s->draw->blit_span(s, x, y, length, src);
+	else
+		s->draw->blend_span(s, x, y, length, src, opacity);
+}
+
 /* Return text width and height in pixels. Will return 0,0 for empty text */
 void fb_text_size(int *width, int *height, const Font * font,
 		const char *text)
 {
-	char *c = (char *) text;
+	unsigned char *c = (unsigned char *) text;
+	struct fb_font_index_t *fi;
 	int n, w, h, mw;
 
 	n = strlenn(text);
-	if (0 == n) {
+	fi = fb_font_index(font);
+	if ( (0 == n) || (NULL == fi) ) {
 		*width = 0;
 		*height = 0;
 		return;
@@ -683,7 +4830,7 @@ void fb_text_size(int *width, int *height, const Font * font,
 			continue;
 		}
 
-		w += font_glyph(font, *c, NULL);
+		w += fi->width[*c];
 	}
 
 	*width = (w > mw) ? w : mw;
@@ -691,34 +4838,44 @@ void fb_text_size(int *width, int *height, const Font * font,
 }
 
 
-int fb_draw_constrained_text(int x, int y,
+int fb_draw_constrained_text(kx_surface *s, int x, int y,
 		int max_x, int max_y, kx_rgba rgba,
 		const Font * font, const char *text)
 {
-	int h, w, cx, cy, dx, dy;
-	char *c = (char *) text;
-	u_int32_t gl;
+	int h, w, dx, dy, i;
+	const int B = s->format->byte_pp;
+	const kx_rect *clip = &s->clip;
+	unsigned char *c = (unsigned char *) text;
+	struct fb_font_index_t *fi;
+	struct fb_glyph_t *g;
+	kx_run *run;
 	kx_rgba color;
 
-	color = compose_color(rgba);
+	/* Text may be partially transparent */
+	fb_text_size(&w, &h, font, text);
+	if (!fb_prepare_rect(s, x, y, w, h, 0))
+		return (h > 0) ? h : font->height;
+
+	fi = fb_font_index(font);
+	color = compose_color(s->format, rgba);
 
 	h = font->height;
 	dx = x; dy = y;
 
 	for(; *c;c++){
-		u_int32_t *glyph = NULL;
-
 		if (*c == '\n') {
 			dy += h;
 			dx = x;
 			continue;
 		}
 
-		w = font_glyph(font, *c, &glyph);
+		g = fb_glyph_get(fi, *c, color, B);
 
-		if (glyph == NULL)
+		if (g == NULL)
 			continue;
 
+		w = g->width;
+
 		/* Wrap by max width if any and if we are not on first char *
 		if ( (max_x > 0) && (dx > x) && (dx + w > max_x) ) {
 			dy += h;
@@ -727,20 +4884,25 @@ int fb_draw_constrained_text(int x, int y,
 
 		/* Stop if max height exceeded */
 		if ( (max_y > 0) && (dy + h > max_y) ) {
+			if (!g->cached) free(g);
 			break;
 		}
 
-		for (cy = 0; cy < h; cy++) {
-			gl = *glyph++;
-
-			for (cx = 0; cx < w; cx++) {
-				if (gl & 0x80000000)
-					fb.plot_pixel(dx + cx,
-						      dy + cy, color);
-				gl <<= 1;
+		if ( (dx >= clip->x) && (dx + w <= clip->x + clip->width)
+			&& (dy >= clip->y) && (dy + h <= clip->y + clip->height) )
+		{
+			/* Whole glyph is visible */
+			s->draw->blit_runs(s, dx, dy, g->runs, g->run_count, g->pixels,
+					w * B);
+		} else {
+			for (i = 0; i < g->run_count; i++) {
+				run = &g->runs[i];
+				fb_clipped_blit(s, dx + run->x, dy + run->y, run->length,
+						g->pixels + (run->y * w + run->x) * B, NULL);
 			}
 		}
 
+		if (!g->cached) free(g);
 		dx += w;
 	}
 
@@ -748,37 +4910,226 @@ int fb_draw_constrained_text(int x, int y,
 }
 
 
-void fb_draw_text(int x, int y, kx_rgba rgba,
+void fb_draw_text(kx_surface *s, int x, int y, kx_rgba rgba,
 		const Font * font, const char *text)
 {
-	fb_draw_constrained_text(x, y, 0, 0, rgba, font, text);
+	fb_draw_constrained_text(s, x, y, 0, 0, rgba, font, text);
 }
 
 
-/* Draw picture on framebuffer */
-void fb_draw_picture(int x, int y, kx_picture *pic)
+/* Kinds of picture pixels */
+enum fb_pixel_kind_t {
+	FB_PIXEL_TRANSPARENT,
+	FB_PIXEL_OPAQUE,
+	FB_PIXEL_TRANSLUCENT
+};
+
+static inline enum fb_pixel_kind_t fb_pixel_kind(kx_rgba rgba)
 {
-	if (NULL == pic) return;
+	switch (rgba2a(rgba)) {
+	case 0:
+		return FB_PIXEL_OPAQUE;
+	case 255:
+		return FB_PIXEL_TRANSPARENT;
+	default:
+		return FB_PIXEL_TRANSLUCENT;
+	}
+}
 
-	unsigned int i, j;
-	int dx = 0, dy = 0;
-	kx_rgba *pixel, color;
+/* Find runs of picture pixels of given kind and store them to 'runs'
+ * if it is not NULL. Return count of runs */
+static int fb_picture_runs(kx_picture *pic, enum fb_pixel_kind_t kind,
+		kx_run *runs)
+{
+	int i, j, n, x;
+	kx_rgba *pixel;
 
+	n = 0;
 	pixel = pic->pixels;
-	dy = y;
 	for (i = 0; i < pic->height; i++) {
-		dx = x;
-		for (j = 0; j < pic->width; j++) {
-			color = *pixel;
-			color = compose_color (color);
-			/* TODO Add transparency processing */
-			/* Draw pixel if not fully transparent */
-			if ((color & 0xFF000000) == 0)
-				fb.plot_pixel(dx, dy, color);
-			++dx;
-			++pixel;
+		x = -1;		/* No run is started */
+		for (j = 0; j <= pic->width; j++) {
+			if ( (j < pic->width) && (fb_pixel_kind(pixel[j]) == kind) ) {
+				if (x < 0) x = j;
+			} else if (x >= 0) {
+				if (NULL != runs) {
+					runs[n].y = i;
+					runs[n].x = x;
+					runs[n].length = j - x;
+				}
+				++n;
+				x = -1;
+			}
+		}
+		pixel += pic->width;
+	}
+
+	return n;
+}
+
+/* Convert 'n' RGBA colors to pixels in framebuffer format.
+ * Common 888 layouts are converted by shifts only. These loops have no
+ * lookups so compiler vectorizes them with SIMD instructions of target */
+void fb_convert_row(const kx_rgba *src, char *dst, int n)
+{
+	uint32_t *d = (uint32_t *)dst;
+	int i;
+
+	if (4 == fb.format.byte_pp) {
+		switch (fb.format.convert) {
+		case FB_CONVERT_RGB888:
+			for (i = 0; i < n; i++)
+				d[i] = src[i] >> 8;
+			return;
+		case FB_CONVERT_BGR888:
+			for (i = 0; i < n; i++)
+				d[i] = (src[i] >> 24) | ((src[i] >> 8) & 0xFF00)
+						| ((src[i] << 8) & 0xFF0000);
+			return;
+		default:
+			break;
 		}
-		++dy;
+	}
+
+	switch (fb.format.byte_pp) {
+	case 4:
+		for (i = 0; i < n; i++)
+			d[i] = compose_color(&fb.format, src[i]);
+		break;
+	case 3:
+		for (i = 0; i < n; i++, dst += 3)
+			FB_STORE_24(dst, compose_color(&fb.format, src[i]));
+		break;
+	case 1:
+		for (i = 0; i < n; i++)
+			FB_STORE_8(dst + i, compose_color(&fb.format, src[i]));
+		break;
+	default:
+		for (i = 0; i < n; i++, dst += 2)
+			FB_STORE_16(dst, compose_color(&fb.format, src[i]));
+		break;
+	}
+}
+
+/* Convert picture to framebuffer format. RGBA pixels are freed */
+int fb_convert_picture(kx_picture *pic)
+{
+	int i, n, count;
+	kx_rgba *pixel;
+	unsigned char *opacity;
+	char *native;
+
+	if (NULL == pic->pixels) return -1;
+
+	n = pic->width * pic->height;
+	native = malloc(n * fb.format.byte_pp);
+	if (NULL == native) {
+		DPRINTF("Can't allocate memory for converted picture");
+		return -1;
+	}
+
+	/* Opaque pixels are copied and translucent ones are blended */
+	pic->run_count = fb_picture_runs(pic, FB_PIXEL_OPAQUE, NULL);
+	pic->blend_count = fb_picture_runs(pic, FB_PIXEL_TRANSLUCENT, NULL);
+
+	count = 0;
+	for (i = 0; i < n; i++) {
+		if (FB_PIXEL_TRANSLUCENT == fb_pixel_kind(pic->pixels[i])) ++count;
+	}
+
+	pic->runs = malloc((pic->run_count + pic->blend_count) * sizeof(kx_run));
+	pic->opacity = malloc(count);
+	if ( ((NULL == pic->runs) && (pic->run_count + pic->blend_count > 0))
+			|| ((NULL == pic->opacity) && (count > 0)) )
+	{
+		DPRINTF("Can't allocate memory for picture runs");
+		free(native);
+		dispose(pic->runs);
+		dispose(pic->opacity);
+		pic->runs = pic->blend_runs = NULL;
+		pic->opacity = NULL;
+		pic->run_count = pic->blend_count = 0;
+		return -1;
+	}
+
+	pic->blend_runs = pic->runs + pic->run_count;
+	fb_picture_runs(pic, FB_PIXEL_OPAQUE, pic->runs);
+	fb_picture_runs(pic, FB_PIXEL_TRANSLUCENT, pic->blend_runs);
+
+	fb_convert_row(pic->pixels, native, n);
+
+	/* Opacities are in same order as pixels of blend runs */
+	opacity = pic->opacity;
+	pixel = pic->pixels;
+	for (i = 0; i < n; i++, pixel++) {
+		if (FB_PIXEL_TRANSLUCENT == fb_pixel_kind(*pixel))
+			*(opacity++) = fb_opacity(*pixel);
+	}
+
+	dispose(pic->pixels);
+	pic->pixels = NULL;
+
+	/* Picture is drawn only when all its parts are ready */
+	__sync_synchronize();
+	pic->native = native;
+	return 0;
+}
+
+/* Draw picture on surface */
+void fb_draw_picture(kx_surface *s, int x, int y, kx_picture *pic)
+{
+	int i, cx, cy, cw, ch, stride;
+	const int B = s->format->byte_pp;
+	const unsigned char *opacity;
+	kx_run *run;
+
+	if (NULL == pic) return;
+
+	if (NULL == pic->native) {
+#ifdef USE_FB_THREADS
+		/* Several bands may need same picture at once */
+		static pthread_mutex_t convert_lock = PTHREAD_MUTEX_INITIALIZER;
+		int ret = 0;
+
+		pthread_mutex_lock(&convert_lock);
+		if (NULL == pic->native) ret = fb_convert_picture(pic);
+		pthread_mutex_unlock(&convert_lock);
+		if (-1 == ret) return;
+#else
+		if (-1 == fb_convert_picture(pic)) return;
+#endif
+	}
+
+	/* Draw only part inside of clipping rectangle */
+	cx = x; cy = y;
+	cw = pic->width; ch = pic->height;
+	if (!fb_prepare_rect(s, cx, cy, cw, ch, 0)) return;
+	fb_clip_rect(s, &cx, &cy, &cw, &ch);
+
+	stride = pic->width * B;
+
+	if ( (cx == x) && (cy == y) && (cw == pic->width) && (ch == pic->height) ) {
+		/* Whole picture is visible */
+		s->draw->blit_runs(s, x, y, pic->runs, pic->run_count, pic->native,
+				stride);
+		if (pic->blend_count > 0)
+			s->draw->blend_runs(s, x, y, pic->blend_runs, pic->blend_count,
+					pic->native, stride, pic->opacity);
+		return;
+	}
+
+	for (i = 0; i < pic->run_count; i++) {
+		run = &pic->runs[i];
+		fb_clipped_blit(s, x + run->x, y + run->y, run->length,
+				pic->native + run->y * stride + run->x * B, NULL);
+	}
+
+	opacity = pic->opacity;
+	for (i = 0; i < pic->blend_count; i++) {
+		run = &pic->blend_runs[i];
+		fb_clipped_blit(s, x + run->x, y + run->y, run->length,
+				pic->native + run->y * stride + run->x * B, opacity);
+		opacity += run->length;
 	}
 }
 
@@ -787,6 +5138,9 @@ void fb_destroy_picture(kx_picture* pic)
 {
 	if (NULL == pic) return;
 	dispose(pic->pixels);
+	dispose(pic->native);
+	dispose(pic->runs);
+	dispose(pic->opacity);
 	free(pic);
 }
 
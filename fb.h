@@ -38,66 +38,158 @@
 #include "res/fonts/font.h"
 #include "rgb.h"
 
-typedef void (*plot_pixel_func)(int x, int y,
-		kx_rgba color);
+/* Rectangle on screen */
+typedef struct {
+	int x, y;
+	int width, height;
+} kx_rect;
 
-typedef void (*draw_hline_func)(int x, int y, int length,
+struct kx_surface;
+
+typedef void (*plot_pixel_func)(struct kx_surface *s, int x, int y,
 		kx_rgba color);
 
-typedef struct FB {
-	int fd;
-	int type;
-	int visual;
-	int width, height;
-	int bpp;
-	int depth;		/* Color depth to enable 18bpp mode */
-	int byte_pp;	/* Byte per pixel, 0 for bpp < 8 */
-	int stride;
-	char *data;
-	char *backbuffer;
-	char *base;
-
-	int screensize;
-	int angle;
-	int real_width, real_height;
+typedef void (*draw_hline_func)(struct kx_surface *s, int x, int y,
+		int length, kx_rgba color);
+
+typedef void (*draw_rect_func)(struct kx_surface *s, int x, int y,
+		int width, int height, kx_rgba color);
+
+/* Copy horizontal span of 'length' pixels in framebuffer format */
+typedef void (*blit_span_func)(struct kx_surface *s, int x, int y,
+		int length, const char *src);
+
+/* Run of covered pixels in image row */
+typedef struct {
+	unsigned short y, x;	/* Position inside of image */
+	unsigned short length;
+} kx_run;
 
-	enum RGBMode rgbmode;
-	int red_offset;
-	int red_length;
-	int green_offset;
-	int green_length;
-	int blue_offset;
-	int blue_length;
+/* Copy 'count' runs of image in framebuffer format. Image has 'stride'
+ * bytes per row and is placed at (x, y) of surface */
+typedef void (*blit_runs_func)(struct kx_surface *s, int x, int y,
+		const kx_run *runs, int count, const char *pixels, int stride);
 
+/* Blending variants of primitives above. Opacity is 0 (transparent)
+ * to 255 (opaque). Spans and runs take opacity of every pixel */
+typedef void (*blend_rect_func)(struct kx_surface *s, int x, int y,
+		int width, int height, kx_rgba color, int opacity);
+
+typedef void (*blend_span_func)(struct kx_surface *s, int x, int y,
+		int length, const char *src, const unsigned char *opacity);
+
+typedef void (*blend_runs_func)(struct kx_surface *s, int x, int y,
+		const kx_run *runs, int count, const char *pixels, int stride,
+		const unsigned char *opacity);
+
+/* Primitives for one pixel format and angle. Work with clipped coordinates */
+typedef struct {
 	plot_pixel_func plot_pixel;
 	draw_hline_func draw_hline;
-} FB;
+	draw_rect_func draw_rect;
+	blit_span_func blit_span;
+	blit_runs_func blit_runs;
+	blend_rect_func blend_rect;
+	blend_span_func blend_span;
+	blend_runs_func blend_runs;
+} kx_primitives;
+
+/* How RGBA colors are converted to pixels */
+enum fb_convert_t {
+	FB_CONVERT_LUT = 0,		/* Any layout, by per-channel lookup tables */
+	FB_CONVERT_RGB888,		/* Red at bits 16-23, blue at bits 0-7 */
+	FB_CONVERT_BGR888,		/* Red at bits 0-7, blue at bits 16-23 */
+	FB_CONVERT_PALETTE		/* Index of nearest palette entry (8bpp) */
+};
+
+/* Pixel format. Built once from channel offsets and lengths */
+typedef struct {
+	/* Channel value 0..255 shifted and scaled to its place in pixel */
+	uint32_t red[256];
+	uint32_t green[256];
+	uint32_t blue[256];
+	uint32_t mask[3];		/* Bits of red, green and blue in pixel */
+	int offset[3], length[3];	/* Red, green and blue channels in pixel */
+#ifdef USE_8BPP
+	/* Palettized format composes RGB565 color by tables above and
+	 * looks it up in cache of nearest palette entries */
+	uint32_t palette[256];	/* RGB888 color of every palette entry */
+	int palette_size;
+	uint16_t *nearest;		/* Palette index + 1 of every RGB565 color */
+#endif
+	enum fb_convert_t convert;
+	int generic;			/* Layout needs per-channel blending */
+	int bpp;
+	int depth;				/* Color depth to enable 18bpp mode */
+	int byte_pp;			/* Byte per pixel, 0 for bpp < 8 */
+} kx_pixel_format;
 
-FB fb;
+/*
+ * Drawing surface. Screen backbuffer is one of surfaces, others are
+ * offscreen images in same pixel format. Drawing functions keep no
+ * state outside of surface, so different surfaces may be drawn by
+ * different threads. Screen should be drawn by one thread at a time.
+ */
+typedef struct kx_surface {
+	char *pixels;
+	int width, height;		/* Size in drawing coordinates */
+	int real_width, real_height;	/* Size of pixels rows and columns */
+	int stride;				/* Bytes per pixels row */
+	int angle;				/* Drawing is rotated by angle into pixels */
+	const kx_pixel_format *format;
+	const kx_primitives *draw;	/* Primitives for format and angle */
+	kx_rect clip;			/* Drawing is allowed inside this rectangle only */
+	int screen;				/* Changes are tracked and shown by fb_render() */
+} kx_surface;
 
 /* Picture structure */
 /* FIXME: store pixels as colors triplets per uint32_t value */
 typedef struct {
 	unsigned int width;		/* picture width */
 	unsigned int height;	/* picture height */
-	kx_rgba *pixels;		/* RGBA array */
+	kx_rgba *pixels;		/* RGBA array, freed after conversion */
+	char *native;			/* Pixels in framebuffer format */
+	kx_run *runs;			/* Runs of opaque pixels in 'native' */
+	int run_count;
+	kx_run *blend_runs;		/* Runs of translucent pixels in 'native' */
+	int blend_count;
+	unsigned char *opacity;	/* Opacity of every pixel in 'blend_runs' */
 } kx_picture;
 
 
 void fb_destroy();
 
-int fb_new(int angle);
+/* Open framebuffer. Return surface of its backbuffer or NULL on error */
+kx_surface *fb_new(int angle);
+
+/* Pixel format of framebuffer and all surfaces */
+const kx_pixel_format *fb_pixel_format();
+
+#ifdef USE_8BPP
+/* Choose palette of 8bpp framebuffer: 'colors' first, then most used
+ * colors of pictures, then grey ramp and color cube. Should be called
+ * before pictures are drawn. Does nothing in other modes */
+void fb_build_palette(const kx_rgba *colors, int count, kx_picture **pics,
+		int pic_count);
+#endif
 
 #ifdef DEBUG
 void print_fb();
 #endif
 
+/* Create offscreen surface in framebuffer pixel format and orientation.
+ * Pixels are not initialized. Return NULL on error */
+kx_surface *fb_surface_new(int width, int height);
+
+/* Free offscreen surface */
+void fb_surface_destroy(kx_surface *s);
+
 void
-fb_draw_rect(int x, int y,
+fb_draw_rect(kx_surface *s, int x, int y,
 		int width, int height, kx_rgba rgba);
 
 void
-fb_draw_rounded_rect(int x, int y,
+fb_draw_rounded_rect(kx_surface *s, int x, int y,
 		int width, int height, kx_rgba rgba);
 
 
@@ -107,25 +199,92 @@ fb_text_size(int *width, int *height,
 		const Font * font, const char *text);
 
 int
-fb_draw_constrained_text(int x, int y,
+fb_draw_constrained_text(kx_surface *s, int x, int y,
 		int max_x, int max_y, kx_rgba rgba,
 		const Font * font, const char *text);
 
 void
-fb_draw_text(int x, int y, kx_rgba rgba,
+fb_draw_text(kx_surface *s, int x, int y, kx_rgba rgba,
 		const Font * font, const char *text);
 
-/* Move backbuffer contents to videomemory */
+/* Copy 'width' x 'height' rectangle at (sx, sy) of 'src' to (x, y) of 'dst'.
+ * Surfaces may be the same one and rectangles may overlap */
+void fb_blit(kx_surface *dst, int x, int y, kx_surface *src,
+		int sx, int sy, int width, int height);
+
+/* Surface contents compressed by pixel rows. Runs of equal pixels keep
+ * only their color. Equal neighbour rows are stored once */
+typedef struct kx_layer {
+	int width, height;		/* Size in drawing coordinates */
+	int real_width, real_height;
+	int angle;
+	uint32_t **rows;		/* Runs of every pixel row */
+	int size;			/* Used memory in bytes */
+} kx_layer;
+
+/* Compress contents of surface into layer. Return NULL on error */
+kx_layer *fb_layer_new(kx_surface *s);
+
+/* Free layer */
+void fb_layer_destroy(kx_layer *l);
+
+/* Restore rectangle of surface from layer made of same sized and
+ * oriented surface */
+void fb_draw_layer(kx_surface *s, kx_layer *l, int x, int y, int width,
+		int height);
+
+#ifdef USE_SPLASH
+/* Serialize layer of screen with framebuffer geometry and pixel format.
+ * Return allocated data or NULL on error */
+char *fb_layer_pack(kx_layer *l, int *size);
+
+/* Restore layer packed by fb_layer_pack(). Return NULL if data is damaged
+ * or was made for other geometry, rotation or pixel format */
+kx_layer *fb_layer_unpack(const char *data, int size);
+#endif
+
+/* Draw part of surface passed by fb_draw_bands(). Must not change clipping */
+typedef void (*fb_band_func)(kx_surface *s, void *arg);
+
+/* Draw rectangle of surface by calling 'draw' with clipping limited to it.
+ * Large rectangles are split into horizontal bands drawn by several threads
+ * with every band clipped to its rows. 'opaque' tells that 'draw' covers
+ * whole rectangle */
+void fb_draw_bands(kx_surface *s, int x, int y, int width, int height,
+		int opaque, fb_band_func draw, void *arg);
+
+/* Limit drawing to rectangle */
+void fb_set_clip(kx_surface *s, int x, int y, int width, int height);
+
+/* Allow drawing on whole surface */
+void fb_reset_clip(kx_surface *s);
+
+/* Mark rectangle of screen as changed. Only changed areas are moved to
+ * videomemory */
+void fb_damage(int x, int y, int width, int height);
+
+/* Move changed parts of backbuffer to videomemory */
 void fb_render();
 
-/* Save backbuffer contents to further usage */
-char *fb_dump();
+#ifdef USE_ANIMATION
+/* Wait for vertical retrace before rendering. Return -1 if it is unknown */
+int fb_wait_vsync();
+#endif
+
+#ifdef USE_FB_MEMORY
+/* Save shown framebuffer contents to PPM file */
+int fb_save_ppm(const char *path);
+#endif
+
+/* Convert 'n' RGBA colors to pixels in framebuffer format. Alpha is ignored */
+void fb_convert_row(const kx_rgba *src, char *dst, int n);
 
-/* Restore saved backbuffer */
-void fb_restore(char *dump);
+/* Convert picture to framebuffer format. RGBA pixels are freed.
+ * Return 0 on success, -1 on error */
+int fb_convert_picture(kx_picture *pic);
 
-/* Draw picture on framebuffer */
-void fb_draw_picture(int x, int y, kx_picture *pic);
+/* Draw picture on surface */
+void fb_draw_picture(kx_surface *s, int x, int y, kx_picture *pic);
 
 /* Free picture's data structure */
 void fb_destroy_picture(kx_picture *pic);
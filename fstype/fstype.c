@@ -12,6 +12,8 @@
 
 #include <sys/types.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <string.h>
 #include <unistd.h>
@@ -157,17 +159,92 @@ static int minix_image(const void *buf, unsigned long long *bytes)
 }
 
 /*
- * Check to see if a filesystem is in /proc/filesystems.
- * Returns 1 if found, 0 if not
+ * Hashed sets of filesystem names known to kernel. They are read once
+ * from /proc/filesystems and modules.dep instead of on every check.
  */
-static int fs_proc_check(const char *fs_name)
+#define FS_HASH_SIZE	64	/* Should be power of 2 */
+
+struct fs_name {
+	struct fs_name *next;
+	char *name;
+};
+
+struct fs_nameset {
+	int loaded;
+	struct fs_name *bucket[FS_HASH_SIZE];
+};
+
+static struct fs_nameset proc_fs;	/* /proc/filesystems */
+static struct fs_nameset module_fs;	/* modules.dep */
+
+static unsigned int fs_hash(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s)
+		h = (h << 5) + h + (unsigned char)*s++;
+	return h & (FS_HASH_SIZE - 1);
+}
+
+static void fs_nameset_add(struct fs_nameset *set, const char *name)
+{
+	struct fs_name *n;
+	unsigned int h;
+
+	if ('\0' == *name)
+		return;
+
+	n = malloc(sizeof(*n));
+	if (!n)
+		return;
+	n->name = strdup(name);
+	if (!n->name) {
+		free(n);
+		return;
+	}
+
+	h = fs_hash(name);
+	n->next = set->bucket[h];
+	set->bucket[h] = n;
+}
+
+static int fs_nameset_has(struct fs_nameset *set, const char *name)
+{
+	struct fs_name *n;
+
+	for (n = set->bucket[fs_hash(name)]; n; n = n->next) {
+		if (!strcmp(n->name, name))
+			return 1;
+	}
+	return 0;
+}
+
+static void fs_nameset_free(struct fs_nameset *set)
+{
+	struct fs_name *n, *next;
+	int i;
+
+	for (i = 0; i < FS_HASH_SIZE; i++) {
+		for (n = set->bucket[i]; n; n = next) {
+			next = n->next;
+			free(n->name);
+			free(n);
+		}
+		set->bucket[i] = NULL;
+	}
+	set->loaded = 0;
+}
+
+/* Read filesystems registered in kernel */
+static void load_proc_filesystems(void)
 {
 	FILE	*f;
 	char	buf[80], *cp, *t;
 
+	proc_fs.loaded = 1;
 	f = fopen("/proc/filesystems", "r");
 	if (!f)
-		return (0);
+		return;
 	while (fgets(buf, sizeof(buf), f)) {
 		cp = buf;
 		if (!isspace(*cp)) {
@@ -182,33 +259,27 @@ static int fs_proc_check(const char *fs_name)
 			*t = 0;
 		if ((t = strchr(cp, ' ')) != NULL)
 			*t = 0;
-		if (!strcmp(fs_name, cp)) {
-			fclose(f);
-			return (1);
-		}
+		fs_nameset_add(&proc_fs, cp);
 	}
 	fclose(f);
-	return (0);
 }
 
-/*
- * Check to see if a filesystem is available as a module
- * Returns 1 if found, 0 if not
- */
-static int check_for_modules(const char *fs_name)
+/* Read names of available modules */
+static void load_modules_dep(void)
 {
 	struct utsname	uts;
 	FILE		*f;
 	char		buf[1024], *cp, *t;
 	int		i;
 
+	module_fs.loaded = 1;
 	if (uname(&uts))
-		return (0);
+		return;
 	snprintf(buf, sizeof(buf), "/lib/modules/%s/modules.dep", uts.release);
 
 	f = fopen(buf, "r");
 	if (!f)
-		return (0);
+		return;
 	while (fgets(buf, sizeof(buf), f)) {
 		if ((cp = strchr(buf, ':')) != NULL)
 			*cp = 0;
@@ -216,19 +287,55 @@ static int check_for_modules(const char *fs_name)
 			continue;
 		if ((cp = strrchr(buf, '/')) != NULL)
 			cp++;
+		else
+			cp = buf;
 		i = strlen(cp);
 		if (i > 3) {
 			t = cp + i - 3;
 			if (!strcmp(t, ".ko"))
 				*t = 0;
 		}
-		if (!strcmp(cp, fs_name)) {
-			fclose(f);
-			return (1);
-		}
+		fs_nameset_add(&module_fs, cp);
 	}
 	fclose(f);
-	return (0);
+}
+
+/*
+ * Check to see if a filesystem is in /proc/filesystems.
+ * Returns 1 if found, 0 if not
+ */
+int fs_proc_check(const char *fs_name)
+{
+	if (!proc_fs.loaded)
+		load_proc_filesystems();
+	return fs_nameset_has(&proc_fs, fs_name);
+}
+
+/*
+ * Check to see if a filesystem is available as a module
+ * Returns 1 if found, 0 if not
+ */
+static int check_for_modules(const char *fs_name)
+{
+	if (!module_fs.loaded)
+		load_modules_dep();
+	return fs_nameset_has(&module_fs, fs_name);
+}
+
+/* Read lists now. Needed before identify_fs() is called from threads */
+void fs_cache_load(void)
+{
+	if (!proc_fs.loaded)
+		load_proc_filesystems();
+	if (!module_fs.loaded)
+		load_modules_dep();
+}
+
+/* Forget cached lists. They will be re-read on next check */
+void fs_cache_reset(void)
+{
+	fs_nameset_free(&proc_fs);
+	fs_nameset_free(&module_fs);
 }
 
 static int base_ext4_image(const void *buf, unsigned long long *bytes,
@@ -509,12 +616,27 @@ static int btrfs_image(const void *buf, unsigned long long *bytes)
 	return 0;
 }
 
+/*
+ * Every image type may have optional signature that is checked before
+ * calling identify(). It is (offset in block, length, bytes) triplet and
+ * allows to skip most of identifiers with a single memcmp.
+ */
 struct imagetype {
 	off_t block;
 	const char name[12];
 	int (*identify) (const void *, unsigned long long *);
+	unsigned int sig_offset;
+	unsigned int sig_len;
+	const char *sig;
 };
 
+#define SIG(type, field, len, magic)	offsetof(type, field), len, magic
+#define NO_SIG				0, 0, NULL
+
+/* Magics stored as little-endian 16-bit values */
+#define EXT2_SIG	SIG(struct ext2_super_block, s_magic, 2, "\x53\xEF")
+#define NILFS_SIG	SIG(struct nilfs_super_block, s_magic, 2, "\x34\x34")
+
 /*
  * Note:
  *
@@ -528,42 +650,91 @@ struct imagetype {
  * The same goes for LUKS as for LVM.
  */
 static struct imagetype images[] = {
-	{0, "gzip", gzip_image},
-	{0, "cramfs", cramfs_image},
-	{0, "romfs", romfs_image},
-	{0, "xfs", xfs_image},
-	{0, "squashfs", squashfs_image},
-	{1, "ext4dev", ext4dev_image},
-	{1, "ext4", ext4_image},
-	{1, "ext3", ext3_image},
-	{1, "ext2", ext2_image},
-	{1, "minix", minix_image},
-	{0, "ubi", ubi_image},
-	{0, "jffs2", jffs2_image},
-	{0, "vfat", vfat_image},
-	{1, "nilfs2", nilfs2_image},
-	{2, "ocfs2", ocfs2_image},
-	{8, "reiserfs", reiserfs_image},
-	{64, "reiserfs", reiserfs_image},
-	{64, "reiser4", reiser4_image},
-	{64, "gfs2", gfs2_image},
-	{64, "btrfs", btrfs_image},
-	{32, "jfs", jfs_image},
-	{32, "iso9660", iso_image},
-	{0, "luks", luks_image},
-	{0, "lvm2", lvm2_image},
-	{1, "lvm2", lvm2_image},
-	{-1, "swap", swap_image},
-	{-1, "suspend", suspend_image},
-	{0, "", NULL}
+	{0, "gzip", gzip_image, 0, 1, "\037"},
+	{0, "cramfs", cramfs_image, NO_SIG},
+	{0, "romfs", romfs_image, NO_SIG},
+	{0, "xfs", xfs_image, SIG(struct xfs_sb, sb_magicnum, 4, "XFSB")},
+	{0, "squashfs", squashfs_image, NO_SIG},
+	{1, "ext4dev", ext4dev_image, EXT2_SIG},
+	{1, "ext4", ext4_image, EXT2_SIG},
+	{1, "ext3", ext3_image, EXT2_SIG},
+	{1, "ext2", ext2_image, EXT2_SIG},
+	{1, "minix", minix_image, NO_SIG},
+	{0, "ubi", ubi_image, 0, 4, "UBI#"},
+	{0, "jffs2", jffs2_image, 0, 2, "\x85\x19"},
+	{0, "vfat", vfat_image, NO_SIG},
+	{1, "nilfs2", nilfs2_image, NILFS_SIG},
+	{2, "ocfs2", ocfs2_image, SIG(struct ocfs2_dinode, i_signature,
+		sizeof(OCFS2_SUPER_BLOCK_SIGNATURE) - 1, OCFS2_SUPER_BLOCK_SIGNATURE)},
+	{8, "reiserfs", reiserfs_image, NO_SIG},
+	{64, "reiserfs", reiserfs_image, NO_SIG},
+	{64, "reiser4", reiser4_image, SIG(struct reiser4_master_sb, ms_magic,
+		sizeof(REISER4_SUPER_MAGIC_STRING) - 1, REISER4_SUPER_MAGIC_STRING)},
+	{64, "gfs2", gfs2_image, NO_SIG},
+	{64, "btrfs", btrfs_image, SIG(struct btrfs_super_block, magic,
+		BTRFS_MAGIC_L, BTRFS_MAGIC)},
+	{32, "jfs", jfs_image, SIG(struct jfs_superblock, s_magic, 4, JFS_MAGIC)},
+	{32, "iso9660", iso_image, NO_SIG},
+	{0, "luks", luks_image, SIG(struct luks_partition_header, magic,
+		LUKS_MAGIC_L, LUKS_MAGIC)},
+	{0, "lvm2", lvm2_image, NO_SIG},
+	{1, "lvm2", lvm2_image, NO_SIG},
+	{-1, "swap", swap_image, NO_SIG},
+	{-1, "suspend", suspend_image, NO_SIG},
+	{0, "", NULL, NO_SIG}
 };
 
+/* Probe window: all blocks used in images[] (0..64) */
+#define PROBE_BLOCKS	(FS_PROBE_SIZE / BLOCK_SIZE)
+
+/* Identify FS by probe window 'buf' of 'len' bytes. Swap superblock
+ * is taken from 'swap_buf' when it is outside of window */
+static int identify_window(const char *buf, ssize_t len,
+		const char *swap_buf, const char **fstype,
+		unsigned long long *bytes)
+{
+	off_t swap_block;
+	const char *blk;
+	off_t block;
+	struct imagetype *ip;
+
+	/* Hack for swap, which apparently is dependent on page size */
+	swap_block = SWAP_OFFSET();
+	if (swap_block >= PROBE_BLOCKS && !swap_buf)
+		swap_block = -2;	/* Don't try it */
+
+	for (ip = images; ip->identify; ip++) {
+		block = (-1 == ip->block) ? swap_block : ip->block;
+
+		if (block < 0)
+			continue;
+		if (block >= PROBE_BLOCKS)
+			blk = swap_buf;
+		else if ((block + 1) * BLOCK_SIZE <= len)
+			blk = buf + block * BLOCK_SIZE;
+		else
+			continue;	/* Device is too small */
+
+		/* Check signature index first */
+		if (ip->sig && memcmp(blk + ip->sig_offset, ip->sig, ip->sig_len))
+			continue;
+
+		if (ip->identify(blk, bytes)) {
+			*fstype = ip->name;
+			return 0;
+		}
+	}
+
+	return 1;	/* Unknown filesystem */
+}
+
 int identify_fs(int fd, const char **fstype,
 		unsigned long long *bytes, off_t offset)
 {
-	uint64_t buf[BLOCK_SIZE >> 3];	/* 64-bit worst case alignment */
-	off_t cur_block = (off_t) - 1;
-	struct imagetype *ip;
+	char *buf;
+	char swap_buf[BLOCK_SIZE];
+	const char *swap = NULL;
+	ssize_t len;
 	int ret;
 	unsigned long long dummy;
 
@@ -573,27 +744,42 @@ int identify_fs(int fd, const char **fstype,
 	*fstype = NULL;
 	*bytes = 0;
 
-	for (ip = images; ip->identify; ip++) {
-		/* Hack for swap, which apparently is dependent on page size */
-		if (ip->block == -1)
-			ip->block = SWAP_OFFSET();
-
-		if (cur_block != ip->block) {
-			/*
-			 * Read block.
-			 */
-			cur_block = ip->block;
-			ret = pread(fd, buf, BLOCK_SIZE,
-				    offset + cur_block * BLOCK_SIZE);
-			if (ret != BLOCK_SIZE)
-				return -1;	/* error */
-		}
+	/* Read whole probe window at once. malloc() gives us worst case
+	 * alignment needed by superblock structures */
+	buf = malloc(PROBE_BLOCKS * BLOCK_SIZE);
+	if (!buf)
+		return -1;
 
-		if (ip->identify(buf, bytes)) {
-			*fstype = ip->name;
-			return 0;
-		}
+	len = pread(fd, buf, PROBE_BLOCKS * BLOCK_SIZE, offset);
+	if (len < BLOCK_SIZE) {
+		free(buf);
+		return -1;	/* error */
 	}
 
-	return 1;		/* Unknown filesystem */
+	/* Swap superblock is outside of window on huge pages only */
+	if (SWAP_OFFSET() >= PROBE_BLOCKS &&
+	    pread(fd, swap_buf, BLOCK_SIZE,
+		  offset + SWAP_OFFSET() * BLOCK_SIZE) == BLOCK_SIZE)
+		swap = swap_buf;
+
+	ret = identify_window(buf, len, swap, fstype, bytes);
+	free(buf);
+	return ret;
+}
+
+int identify_fs_buf(const char *buf, ssize_t len, const char **fstype,
+		unsigned long long *bytes)
+{
+	unsigned long long dummy;
+
+	if (!bytes)
+		bytes = &dummy;
+
+	*fstype = NULL;
+	*bytes = 0;
+
+	if (len < BLOCK_SIZE)
+		return -1;	/* error */
+
+	return identify_window(buf, len, NULL, fstype, bytes);
 }
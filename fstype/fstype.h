@@ -14,7 +14,24 @@
 
 #include <unistd.h>
 
+/* Size of device start that is enough to identify any FS */
+#define FS_PROBE_SIZE	(65 * 1024)
+
 int identify_fs(int fd, const char **fstype,
 		unsigned long long *bytes, off_t offset);
 
+/* Identify FS by device start already read into 'buf' ('len' bytes).
+ * Swap superblock beyond FS_PROBE_SIZE (huge pages) is not checked */
+int identify_fs_buf(const char *buf, ssize_t len, const char **fstype,
+		unsigned long long *bytes);
+
+/* Check that filesystem is registered in kernel (cached /proc/filesystems) */
+int fs_proc_check(const char *fs_name);
+
+/* Read lists of filesystems and modules if not cached yet */
+void fs_cache_load(void);
+
+/* Forget cached lists of filesystems and modules */
+void fs_cache_reset(void);
+
 #endif
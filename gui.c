@@ -33,35 +33,35 @@
 #include "res/theme-gui.h"
 
 
-/* Draw background with logo */
-void draw_background_low(struct gui_t *gui)
+/* Draw background with logo on surface 's' */
+void draw_background_low(struct gui_t *gui, kx_surface *s)
 {
-	static int w, h;
+	int w, h;
 
 	/* Fill background */
-	fb_draw_rect(0, 0, fb.width, fb.height, CLR_BG);
+	fb_draw_rect(s, 0, 0, s->width, s->height, CLR_BG);
 
 #ifdef USE_ICONS
 	/* Draw icon pad */
-	fb_draw_rounded_rect(gui->x + LYT_HDR_PAD_LEFT,
+	fb_draw_rounded_rect(s, gui->x + LYT_HDR_PAD_LEFT,
 			gui->y + LYT_HDR_PAD_TOP,
 			LYT_HDR_PAD_WIDTH, LYT_HDR_PAD_HEIGHT, CLR_BG_PAD);
 
 	/* Draw icon */
-	fb_draw_picture(gui->x + LYT_HDR_PAD_LEFT + LYT_PAD_ICON_LOFF,
+	fb_draw_picture(s, gui->x + LYT_HDR_PAD_LEFT + LYT_PAD_ICON_LOFF,
 			gui->y + LYT_HDR_PAD_TOP + LYT_PAD_ICON_TOFF,
 			gui->icons[ICON_LOGO]);
 #endif
 
 	/* Draw menu frame */
-	fb_draw_rounded_rect(gui->x + LYT_MENU_FRAME_LEFT,
+	fb_draw_rounded_rect(s, gui->x + LYT_MENU_FRAME_LEFT,
 			gui->y + LYT_MENU_FRAME_TOP,
 			LYT_MENU_FRAME_WIDTH,
 			LYT_MENU_FRAME_HEIGHT,
 			CLR_MENU_FRAME);
 
 	/* Draw menu area */
-	fb_draw_rounded_rect(gui->x + LYT_MENU_AREA_LEFT,
+	fb_draw_rounded_rect(s, gui->x + LYT_MENU_AREA_LEFT,
 			gui->y + LYT_MENU_AREA_TOP,
 			LYT_MENU_AREA_WIDTH,
 			LYT_MENU_AREA_HEIGHT,
@@ -69,17 +69,26 @@ void draw_background_low(struct gui_t *gui)
 	
 	/* Draw kexecboot version right aligned at bottom */
 	fb_text_size(&w, &h, DEFAULT_FONT, "v." PACKAGE_VERSION);
-	fb_draw_text(gui->x + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH - w,
+	fb_draw_text(s, gui->x + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH - w,
 			gui->y + LYT_MENU_FRAME_TOP + LYT_MENU_FRAME_HEIGHT + (LYT_FTR_HEIGHT - h)/2,
 			CLR_BG_TEXT, DEFAULT_FONT, "v." PACKAGE_VERSION);
 	
 }
 
 
-struct gui_t *gui_init(int angle)
+#ifdef USE_8BPP
+/* Theme colors are put into palette of 8bpp framebuffer first */
+static const kx_rgba theme_colors[] = {
+	CLR_BG, CLR_BG_PAD, CLR_BG_TEXT, CLR_MENU_BG, CLR_MENU_FRAME,
+	CLR_MNI_BG, CLR_MNI_PAD, CLR_MNI_LINE, CLR_MNI_TEXT,
+	CLR_SMNI_BG, CLR_SMNI_PAD, CLR_SMNI_LINE, CLR_SMNI_TEXT
+};
+#endif
+
+struct gui_t *gui_init(int angle, const char *splash, int splash_size)
 {
 	struct gui_t *gui;
-	int ret;
+	kx_surface *screen;
 	gui = malloc(sizeof(*gui));
 	if (NULL == gui) {
 		DPRINTF("Can't allocate memory for GUI structure");
@@ -87,31 +96,47 @@ struct gui_t *gui_init(int angle)
 	}
 
 	/* init framebuffer */
-	ret = fb_new(angle);
+	screen = fb_new(angle);
 
-	if (-1 == ret) {
+	if (NULL == screen) {
 		log_msg(lg, "Can't initialize framebuffer");
 		free(gui);
 		return NULL;
 	}
+	gui->screen = screen;
 
 	/* Tune GUI size */
 #ifdef USE_FBUI_WIDTH
-	if (fb.width > USE_FBUI_WIDTH)
+	if (screen->width > USE_FBUI_WIDTH)
 		gui->width = USE_FBUI_WIDTH;
 	else
 #endif
-		gui->width = fb.width;
+		gui->width = screen->width;
 
 #ifdef USE_FBUI_HEIGHT
-	if (fb.height > USE_FBUI_HEIGHT)
+	if (screen->height > USE_FBUI_HEIGHT)
 		gui->height = USE_FBUI_HEIGHT;
 	else
 #endif
-		gui->height = fb.height;
-
-	gui->x = (fb.width - gui->width)/2;
-	gui->y = (fb.height - gui->height)/2;
+		gui->height = screen->height;
+
+	gui->x = (screen->width - gui->width)/2;
+	gui->y = (screen->height - gui->height)/2;
+
+#ifdef USE_SPLASH
+	/* Show menu saved by previous run while icons are parsed and
+	 * devices are scanned */
+	gui->first_frame = 0;
+	if (NULL != splash) {
+		kx_layer *l = fb_layer_unpack(splash, splash_size);
+		if (NULL != l) {
+			fb_draw_layer(screen, l, 0, 0, screen->width, screen->height);
+			fb_layer_destroy(l);
+			fb_render();
+			gui->first_frame = get_time_us();
+		}
+	}
+#endif
 
 #ifdef USE_ICONS
 	/* Parse compiled images.
@@ -133,16 +158,71 @@ struct gui_t *gui_init(int angle)
 	gui->icons[ICON_EXIT] = xpm_parse_image(exit_xpm, ROWS(exit_xpm));
 #endif
 
+#ifdef USE_8BPP
+#ifdef USE_ICONS
+	fb_build_palette(theme_colors, ROWS(theme_colors), gui->icons,
+			ICON_ARRAY_SIZE);
+#else
+	fb_build_palette(theme_colors, ROWS(theme_colors), NULL, 0);
+#endif
+#endif
+
+	gui->shown_level = NULL;
+	gui->shown_text = NULL;
+	gui->firstslot = 0;
+	gui->item_images = NULL;
+	gui->item_image_count = 0;
+	gui->item_image_size = 0;
+#ifdef USE_ANIMATION
+	gui->anim.active = 0;
+	gui->frame_count = 0;
+	gui->dropped_count = 0;
+#endif
+
 #ifdef USE_BG_BUFFER
-	/* Pre-draw background and store it in special buffer */
-	draw_background_low(gui);
-	gui->bg_buffer = fb_dump();
+	/* Pre-draw background and keep it compressed. Screen is fully
+	 * redrawn by first frame anyway */
+	draw_background_low(gui, screen);
+	gui->bg_buffer = fb_layer_new(screen);
+	if (NULL != gui->bg_buffer)
+		log_msg(lg, "Background layer: %d bytes instead of %d",
+				gui->bg_buffer->size, screen->stride * screen->real_height);
+	else
+		log_msg(lg, "bg_buffer is empty");
+#endif
+
+#ifdef USE_SPLASH
+	/* Nothing is saved yet. Show logo at least */
+	if (0 == gui->first_frame) {
+#ifndef USE_BG_BUFFER
+		draw_background_low(gui, screen);
+#endif
+		fb_render();
+		gui->first_frame = get_time_us();
+	}
 #endif
 
 	return gui;
 }
 
 
+#ifdef USE_SPLASH
+/* Pack screen contents to be shown by gui_init() on next run */
+char *gui_pack_splash(struct gui_t *gui, int *size)
+{
+	kx_layer *l;
+	char *data;
+
+	l = fb_layer_new(gui->screen);
+	if (NULL == l) return NULL;
+
+	data = fb_layer_pack(l, size);
+	fb_layer_destroy(l);
+	return data;
+}
+#endif
+
+
 /* Destroy gui */
 void gui_destroy(struct gui_t *gui)
 {
@@ -157,6 +237,12 @@ void gui_destroy(struct gui_t *gui)
 	free(gui->icons);
 #endif
 
+	gui_invalidate_menu(gui);
+	dispose(gui->item_images);
+
+#ifdef USE_BG_BUFFER
+	fb_layer_destroy(gui->bg_buffer);
+#endif
 	fb_destroy();
 	free(gui);
 }
@@ -164,21 +250,27 @@ void gui_destroy(struct gui_t *gui)
 
 /* Clear screen */
 void gui_clear(struct gui_t *gui) {
-	fb_draw_rect(0, 0, fb.width, fb.height, CLR_BG);
+	gui->shown_level = NULL;
+	gui->shown_text = NULL;
+#ifdef USE_ANIMATION
+	gui->anim.active = 0;
+#endif
+	fb_draw_rect(gui->screen, 0, 0, gui->screen->width, gui->screen->height,
+			CLR_BG);
 	fb_render();
 }
 
 
 /* Draw text */
-void draw_bg_text(struct gui_t *gui, const char *text)
+void draw_bg_text(struct gui_t *gui, kx_surface *s, const char *text)
 {
-	static int w, h;
+	int w, h;
 
 	/* Calculate text size */
 	fb_text_size(&w, &h, DEFAULT_FONT, text);
 
 	/* Draw text */
-	fb_draw_text(gui->x + LYT_HDR_PAD_LEFT + LYT_HDR_PAD_WIDTH + 2 +
+	fb_draw_text(s, gui->x + LYT_HDR_PAD_LEFT + LYT_HDR_PAD_WIDTH + 2 +
 			(gui->width - (LYT_HDR_PAD_LEFT + LYT_HDR_PAD_WIDTH + 2)*2 - w - LYT_FRAME_SIZE)/2,
 			gui->y + (LYT_MENU_FRAME_TOP - h)/2,
 			CLR_BG_TEXT, DEFAULT_FONT, text);
@@ -186,75 +278,189 @@ void draw_bg_text(struct gui_t *gui, const char *text)
 
 
 /* Draw background and text */
-void draw_background(struct gui_t *gui, const char *text)
+void draw_background(struct gui_t *gui, kx_surface *s, const char *text)
 {
 #ifdef USE_BG_BUFFER
 	if (NULL != gui->bg_buffer) {
 		/* If we have bg buffer use it */
-		fb_restore(gui->bg_buffer);
+		fb_draw_layer(s, gui->bg_buffer, 0, 0,
+				gui->bg_buffer->width, gui->bg_buffer->height);
 	} else {
 		/* else draw bg */
-		draw_background_low(gui);
-		log_msg(lg, "bg_buffer is empty");
+		draw_background_low(gui, s);
 	}
 #else
 	/* Have bg buffer disabled. Draw bg */
-	draw_background_low(gui);
+	draw_background_low(gui, s);
 #endif
 	/* Draw text on bg */
-	draw_bg_text(gui, text);
+	draw_bg_text(gui, s, text);
 }
 
 
-/* Draw one slot in menu */
-void draw_slot(struct gui_t *gui, kx_menu_item *item, int slot, int height,
-		int iscurrent)
+/* Draw log text in menu area */
+void draw_log_text(struct gui_t *gui, kx_surface *s, kx_text *text)
 {
-	static kx_rgba cbg, cpad, ctext, cline;
-	static int slot_top, w, h, h2;
-	
+	int i, y;
+	int max_x, max_y;
+
+	/* Size constraints */
+	max_x = gui->x + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH;
+	max_y = gui->y + LYT_MENU_AREA_TOP + LYT_MENU_AREA_HEIGHT;
+
+	for (i = text->current_line_no, y = gui->y + LYT_MENU_AREA_TOP;
+		( (i < text->rows->fill) && (y < max_y) );
+		 i++
+	) {
+		y += fb_draw_constrained_text(s, gui->x + LYT_MENU_AREA_LEFT, y,
+				max_x, max_y,
+				CLR_MNI_TEXT, DEFAULT_FONT,
+				text->rows->list[i]);
+	}
+}
+
+
+/* Whole screen frame. It is drawn by bands */
+struct gui_frame_t {
+	struct gui_t *gui;
+	const char *msg;	/* Text near logo */
+	kx_text *text;		/* Log text or NULL */
+};
+
+static void draw_frame_band(kx_surface *s, void *arg)
+{
+	struct gui_frame_t *f = arg;
+
+	draw_background(f->gui, s, f->msg);
+	if (NULL != f->text)
+		draw_log_text(f->gui, s, f->text);
+}
+
+/* Draw background with message and optional log text on screen */
+void draw_frame(struct gui_t *gui, const char *msg, kx_text *text)
+{
+	struct gui_frame_t f;
+
+	f.gui = gui;
+	f.msg = msg;
+	f.text = text;
+	fb_draw_bands(gui->screen, 0, 0, gui->screen->width,
+			gui->screen->height, 1, draw_frame_band, &f);
+}
+
+
+/* Height of log row 'i' as it is drawn by draw_log_text() */
+static int log_row_height(kx_text *text, int i)
+{
+	int w, h;
+
+	fb_text_size(&w, &h, DEFAULT_FONT, text->rows->list[i]);
+	return (h > 0) ? h : DEFAULT_FONT->height;
+}
+
+
+/*
+ * Redraw log view shown from row 'shown_line_no' of 'shown_fill' rows.
+ * Rows shown wholly before and now are moved on screen, the rest of menu
+ * area is redrawn. Rows longer than menu area run over frame, so whole
+ * screen width right of area is moved. It is plain background there
+ * except of rounded corners of menu area
+ */
+static void scroll_log_text(struct gui_t *gui, kx_text *text)
+{
+	struct gui_frame_t f;
+	kx_surface *s = gui->screen;
+	int i, h, d, ya, yb, top, max_y, left, width;
+	int first = text->current_line_no;
+	int shown = gui->shown_line_no;
+
+	top = gui->y + LYT_MENU_AREA_TOP;
+	max_y = top + LYT_MENU_AREA_HEIGHT;
+	left = gui->x + LYT_MENU_AREA_LEFT;
+	width = s->width - left;
+
+	/* Rows are moved down by 'd' pixels */
+	d = 0;
+	for (i = first; (i < shown) && (d < LYT_MENU_AREA_HEIGHT); i++)
+		d += log_row_height(text, i);
+	for (i = shown; (i < first) && (-d < LYT_MENU_AREA_HEIGHT); i++)
+		d -= log_row_height(text, i);
+
+	/* Rows from 'ya' to 'yb' are kept */
+	ya = yb = top + ( (d > 0) ? d : 0 );
+	for (i = (first > shown) ? first : shown;
+			(i < gui->shown_fill) && (i < text->rows->fill); i++)
+	{
+		h = log_row_height(text, i);
+		if ( (yb + h > max_y) || (yb - d + h > max_y) ) break;
+		yb += h;
+	}
+
+	/* Rounded corners of menu area are neither moved nor overwritten */
+	if (ya < top + 2) ya = top + 2;
+	if (ya - d < top + 2) ya = top + 2 + d;
+	if (yb > max_y - 2) yb = max_y - 2;
+	if (yb - d > max_y - 2) yb = max_y - 2 + d;
+	if (yb <= ya) ya = yb = max_y;
+
+	if (0 != d)
+		fb_blit(s, left, ya, s, left, ya - d, width, yb - ya);
+
+	f.gui = gui;
+	f.msg = "KEXECBOOT";
+	f.text = text;
+	fb_draw_bands(s, left, top, width, ya - top, 1, draw_frame_band, &f);
+	fb_draw_bands(s, left, yb, width, max_y - yb, 1, draw_frame_band, &f);
+}
+
+
+/* Draw selection highlight of slot at ('left', 'top') */
+static void draw_highlight(struct gui_t *gui, kx_surface *s, int left, int top,
+		int height)
+{
+	fb_draw_rounded_rect(s, left, top, LYT_MNI_WIDTH, height, CLR_SMNI_LINE);
+	fb_draw_rounded_rect(s, left + 1, top + 1, LYT_MNI_WIDTH - 2, height - 2,
+			CLR_SMNI_BG);
+}
+
+
+/* Draw icon and text of menu item in slot at ('left', 'top') */
+static void draw_item_content(struct gui_t *gui, kx_surface *s,
+		kx_menu_item *item, int left, int top, int height, int iscurrent)
+{
+	kx_rgba cpad, ctext, cline;
+	int w, h, h2;
+#ifdef USE_ICONS
+	kx_picture *icon;
+#endif
+
 	if (!iscurrent) {
-		cbg =   CLR_MNI_BG;
 		cpad =  CLR_MNI_PAD;
 		ctext = CLR_MNI_TEXT;
 		cline = CLR_MNI_LINE;
 	} else {
-		cbg =   CLR_SMNI_BG;
 		cpad =  CLR_SMNI_PAD;
 		ctext = CLR_SMNI_TEXT;
 		cline = CLR_SMNI_LINE;
 	}
 	
 #ifdef USE_ICONS
-	static kx_picture *icon;
 	icon = (kx_picture *)item->data;
 #endif
 
-	slot_top = gui->y + LYT_MENU_AREA_TOP + LYT_MNI_HEIGHT * (slot-1); /* Slots are numbered from 1 */
-
-	/* Draw background */
-	if (iscurrent) {
-		fb_draw_rounded_rect(gui->x + LYT_MNI_LEFT,
-				slot_top,
-				LYT_MNI_WIDTH,
-				height, cline);
-
-		fb_draw_rounded_rect(gui->x + LYT_MNI_LEFT + 1,
-				slot_top + 1,
-				LYT_MNI_WIDTH - 2,
-				height - 2, cbg);
-	}
+	/* Layout offsets are given relative to GUI origin */
+	left -= LYT_MNI_LEFT;
 
 #ifdef USE_ICONS
 	/* Draw icon pad */
-	fb_draw_rounded_rect(gui->x + LYT_MNI_PAD_LEFT,
-			slot_top + LYT_MNI_PAD_TOP,
+	fb_draw_rounded_rect(s, left + LYT_MNI_PAD_LEFT,
+			top + LYT_MNI_PAD_TOP,
 			LYT_MNI_PAD_WIDTH, LYT_MNI_PAD_HEIGHT, cpad);
 
 	/* Draw icon */
 	if (NULL != icon) {
-		fb_draw_picture(gui->x + LYT_MNI_PAD_LEFT + LYT_PAD_ICON_LOFF,
-				slot_top + LYT_MNI_PAD_TOP + LYT_PAD_ICON_TOFF,
+		fb_draw_picture(s, left + LYT_MNI_PAD_LEFT + LYT_PAD_ICON_LOFF,
+				top + LYT_MNI_PAD_TOP + LYT_PAD_ICON_TOFF,
 				icon);
 	}
 #endif
@@ -263,8 +469,8 @@ void draw_slot(struct gui_t *gui, kx_menu_item *item, int slot, int height,
 	fb_text_size(&w, &h, DEFAULT_FONT, item->label);
 
 	/* Draw label text. Align middle unless description exists */
-	fb_draw_text(gui->x + LYT_MNI_TEXT_LEFT,
-			slot_top + (item->description ? LYT_MNI_PAD_TOP : (height - h)/2),
+	fb_draw_text(s, left + LYT_MNI_TEXT_LEFT,
+			top + (item->description ? LYT_MNI_PAD_TOP : (height - h)/2),
 			ctext, DEFAULT_FONT, item->label);
 
 	/* Draw description if available */
@@ -274,8 +480,8 @@ void draw_slot(struct gui_t *gui, kx_menu_item *item, int slot, int height,
 		fb_text_size(&w, &h, DEFAULT_FONT, item->description);
 
 		/* Draw description right aligned */
-		fb_draw_text(gui->x + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH - w - 3,
-				slot_top + LYT_MNI_PAD_TOP + h2 + 1,
+		fb_draw_text(s, left + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH - w - 3,
+				top + LYT_MNI_PAD_TOP + h2 + 1,
 				cline, DEFAULT_FONT, item->description);
 	}
 
@@ -285,14 +491,326 @@ void draw_slot(struct gui_t *gui, kx_menu_item *item, int slot, int height,
 	*/
 
 	/* Draw line *
-	fb_draw_rect(fb, gui->x + LYT_MNI_LEFT,
-			slot_top + LYT_MNI_LINE_TOP,
+	fb_draw_rect(fb, left + LYT_MNI_LEFT,
+			top + LYT_MNI_LINE_TOP,
 			LYT_MNI_LINE_WIDTH,
 			LYT_MNI_LINE_HEIGHT, cline);
 	*/
 }
 
 
+/* Draw menu item on surface 's' in slot rectangle at ('left', 'top') */
+static void draw_item(struct gui_t *gui, kx_surface *s, kx_menu_item *item,
+		int left, int top, int height, int iscurrent)
+{
+	if (iscurrent)
+		draw_highlight(gui, s, left, top, height);
+	draw_item_content(gui, s, item, left, top, height, iscurrent);
+}
+
+
+/*
+ * Copy 'width' x 'height' rectangle without its rounded corners. Items
+ * never draw on these corners so they always show background beneath.
+ */
+static void blit_rounded(kx_surface *dst, int x, int y, kx_surface *src,
+		int sx, int sy, int width, int height)
+{
+	/* Row offset, inset from sides and row count of rectangle parts */
+	const int part[5][3] = {
+		{ 0, 2, 1 }, { 1, 1, 1 }, { 2, 0, height - 4 },
+		{ height - 2, 1, 1 }, { height - 1, 2, 1 }
+	};
+	const int *p;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		/* Parts are taken bottom-up when rows are moved down on same surface */
+		p = ( (src == dst) && (y > sy) ) ? part[4 - i] : part[i];
+		fb_blit(dst, x + p[1], y + p[0], src, sx + p[1], sy + p[0],
+				width - 2 * p[1], p[2]);
+	}
+}
+
+
+/*
+ * Check that slot at 'top' lies on plain menu area background. Only such
+ * slots may be shown from pre-rendered images. Rounded corners of menu
+ * area are skipped by blit_rounded()
+ */
+static int slot_is_plain(struct gui_t *gui, int top, int height)
+{
+	return (top + height <= gui->y + (LYT_MENU_AREA_TOP)
+			+ (LYT_MENU_AREA_HEIGHT));
+}
+
+
+/*
+ * Return image of menu item in normal (upper half) and selected (lower
+ * half) states. It is rendered on first use and kept until menu items are
+ * changed. Return NULL when there is no memory for it
+ */
+static kx_surface *get_item_image(struct gui_t *gui, kx_menu_item *item,
+		int height)
+{
+	struct gui_item_image_t *ii;
+	kx_surface *image;
+	int i;
+
+	for (i = 0; i < gui->item_image_count; i++) {
+		if (gui->item_images[i].item == item)
+			return gui->item_images[i].image;
+	}
+
+	if (gui->item_image_count == gui->item_image_size) {
+		ii = realloc(gui->item_images,
+				(gui->item_image_size + 8) * sizeof(*ii));
+		if (NULL == ii) {
+			DPRINTF("Can't allocate menu item images array");
+			return NULL;
+		}
+		gui->item_images = ii;
+		gui->item_image_size += 8;
+	}
+
+	image = fb_surface_new(LYT_MNI_WIDTH, height * 2);
+	if (NULL == image) {
+		DPRINTF("Can't allocate menu item image");
+		return NULL;
+	}
+
+	fb_draw_rect(image, 0, 0, image->width, image->height, CLR_MENU_BG);
+	draw_item(gui, image, item, 0, 0, height, 0);
+	draw_item(gui, image, item, 0, height, height, 1);
+
+	ii = &gui->item_images[gui->item_image_count++];
+	ii->item = item;
+	ii->image = image;
+
+	return image;
+}
+
+
+/* Forget pre-rendered images of menu items */
+void gui_invalidate_menu(struct gui_t *gui)
+{
+	int i;
+
+	if (!gui) return;
+
+	for (i = 0; i < gui->item_image_count; i++)
+		fb_surface_destroy(gui->item_images[i].image);
+	gui->item_image_count = 0;
+
+	/* Shown items may be destroyed too */
+	gui->shown_level = NULL;
+#ifdef USE_ANIMATION
+	gui->anim.active = 0;
+#endif
+}
+
+
+/* Draw one slot in menu */
+void draw_slot(struct gui_t *gui, kx_menu_item *item, int slot, int height,
+		int iscurrent)
+{
+	int slot_top;
+
+	slot_top = gui->y + LYT_MENU_AREA_TOP + LYT_MNI_HEIGHT * (slot-1); /* Slots are numbered from 1 */
+	draw_item(gui, gui->screen, item, gui->x + LYT_MNI_LEFT, slot_top,
+			height, iscurrent);
+}
+
+
+/*
+ * Redraw one slot over background. Nothing outside of slot is touched.
+ * Plain slots are copied from item images
+ */
+static void redraw_slot(struct gui_t *gui, kx_menu_item *item, int slot,
+		int height, int iscurrent)
+{
+	kx_surface *image = NULL;
+	int slot_top, left;
+
+	left = gui->x + LYT_MNI_LEFT;
+	slot_top = gui->y + LYT_MENU_AREA_TOP + LYT_MNI_HEIGHT * (slot-1);
+
+	if (slot_is_plain(gui, slot_top, height))
+		image = get_item_image(gui, item, height);
+
+	/* Item image covers whole background of slot */
+	if (NULL != image) {
+		blit_rounded(gui->screen, left, slot_top, image,
+				0, (iscurrent ? height : 0), LYT_MNI_WIDTH, height);
+		return;
+	}
+
+	fb_set_clip(gui->screen, left, slot_top, LYT_MNI_WIDTH, height);
+
+#ifdef USE_BG_BUFFER
+	if (NULL != gui->bg_buffer)
+		fb_draw_layer(gui->screen, gui->bg_buffer,
+				left, slot_top, LYT_MNI_WIDTH, height);
+	else
+#endif
+		draw_background_low(gui, gui->screen);
+
+	draw_item(gui, gui->screen, item, left, slot_top, height, iscurrent);
+
+	fb_reset_clip(gui->screen);
+}
+
+
+#ifdef USE_ANIMATION
+/* Time of one animation frame in us (60 Hz) */
+#define GUI_FRAME_TIME	16667
+
+/*
+ * Draw menu slots of list scrolled by 'offset' pixels with highlight at
+ * 'sel' pixels of list. Items cut by slots area edges are clipped.
+ */
+static void draw_menu_area(struct gui_t *gui, kx_menu_level *ml, int offset,
+		int sel, int cur_no)
+{
+	kx_surface *s = gui->screen;
+	int i, left, top, height, slots;
+
+	height = LYT_MNI_HEIGHT;
+	slots = (LYT_MENU_AREA_HEIGHT) / height;
+	left = gui->x + LYT_MNI_LEFT;
+	top = gui->y + LYT_MENU_AREA_TOP;
+
+	fb_set_clip(s, left, top, LYT_MNI_WIDTH, slots * height);
+
+#ifdef USE_BG_BUFFER
+	if (NULL != gui->bg_buffer)
+		fb_draw_layer(s, gui->bg_buffer, left, top,
+				LYT_MNI_WIDTH, slots * height);
+	else
+#endif
+		draw_background_low(gui, s);
+
+	draw_highlight(gui, s, left, top + sel - offset, height);
+
+	for (i = offset / height; (i < ml->count)
+			&& (i * height - offset < slots * height); i++)
+	{
+		draw_item_content(gui, s, ml->list[i], left,
+				top + i * height - offset, height, i == cur_no);
+	}
+
+	fb_reset_clip(s);
+}
+
+
+/* Begin animated move of selection and list to new state */
+static void start_animation(struct gui_t *gui, kx_menu_level *ml, int cur_no,
+		int firstslot)
+{
+	struct gui_anim_t *a = &gui->anim;
+
+	a->level = ml;
+	a->cur_no = cur_no;
+	a->from_offset = gui->shown_firstslot * LYT_MNI_HEIGHT;
+	a->to_offset = firstslot * LYT_MNI_HEIGHT;
+	a->from_sel = gui->shown_no * LYT_MNI_HEIGHT;
+	a->to_sel = cur_no * LYT_MNI_HEIGHT;
+	a->late = 0;
+	a->start = get_time_us();
+	a->active = 1;
+}
+
+
+/* Draw frame of animation. Last frame is drawn when 'last' is set */
+static void draw_animation_frame(struct gui_t *gui, int last)
+{
+	struct gui_anim_t *a = &gui->anim;
+	struct gui_frame_stat_t *st;
+	unsigned long long t0, t1, t2, elapsed;
+	int offset, sel;
+
+	t0 = get_time_us();
+	elapsed = t0 - a->start;
+
+	if ( last || a->late || (elapsed >= USE_ANIMATION * 1000ULL) ) {
+		last = 1;
+		offset = a->to_offset;
+		sel = a->to_sel;
+	} else {
+		offset = a->from_offset + (int)((a->to_offset - a->from_offset)
+				* (long long)elapsed / (USE_ANIMATION * 1000LL));
+		sel = a->from_sel + (int)((a->to_sel - a->from_sel)
+				* (long long)elapsed / (USE_ANIMATION * 1000LL));
+	}
+
+	draw_menu_area(gui, a->level, offset, sel, a->cur_no);
+	t1 = get_time_us();
+
+	/* Without retrace wait frames are paced by time */
+	if (-1 == fb_wait_vsync()) {
+		if (t1 - t0 < GUI_FRAME_TIME)
+			usleep(GUI_FRAME_TIME - (t1 - t0));
+	}
+
+	t2 = get_time_us();
+	fb_render();
+
+	st = &gui->frame_stats[gui->frame_count++ % GUI_FRAME_STATS];
+	st->render = t1 - t0;
+	st->present = get_time_us() - t2;
+
+	/* Slow frame. Skip intermediate ones to keep up with key repeat */
+	if (!last && (st->render + st->present > GUI_FRAME_TIME)) {
+		a->late = 1;
+		++gui->dropped_count;
+	}
+
+	if (last) {
+		a->active = 0;
+		gui->shown_no = a->cur_no;
+		gui->shown_firstslot = a->to_offset / LYT_MNI_HEIGHT;
+	}
+}
+
+
+int gui_animate(struct gui_t *gui)
+{
+	if ( (NULL == gui) || !gui->anim.active ) return 0;
+
+	draw_animation_frame(gui, 0);
+	return gui->anim.active;
+}
+
+
+void gui_stop_animation(struct gui_t *gui)
+{
+	if ( (NULL == gui) || !gui->anim.active ) return;
+
+	draw_animation_frame(gui, 1);
+}
+
+
+void gui_log_frame_stats(struct gui_t *gui)
+{
+	struct gui_frame_stat_t *st;
+	int i;
+
+	if ( (NULL == gui) || (0 == gui->frame_count) ) return;
+
+	log_msg(lg, "Animation frames: %d, cut short: %d",
+			gui->frame_count, gui->dropped_count);
+
+	i = (gui->frame_count > GUI_FRAME_STATS)
+			? gui->frame_count - GUI_FRAME_STATS : 0;
+	for (; i < gui->frame_count; i++) {
+		st = &gui->frame_stats[i % GUI_FRAME_STATS];
+		log_msg(lg, "+ frame %d: render %u us, present %u us",
+				i, st->render, st->present);
+	}
+}
+#endif
+
+
 /* Display bootlist menu with selection */
 void gui_show_menu(struct gui_t *gui, kx_menu *menu)
 {
@@ -300,32 +818,108 @@ void gui_show_menu(struct gui_t *gui, kx_menu *menu)
 
 	int i,j;
 	int slotheight = LYT_MNI_HEIGHT;
-	int slots = gui->height/slotheight -1;
+	int slots = (LYT_MENU_AREA_HEIGHT) / slotheight;	/* Fit menu area */
 	kx_menu_level *ml;
-	// struct boot that is in fist slot
-	static int firstslot=0;
+	int firstslot;
 	int cur_no;
+	int top, left;
+
+	gui->shown_text = NULL;		/* Log view is covered by menu */
+
+#ifdef USE_ANIMATION
+	gui_stop_animation(gui);
+#endif
 
 	ml = menu->current;			/* active menu level */
 	cur_no = ml->current_no;	/* active menu item index */
-	
-	/* FIXME: shouldn't be done here */
-	if (1 == ml->count) {
-		/* Only system menu in list */
-		draw_background(gui, "No boot devices found\nR: Reboot S: Rescan");
-	} else {
-		draw_background(gui, "KEXECBOOT");
-	}
 
+	firstslot = gui->firstslot;
 	if(cur_no < firstslot)
 		firstslot = cur_no;
 	if(cur_no > firstslot + slots -1)
 		firstslot = cur_no - (slots -1);
+	gui->firstslot = firstslot;
+
+#ifdef USE_ANIMATION
+	/* Selection is moved to neighbour item. Slide it and list there */
+	if ( (ml == gui->shown_level) && (ml->count == gui->shown_count)
+			&& (1 == abs(cur_no - gui->shown_no)) )
+	{
+		start_animation(gui, ml, cur_no, firstslot);
+		return;
+	}
+#endif
+
+	/* Only selection is moved. Redraw previous and new selected slots */
+	if ( (ml == gui->shown_level) && (ml->count == gui->shown_count)
+			&& (firstslot == gui->shown_firstslot)
+			&& (cur_no != gui->shown_no) )
+	{
+		redraw_slot(gui, ml->list[gui->shown_no],
+				gui->shown_no - firstslot + 1, slotheight, 0);
+		redraw_slot(gui, ml->list[cur_no],
+				cur_no - firstslot + 1, slotheight, 1);
+
+		gui->shown_no = cur_no;
+		fb_render();
+		return;
+	}
+
+	/* List is scrolled by one slot. Move already composed slots and draw
+	 * the new one and those whose selection is changed */
+	if ( (ml == gui->shown_level) && (ml->count == gui->shown_count)
+			&& (1 == abs(firstslot - gui->shown_firstslot))
+			&& (firstslot + slots <= ml->count)
+			&& (gui->shown_firstslot + slots <= ml->count)
+			&& slot_is_plain(gui, gui->y + LYT_MENU_AREA_TOP
+					+ slotheight * (slots - 1), slotheight) )
+	{
+		top = gui->y + LYT_MENU_AREA_TOP;
+		left = gui->x + LYT_MNI_LEFT;
+
+		if (firstslot > gui->shown_firstslot) {
+			blit_rounded(gui->screen, left, top, gui->screen, left,
+					top + slotheight, LYT_MNI_WIDTH, slotheight * (slots - 1));
+			i = slots;
+		} else {
+			blit_rounded(gui->screen, left, top + slotheight, gui->screen,
+					left, top, LYT_MNI_WIDTH, slotheight * (slots - 1));
+			i = 1;
+		}
+		j = firstslot + i - 1;
+		redraw_slot(gui, ml->list[j], i, slotheight, j == cur_no);
+
+		j = gui->shown_no - firstslot + 1;
+		if ( (gui->shown_no != cur_no) && (j >= 1) && (j <= slots) )
+			redraw_slot(gui, ml->list[gui->shown_no], j, slotheight, 0);
+
+		j = cur_no - firstslot + 1;
+		if (j != i)
+			redraw_slot(gui, ml->list[cur_no], j, slotheight, 1);
+
+		gui->shown_no = cur_no;
+		gui->shown_firstslot = firstslot;
+		fb_render();
+		return;
+	}
+
+	/* FIXME: shouldn't be done here */
+	if (1 == ml->count) {
+		/* Only system menu in list */
+		draw_frame(gui, "No boot devices found\nR: Reboot S: Rescan", NULL);
+	} else {
+		draw_frame(gui, "KEXECBOOT", NULL);
+	}
 
 	for(i=1, j=firstslot; i <= slots && j< ml->count; i++, j++) {
 		draw_slot(gui, ml->list[j], i, slotheight, j == cur_no);
 	}
 
+	gui->shown_level = ml;
+	gui->shown_count = ml->count;
+	gui->shown_no = cur_no;
+	gui->shown_firstslot = firstslot;
+
 	fb_render();
 }
 
@@ -334,27 +928,30 @@ void gui_show_text(struct gui_t *gui, kx_text *text)
 {
 	if (!gui) return;
 
-	int i, y;
-	int max_x, max_y;
-
-	draw_background(gui, "KEXECBOOT");
+	gui->shown_level = NULL;
+#ifdef USE_ANIMATION
+	gui->anim.active = 0;
+#endif
 
 	/* No text to show */
-	if ((!text) || (text->rows->fill <= 1)) return;
-
-	/* Size constraints */
-	max_x = gui->x + LYT_MENU_AREA_LEFT + LYT_MENU_AREA_WIDTH;
-	max_y = gui->y + LYT_MENU_AREA_TOP + LYT_MENU_AREA_HEIGHT;
+	if ((!text) || (text->rows->fill <= 1)) {
+		gui->shown_text = NULL;
+		draw_frame(gui, "KEXECBOOT", NULL);
+		return;
+	}
 
-	for (i = text->current_line_no, y = gui->y + LYT_MENU_AREA_TOP;
-		( (i < text->rows->fill) && (y < max_y) );
-		 i++
-	) {
-		y += fb_draw_constrained_text(gui->x + LYT_MENU_AREA_LEFT, y,
-				max_x, max_y,
-				CLR_MNI_TEXT, DEFAULT_FONT,
-				text->rows->list[i]);
+	/* Same log is scrolled or has new rows. Redraw only changed rows */
+	if ( (text == gui->shown_text) && (text->rows->fill >= gui->shown_fill) ) {
+		if ( (text->current_line_no != gui->shown_line_no)
+				|| (text->rows->fill != gui->shown_fill) )
+			scroll_log_text(gui, text);
+	} else {
+		draw_frame(gui, "KEXECBOOT", text);
 	}
+
+	gui->shown_text = text;
+	gui->shown_line_no = text->current_line_no;
+	gui->shown_fill = text->rows->fill;
 	fb_render();
 }
 
@@ -364,7 +961,12 @@ void gui_show_msg(struct gui_t *gui, const char *text)
 {
 	if (!gui) return;
 
-	draw_background(gui, text);
+	gui->shown_level = NULL;
+	gui->shown_text = NULL;
+#ifdef USE_ANIMATION
+	gui->anim.active = 0;
+#endif
+	draw_frame(gui, text, NULL);
 	fb_render();
 }
 
@@ -45,22 +45,94 @@ enum icon_id_t {
 };
 #endif
 
+#ifdef USE_ANIMATION
+/* Number of last animation frames kept for debug view */
+#define GUI_FRAME_STATS	8
+
+/* Menu scrolling animation */
+struct gui_anim_t {
+	int active;
+	int late;			/* Frame was over budget, jump to end */
+	unsigned long long start;	/* Start time in us */
+	kx_menu_level *level;
+	int cur_no;			/* Item selected at end */
+	int from_offset, to_offset;	/* List scroll in pixels */
+	int from_sel, to_sel;		/* Highlight position in list pixels */
+};
+
+/* Durations of animation frame parts in us */
+struct gui_frame_stat_t {
+	unsigned int render;
+	unsigned int present;
+};
+#endif
+
+/* Menu item pre-rendered in normal and selected states */
+struct gui_item_image_t {
+	kx_menu_item *item;
+	kx_surface *image;
+};
+
 struct gui_t {
 	int x,y;
 	int height, width;
+	kx_surface *screen;
 #ifdef USE_BG_BUFFER
-	char *bg_buffer;
+	kx_layer *bg_buffer;	/* Pre-drawn background */
 #endif
 #ifdef USE_ICONS
 	kx_picture **icons;
+#endif
+	/* Menu state currently on screen. shown_level is NULL when other
+	 * content is shown and whole menu should be redrawn */
+	kx_menu_level *shown_level;
+	int shown_count;
+	int shown_no;
+	int shown_firstslot;
+	/* Log view currently on screen or NULL */
+	kx_text *shown_text;
+	int shown_line_no;
+	int shown_fill;
+	int firstslot;		/* Menu item shown in first slot */
+	struct gui_item_image_t *item_images;
+	int item_image_count, item_image_size;
+#ifdef USE_ANIMATION
+	struct gui_anim_t anim;
+	struct gui_frame_stat_t frame_stats[GUI_FRAME_STATS];	/* Last frames */
+	int frame_count;	/* Animation frames shown */
+	int dropped_count;	/* Animations cut short by slow frame */
+#endif
+#ifdef USE_SPLASH
+	unsigned long long first_frame;	/* Time when first frame was shown */
 #endif
 };
 
 
-struct gui_t *gui_init(int angle);
+/* Open framebuffer and show 'splash' packed by gui_pack_splash() if it
+ * fits screen (logo otherwise) */
+struct gui_t *gui_init(int angle, const char *splash, int splash_size);
+
+#ifdef USE_SPLASH
+/* Pack current screen contents. Return allocated data or NULL */
+char *gui_pack_splash(struct gui_t *gui, int *size);
+#endif
 
 void gui_show_menu(struct gui_t *gui, kx_menu *menu);
 
+/* Forget pre-rendered menu items. Should be called when items are changed */
+void gui_invalidate_menu(struct gui_t *gui);
+
+#ifdef USE_ANIMATION
+/* Draw next frame of menu animation. Return 1 while animation goes on */
+int gui_animate(struct gui_t *gui);
+
+/* Finish menu animation at once showing its last frame */
+void gui_stop_animation(struct gui_t *gui);
+
+/* Put durations of last animation frames into log */
+void gui_log_frame_stats(struct gui_t *gui);
+#endif
+
 void gui_show_text(struct gui_t *gui, kx_text *text);
 
 void gui_show_msg(struct gui_t *gui, const char *text);
@@ -0,0 +1,128 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *  In-process kernel loading via kexec_file_load(2)
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#include "config.h"
+
+#ifdef USE_KEXEC_FILE_LOAD
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/reboot.h>
+#include <linux/reboot.h>
+
+#include "util.h"
+#include "kexec.h"
+
+/* Older kernel headers have no kexec_file_load flags */
+#ifndef KEXEC_FILE_UNLOAD
+#define KEXEC_FILE_UNLOAD		0x00000001
+#endif
+#ifndef KEXEC_FILE_NO_INITRAMFS
+#define KEXEC_FILE_NO_INITRAMFS	0x00000004
+#endif
+
+static long sys_kexec_file_load(int kernel_fd, int initrd_fd,
+		unsigned long cmdline_len, const char *cmdline,
+		unsigned long flags)
+{
+#ifdef __NR_kexec_file_load
+	return syscall(__NR_kexec_file_load, kernel_fd, initrd_fd,
+			cmdline_len, cmdline, flags);
+#else
+	/* Headers have no syscall number. Behave like old kernel */
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+/* Load kernel with optional initrd and cmdline */
+int kexec_load_kernel(const char *kernel, const char *initrd,
+		const char *cmdline)
+{
+	int kernel_fd, initrd_fd = -1;
+	unsigned long flags = 0;
+	unsigned long cmdline_len = 0;
+	long rc;
+	int err;
+
+	kernel_fd = open(kernel, O_RDONLY);
+	if (kernel_fd < 0) {
+		log_msg(lg, "+ can't open kernel '%s': %s", kernel, ERRMSG);
+		return -1;
+	}
+
+	if (initrd) {
+		initrd_fd = open(initrd, O_RDONLY);
+		if (initrd_fd < 0) {
+			log_msg(lg, "+ can't open initrd '%s': %s", initrd, ERRMSG);
+			close(kernel_fd);
+			return -1;
+		}
+	} else {
+		flags |= KEXEC_FILE_NO_INITRAMFS;
+	}
+
+	/* Length should include terminating '\0' */
+	if (cmdline) cmdline_len = strlen(cmdline) + 1;
+
+	rc = sys_kexec_file_load(kernel_fd, initrd_fd, cmdline_len,
+			cmdline, flags);
+	err = errno;
+
+	close(kernel_fd);
+	if (initrd_fd >= 0) close(initrd_fd);
+
+	if (-1 == rc) {
+		if (ENOSYS != err)
+			log_msg(lg, "+ kexec_file_load failed: %s", strerror(err));
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Unload previously loaded kernel */
+int kexec_unload_kernel(void)
+{
+	if (-1 == sys_kexec_file_load(-1, -1, 0, NULL, KEXEC_FILE_UNLOAD)) {
+		log_msg(lg, "+ can't unload kernel: %s", ERRMSG);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Boot loaded kernel */
+int kexec_reboot(void)
+{
+	sync();
+	if (-1 == reboot(LINUX_REBOOT_CMD_KEXEC)) {
+		log_msg(lg, "+ can't boot loaded kernel: %s", ERRMSG);
+		return -1;
+	}
+	return 0;	/* Should not happens */
+}
+
+#endif	/* USE_KEXEC_FILE_LOAD */
@@ -0,0 +1,42 @@
+/*
+ *  kexecboot - A kexec based bootloader
+ *
+ *  Copyright (c) 2008-2011 Yuri Bushmelev <jay4mail@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#ifndef _HAVE_KEXEC_H
+#define _HAVE_KEXEC_H
+
+#include "config.h"
+
+#ifdef USE_KEXEC_FILE_LOAD
+
+/*
+ * Load kernel with optional initrd and cmdline using kexec_file_load(2).
+ * Return value:
+ * - 0 on success
+ * - -1 on error with errno set. errno is ENOSYS when running kernel
+ *   has no kexec_file_load support and external kexec should be used.
+ */
+int kexec_load_kernel(const char *kernel, const char *initrd,
+		const char *cmdline);
+
+/* Unload previously loaded kernel. Return 0 on success, -1 on error */
+int kexec_unload_kernel(void);
+
+/* Boot loaded kernel. Returns -1 on error only */
+int kexec_reboot(void);
+
+#endif	/* USE_KEXEC_FILE_LOAD */
+#endif	/* _HAVE_KEXEC_H */
@@ -32,6 +32,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "config.h"
 #include "util.h"
@@ -40,6 +43,7 @@
 #include "evdevs.h"
 #include "menu.h"
 #include "kexecboot.h"
+#include "kexec.h"
 
 #ifdef USE_FBMENU
 #include "gui.h"
@@ -90,6 +94,19 @@ typedef enum {
 	KX_CTX_TEXTVIEW,
 } kx_context;
 
+/* Kernel loaders. Values are passed as exit status of preloading worker */
+typedef enum {
+	KX_LOADER_NONE = 0,
+	KX_LOADER_SYSCALL,
+	KX_LOADER_BINARY,
+	KX_LOADER_UNKNOWN,	/* Killed worker may have left kernel loaded by any */
+} kx_loader;
+
+#ifdef USE_KEXEC_PRELOAD
+/* Highlighted item should stay for this time (ms) before it is preloaded */
+#define PRELOAD_DELAY	500
+#endif
+
 /* Common parameters */
 struct params_t {
 	struct cfgdata_t *cfg;
@@ -102,6 +119,19 @@ struct params_t {
 #ifdef USE_TEXTUI
 	kx_tui *tui;
 #endif
+#ifdef USE_KEXEC_PRELOAD
+	pid_t preload_pid;		/* Preloading worker (0 - none) */
+	int preload_choice;		/* Item preloaded or being preloaded (-1 - none) */
+	int preload_wanted;		/* Item that should be preloaded (-1 - none) */
+	unsigned long long preload_wanted_time;	/* When wanted item was chosen */
+	kx_loader preload_loader;	/* Loader of preloaded item */
+	unsigned long long preload_start;	/* Preloading start time */
+#endif
+#ifdef USE_SPLASH
+	unsigned long long start_time;	/* Program start time */
+	char *splash;			/* Menu to be saved for next run */
+	int splash_size;
+#endif
 };
 
 static char *kxb_ttydev = NULL;
@@ -174,31 +204,11 @@ char *get_machine_kernelpath() {
 #endif	/* USE_MACHINE_KERNEL */
 
 
-int start_booting(struct params_t *params, int choice)
+/* Mount boot item's device (and partition image if any) on ROOTFS */
+static int mount_boot_item(struct boot_item_t *item)
 {
-	struct boot_item_t *item;
 	int file_fd, device_fd;
-	char op[4096];
-	
-	item = params->bootcfg->list[choice];
-	
-	if ( ! (item->boottype & BOOT_TYPE_LINUX)) {
-		char *const envp[] = { NULL };
-		const char *exec_argv[] = { "/init-android", NULL};
-		system("echo -n 0 > /sys/class/vtconsole/vtcon0/bind");
-		system("echo -n 0 > /sys/class/vtconsole/vtcon1/bind");
-		
-		umount("/dev/pts");
-		umount("/dev");
-		umount("/sys");
-		umount("/proc");
-		umount("/run");
-		umount("/data");
-		
-		execve("/init-android", (char *const *)exec_argv, envp);
-		return -1;
-	}
-	
+
 	if (item->boottype & BOOT_TYPE_IMAGE) {
 		if (-1 == mount(item->device, MOUNTPOINT, item->fstype, 0, NULL)) {
 			log_msg(lg, "+ can't mount device containing boot image file '%s': %s", item->device, ERRMSG);
@@ -234,140 +244,696 @@ int start_booting(struct params_t *params, int choice)
 		mount("/dev/loop0", ROOTFS, "ext4", 0, NULL);
 		
 	} else {
+		char bind_src[strlen(MOUNTPOINT) + strlenn(item->directory) + 1];
+
 		if (-1 == mount(item->device, MOUNTPOINT, item->fstype, 0, NULL)) {
 			log_msg(lg, "+ can't mount boot device '%s': %s", item->device, ERRMSG);
 			return -1;
 		}
 		
-		sprintf(op, "mount --bind %s%s %s", MOUNTPOINT, item->directory, ROOTFS);
-		system(op);
+		strcpy(bind_src, MOUNTPOINT);
+		if (item->directory) strcat(bind_src, item->directory);
+		if (-1 == mount(bind_src, ROOTFS, NULL, MS_BIND, NULL)) {
+			log_msg(lg, "+ can't bind '%s' to '%s': %s", bind_src, ROOTFS, ERRMSG);
+		}
 	}
-	
-	if (item->boottype & BOOT_TYPE_KEXEC) {
-		/* we use var[] instead of *var because sizeof(var) using */
-		const char kexec_path[] = KEXEC_PATH;
-		
-		const char str_cmdline_start[] = "--command-line=";
-		const char str_partition[] = " partition=";
-		const char str_image[] = " image=";
-		const char str_directory[] = " directory=";
-		const char str_initrd_start[] = "--initrd=";
-		
-		const char *load_argv[] = { NULL, "--load-hardboot", NULL, NULL, "--mem-min=0x84000000", NULL, NULL };
-		const char *exec_argv[] = { NULL, "-e", NULL};
-		
-		char *cmdline_arg = NULL, *initrd_arg = NULL, cmdline[1024], *kernel_arg = NULL;
-		int n;
-		
-		n = 32 + strlen(item->kernelpath);
-		kernel_arg = (char *)malloc(n);
-		strcpy(kernel_arg, ROOTFS);
-		strcat(kernel_arg, item->kernelpath);
-		load_argv[2] = kernel_arg;
-		
-		exec_argv[0] = kexec_path;
-		load_argv[0] = kexec_path;
-		
-		/* --command-line arg generation */
+
+	return 0;
+}
+
+
+/* Unmount everything mounted by mount_boot_item() */
+static void umount_boot_item(struct boot_item_t *item)
+{
+	int file_fd, device_fd;
+
+	umount(ROOTFS);
+	if (item->boottype & BOOT_TYPE_IMAGE) {
+		file_fd = open64(item->imagepath, O_RDWR);
+		if (file_fd < 0) {
+			log_msg(lg, "open image file '%s' failed", item->imagepath);
+		}
 		
-		/* fill '--initrd' option */
-		if (item->initrd) {
-			/* allocate space */
-			n = sizeof(str_initrd_start) + strlen(item->initrd) + 32;
-			
-			initrd_arg = (char *)malloc(n);
-			if (NULL == initrd_arg) {
-				log_msg(lg, "Can't allocate memory for initrd_arg");
-			} else {
-				strcpy(initrd_arg, str_initrd_start);	/* --initrd= */
-				strcat(initrd_arg, ROOTFS);
-				strcat(initrd_arg, item->initrd);
-				load_argv[3] = initrd_arg;
-			}
+		device_fd = open("/dev/loop0", O_RDWR);
+		if (device_fd < 0) {
+			log_msg(lg, "open loop device failed");
+			close(file_fd);
 		}
 		
-		/* fill '--command-line' option */
-		/* load current cmdline */
-		FILE *f;
-		f = fopen("/proc/cmdline", "r");
-		if (NULL == f) {
-			log_msg(lg, "No cmdline!\n");
-			return -1;
+		if (ioctl(device_fd, LOOP_CLR_FD, file_fd) < 0) {
+			log_msg(lg, "ioctl LOOP_CLR_FD failed");
+			close(file_fd);
+			close(device_fd);
 		}
-		fscanf(f, "%[^\n]", cmdline);
-		fclose(f);
 		
+		if (file_fd >= 0) close(file_fd);
+		if (device_fd >= 0) close(device_fd);
+	}
+	umount(MOUNTPOINT);
+}
+
+
+/* Load kernel of mounted boot item.
+ * Return loader that was used or KX_LOADER_NONE on error */
+static kx_loader load_boot_item(struct boot_item_t *item)
+{
+	/* we use var[] instead of *var because sizeof(var) using */
+	const char kexec_path[] = KEXEC_PATH;
+	
+	const char str_cmdline_start[] = "--command-line=";
+	const char str_partition[] = " partition=";
+	const char str_image[] = " image=";
+	const char str_directory[] = " directory=";
+	const char str_initrd_start[] = "--initrd=";
+	
+	const char *load_argv[] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+	char *const envp[] = { NULL };
+	
+	char *cmdline_arg = NULL, *initrd_arg = NULL, cmdline[1024];
+	char *kernel_arg = NULL;
+#ifdef USE_KEXEC_FILE_LOAD
+	char *initrd_path = NULL, *kernel_cmdline = NULL;
+#endif
+	int n, argc;
+	kx_loader loader = KX_LOADER_BINARY;
+	unsigned long long t;
+	FILE *f;
+	
+	n = 32 + strlen(item->kernelpath);
+	kernel_arg = (char *)malloc(n);
+	if (NULL == kernel_arg) {
+		log_msg(lg, "Can't allocate memory for kernel_arg");
+		return KX_LOADER_NONE;
+	}
+	strcpy(kernel_arg, ROOTFS);
+	strcat(kernel_arg, item->kernelpath);
+	
+	/* Prepare initrd path */
+	if (item->initrd) {
 		/* allocate space */
-		if (item->boottype & BOOT_TYPE_IMAGE) {
-			n = strlen(str_cmdline_start) + 32 + strlen(cmdline) * 2 + strlen(str_partition)
-			+ strlen(item->device) + strlen(str_image) + strlen(item->image);
+		n = sizeof(str_initrd_start) + strlen(item->initrd) + 32;
+		
+		initrd_arg = (char *)malloc(n);
+		if (NULL == initrd_arg) {
+			log_msg(lg, "Can't allocate memory for initrd_arg");
 		} else {
-			n = strlen(str_cmdline_start) + 32 + strlen(cmdline) * 2 + strlen(str_partition)
-			+ strlen(item->device) + strlen(str_directory) + strlen(item->directory);
+			strcpy(initrd_arg, str_initrd_start);	/* --initrd= */
+			strcat(initrd_arg, ROOTFS);
+			strcat(initrd_arg, item->initrd);
+#ifdef USE_KEXEC_FILE_LOAD
+			/* Skip '--initrd=' to get plain path */
+			initrd_path = initrd_arg + sizeof(str_initrd_start) - 1;
+#endif
 		}
-		
-		cmdline_arg = (char *)malloc(n);
-		if (NULL == cmdline_arg) {
-			log_msg(lg, "Can't allocate memory for cmdline_arg");
+	}
+	
+	/* Prepare kernel cmdline */
+	/* load current cmdline */
+	f = fopen("/proc/cmdline", "r");
+	if (NULL == f) {
+		log_msg(lg, "No cmdline!\n");
+		dispose(initrd_arg);
+		free(kernel_arg);
+		return KX_LOADER_NONE;
+	}
+	cmdline[0] = '\0';
+	fscanf(f, "%1023[^\n]", cmdline);
+	fclose(f);
+	
+	/* allocate space */
+	if (item->boottype & BOOT_TYPE_IMAGE) {
+		n = strlen(str_cmdline_start) + 32 + strlen(cmdline) * 2 + strlen(str_partition)
+		+ strlen(item->device) + strlen(str_image) + strlen(item->image);
+	} else {
+		n = strlen(str_cmdline_start) + 32 + strlen(cmdline) * 2 + strlen(str_partition)
+		+ strlen(item->device) + strlen(str_directory) + strlenn(item->directory);
+	}
+	
+	cmdline_arg = (char *)malloc(n);
+	if (NULL == cmdline_arg) {
+		log_msg(lg, "Can't allocate memory for cmdline_arg");
+	} else {
+		strcpy(cmdline_arg, str_cmdline_start);	/* --command-line= */
+#ifdef USE_KEXEC_FILE_LOAD
+		/* Kernel cmdline itself follows '--command-line=' */
+		kernel_cmdline = cmdline_arg + strlen(str_cmdline_start);
+#endif
+		strcat(cmdline_arg, cmdline);
+		strcat(cmdline_arg, str_partition);
+		strcat(cmdline_arg, item->device);
+		if (item->boottype & BOOT_TYPE_IMAGE) {
+			strcat(cmdline_arg, str_image);
+			strcat(cmdline_arg, item->image);
 		} else {
-			strcpy(cmdline_arg, str_cmdline_start);	/* --command-line= */
-			strcat(cmdline_arg, "\"");
-			strcat(cmdline_arg, cmdline);
-			strcat(cmdline_arg, str_partition);
-			strcat(cmdline_arg, item->device);
-			if (item->boottype & BOOT_TYPE_IMAGE) {
-				strcat(cmdline_arg, str_image);
-				strcat(cmdline_arg, item->image);
-			} else {
-				strcat(cmdline_arg, str_directory);
-				strcat(cmdline_arg, item->directory);
-			}
-			strcat(cmdline_arg, "\"");
-			load_argv[5] = cmdline_arg;
+			strcat(cmdline_arg, str_directory);
+			if (item->directory) strcat(cmdline_arg, item->directory);
 		}
+	}
+	
+	/* Load kernel */
+	t = get_time_us();
+#ifdef USE_KEXEC_FILE_LOAD
+	n = kexec_load_kernel(kernel_arg, initrd_path, kernel_cmdline);
+	if (0 == n) {
+		loader = KX_LOADER_SYSCALL;
+		log_msg(lg, "+ kexec_file_load took %llu us", get_time_us() - t);
+	} else if (ENOSYS != errno) {
+		/* Real error. External kexec will not help here */
+		loader = KX_LOADER_NONE;
+	} else {
+		log_msg(lg, "+ kexec_file_load is not supported, using %s", kexec_path);
+	}
+#endif
+	
+	if (KX_LOADER_BINARY == loader) {
+		/* No NULL holes allowed in argv so fill it sequentially */
+		argc = 0;
+		load_argv[argc++] = kexec_path;
+		load_argv[argc++] = "--load-hardboot";
+		load_argv[argc++] = kernel_arg;
+		if (initrd_arg) load_argv[argc++] = initrd_arg;
+		load_argv[argc++] = "--mem-min=0x84000000";
+		if (cmdline_arg) load_argv[argc++] = cmdline_arg;
 		
 		log_msg(lg, "load_argv: %s, %s, %s, %s, %s, %s\n", load_argv[0],
 			load_argv[1], load_argv[2], load_argv[3], load_argv[4], load_argv[5]);
-			
-		/* Load kernel */
-		//n = fexecw(kexec_path, (char *const *)load_argv, envp);
-		sprintf(op, "%s %s %s %s %s %s", load_argv[0],
-				load_argv[1], load_argv[2], load_argv[3], load_argv[4], load_argv[5]);
-		n = system(op);
 		
-		umount(ROOTFS);
-		if (item->boottype & BOOT_TYPE_IMAGE) {
-			file_fd = open64(item->imagepath, O_RDWR);
-			if (file_fd < 0) {
-				log_msg(lg, "open image file '%s' failed", item->imagepath);
-			}
-			
-			device_fd = open("/dev/loop0", O_RDWR);
-			if (device_fd < 0) {
-				log_msg(lg, "open loop device failed");
-				close(file_fd);
-			}
-			
-			if (ioctl(device_fd, LOOP_CLR_FD, file_fd) < 0) {
-				log_msg(lg, "ioctl LOOP_CLR_FD failed");
-				close(file_fd);
-				close(device_fd);
-			}
-			
-			if (file_fd >= 0) close(file_fd);
-			if (device_fd >= 0) close(device_fd);
-			
-			umount(MOUNTPOINT);
+		t = get_time_us();
+		n = fexecw(kexec_path, (char *const *)load_argv, envp);
+		log_msg(lg, "+ %s load took %llu us", kexec_path, get_time_us() - t);
+		if (0 != n) loader = KX_LOADER_NONE;
+	}
+	
+	dispose(cmdline_arg);
+	dispose(initrd_arg);
+	free(kernel_arg);
+	
+	return loader;
+}
+
+
+/* Boot kernel loaded by specified loader. Returns on error only */
+static void exec_loaded_kernel(kx_loader loader)
+{
+	const char kexec_path[] = KEXEC_PATH;
+	const char *exec_argv[] = { kexec_path, "-e", NULL};
+	char *const envp[] = { NULL };
+
+#ifdef USE_KEXEC_FILE_LOAD
+	if (KX_LOADER_SYSCALL == loader) {
+		kexec_reboot();
+		return;
+	}
+#endif
+	log_msg(lg, "exec_argv: %s, %s", exec_argv[0], exec_argv[1]);
+	fexecw(kexec_path, (char *const *)exec_argv, envp);
+}
+
+
+#if defined(USE_TIMEOUT) || defined(USE_KEXEC_PRELOAD)
+/* Return number of default boot item (or item with top priority) in top
+ * menu or -1 when there is no one */
+static int default_item_no(struct params_t *params)
+{
+	struct bootconf_t *bl = params->bootcfg;
+	kx_menu_level *top = params->menu->top;
+	int i;
+
+	if ( (NULL == bl) || (0 == bl->fill) ) return -1;
+
+	if (bl->default_item) {
+		for (i = 0; i < top->count; i++) {
+			if ( (top->list[i]->id >= A_DEVICES)
+					&& (bl->list[top->list[i]->id - A_DEVICES] == bl->default_item) )
+				return i;
 		}
-			
-		dispose(cmdline_arg);
-		dispose(initrd_arg);
+	}
+
+	/* First item is system menu. Next is top priority boot item */
+	if ( (top->count > 1) && (top->list[1]->id >= A_DEVICES) ) return 1;
+
+	return -1;
+}
+#endif
+
+
+#ifdef USE_KEXEC_PRELOAD
+/* Unload kernel loaded by specified loader */
+static void unload_kernel(kx_loader loader)
+{
+	const char kexec_path[] = KEXEC_PATH;
+	const char *unload_argv[] = { kexec_path, "-u", NULL};
+	char *const envp[] = { NULL };
+
+	switch (loader) {
+#ifdef USE_KEXEC_FILE_LOAD
+	case KX_LOADER_SYSCALL:
+		kexec_unload_kernel();
+		break;
+#endif
+	case KX_LOADER_UNKNOWN:
+#ifdef USE_KEXEC_FILE_LOAD
+		/* Syscall unloads kernel loaded by any way */
+		if (0 == kexec_unload_kernel()) break;
+#endif
+		/* Fall through */
+	case KX_LOADER_BINARY:
+		fexecw(kexec_path, (char *const *)unload_argv, envp);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/* SIGCHLD handler. Only purpose is to interrupt select() in main loop */
+static void preload_sigchld_handler(int signum)
+{
+}
+
+
+/* Prepare preloading state */
+void preload_init(struct params_t *params)
+{
+	struct sigaction sa;
+
+	params->preload_pid = 0;
+	params->preload_choice = -1;
+	params->preload_wanted = -1;
+	params->preload_wanted_time = 0;
+	params->preload_loader = KX_LOADER_NONE;
+
+	/* Wake up main loop when preloading worker finishes (no SA_RESTART) */
+	sa.sa_handler = preload_sigchld_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+#ifdef PR_SET_CHILD_SUBREAPER
+	/* kexec started by killed worker comes to us and may be waited for */
+	prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+#endif
+}
+
+
+/* Collect preloading worker result. Wait for it when 'wait' is set */
+static void preload_reap(struct params_t *params, int wait)
+{
+	int status;
+	pid_t pid;
+
+	if (0 == params->preload_pid) return;
+
+	do {
+		pid = waitpid(params->preload_pid, &status, wait ? 0 : WNOHANG);
+	} while ((-1 == pid) && (EINTR == errno));
+
+	if (0 == pid) return;	/* Still working */
+
+	params->preload_pid = 0;
+	if ((pid > 0) && WIFEXITED(status)) {
+		params->preload_loader = WEXITSTATUS(status);
+	} else {
+		params->preload_loader = KX_LOADER_NONE;
+	}
+
+	if (KX_LOADER_NONE != params->preload_loader) {
+		log_msg(lg, "Preloaded item %d in %llu us", params->preload_choice,
+				get_time_us() - params->preload_start);
+	} else {
+		log_msg(lg, "Can't preload item %d", params->preload_choice);
+	}
+}
+
+
+/* Stop preloading worker at once and clean up after it */
+static void preload_cancel(struct params_t *params)
+{
+	int status;
+	pid_t pid, pgid;
+
+	if (0 == params->preload_pid) return;
+
+	/* Worker may wait for kexec binary. Kill whole group to stop it too */
+	pgid = params->preload_pid;
+	kill(-pgid, SIGKILL);
+	do {
+		pid = waitpid(params->preload_pid, &status, 0);
+	} while ((-1 == pid) && (EINTR == errno));
+	params->preload_pid = 0;
+
+	/* Wait for orphans of group before boot item is unmounted */
+	while ( (waitpid(-pgid, NULL, 0) > 0) || (EINTR == errno) );
+
+	if ((pid > 0) && WIFEXITED(status)) {
+		/* Worker was faster */
+		params->preload_loader = WEXITSTATUS(status);
+		return;
+	}
+
+	/* Worker could be killed while its boot item was mounted */
+	umount_boot_item(params->bootcfg->list[params->preload_choice]);
+	params->preload_loader = KX_LOADER_UNKNOWN;
+	params->preload_choice = -1;
+	log_msg(lg, "Preloading is cancelled");
+}
+
+
+/* Stop preloading worker and unload preloaded kernel if any */
+void preload_drop(struct params_t *params)
+{
+	preload_cancel(params);
+	unload_kernel(params->preload_loader);
+	params->preload_loader = KX_LOADER_NONE;
+	params->preload_choice = -1;
+}
+
+
+/* Start preloading worker for specified item */
+static void preload_start(struct params_t *params, int choice)
+{
+	struct boot_item_t *item;
+	kx_loader loader;
+	pid_t pid;
+
+	/* Item is not preloaded by mistake. Kernel of other item may stay */
+	params->preload_choice = choice;
+	if (KX_LOADER_NONE != params->preload_loader)
+		params->preload_loader = KX_LOADER_UNKNOWN;
+
+	item = params->bootcfg->list[choice];
+	if ( (BOOT_TYPE_LINUX | BOOT_TYPE_KEXEC) !=
+		(item->boottype & (BOOT_TYPE_LINUX | BOOT_TYPE_KEXEC)) )
+	{
+		/* Nothing to preload */
+		return;
+	}
+
+	params->preload_start = get_time_us();
+
+	pid = fork();
+	if (pid < 0) {
+		log_msg(lg, "Can't start preloading: %s", ERRMSG);
+		return;
+	} else if (0 == pid) {
+		/* Child: unload previous kernel, mount, load and release
+		 * everything again. Loaded kernel is kept by running kernel
+		 * for our parent */
+		setpgid(0, 0);
+		unload_kernel(params->preload_loader);
+		if (-1 == mount_boot_item(item)) _exit(KX_LOADER_NONE);
+		loader = load_boot_item(item);
+		umount_boot_item(item);
+		_exit(loader);
+	}
+
+	/* Both sides set group, so it exists before any kill */
+	setpgid(pid, pid);
+	params->preload_pid = pid;
+	params->preload_loader = KX_LOADER_NONE;
+	log_msg(lg, "Preloading item %d", choice);
+}
+
+
+/* Return time in ms until wanted item should be preloaded or -1 when
+ * nothing is waiting. Only top menu follows highlighted item */
+int preload_wait_time(struct params_t *params)
+{
+	unsigned long long t;
+
+	if ( (KX_CTX_MENU != params->context)
+			|| (params->menu->current != params->menu->top) )
+		return -1;
+
+	if ( (params->preload_wanted < 0)
+			|| (params->preload_wanted == params->preload_choice) )
+		return -1;
+
+	t = get_time_us() - params->preload_wanted_time;
+	return (t < PRELOAD_DELAY * 1000) ? PRELOAD_DELAY - t / 1000 : 0;
+}
+
+
+/* Cancel preloading of not wanted item. Start preloading of wanted item
+ * when it was chosen long enough ago */
+void preload_update(struct params_t *params)
+{
+	preload_reap(params, 0);
+
+	if (params->preload_wanted < 0) return;
+	if (params->preload_wanted == params->preload_choice) return;
+
+	preload_cancel(params);
+	if (get_time_us() - params->preload_wanted_time < PRELOAD_DELAY * 1000)
+		return;
+
+	preload_start(params, params->preload_wanted);
+}
+
+
+/* Preload default boot item (or item with top priority) */
+void preload_default(struct params_t *params)
+{
+	int no = default_item_no(params);
+
+	/* Timeout boots the same item */
+	params->preload_wanted = (no < 0) ? -1
+			: params->menu->top->list[no]->id - A_DEVICES;
+	params->preload_wanted_time = 0;	/* Don't delay */
+
+	preload_update(params);
+}
+
+
+/* Follow selected menu item. Item that is not bootable or not in top
+ * menu is not waited for, but preloading that is going on is kept */
+void preload_follow_menu(struct params_t *params)
+{
+	kx_menu *menu = params->menu;
+
+	if ( (menu->current != menu->top)
+			|| (menu->current->current->id < A_DEVICES) )
+	{
+		params->preload_wanted = -1;
+		preload_reap(params, 0);
+		return;
+	}
+
+	if (params->preload_wanted != menu->current->current->id - A_DEVICES) {
+		params->preload_wanted = menu->current->current->id - A_DEVICES;
+		params->preload_wanted_time = get_time_us();
+	}
+	preload_update(params);
+}
+
+
+/* Return loader if specified item is preloaded. Drop preloaded item otherwise */
+static kx_loader preload_finish(struct params_t *params, int choice)
+{
+	kx_loader loader;
+
+	/* Wait for chosen item only. Other one is not needed anymore */
+	if (choice == params->preload_choice)
+		preload_reap(params, 1);
+	else
+		preload_cancel(params);
+
+	if ( (choice == params->preload_choice)
+		&& (KX_LOADER_NONE != params->preload_loader)
+		&& (KX_LOADER_UNKNOWN != params->preload_loader) )
+	{
+		loader = params->preload_loader;
+		params->preload_loader = KX_LOADER_NONE;
+		return loader;
+	}
+
+	/* Kernel loaded for booting replaces preloaded one */
+	if (params->bootcfg->list[choice]->boottype & BOOT_TYPE_KEXEC)
+		params->preload_loader = KX_LOADER_NONE;
+	preload_drop(params);
+	return KX_LOADER_NONE;
+}
+#endif	/* USE_KEXEC_PRELOAD */
+
+
+#ifdef USE_SPLASH
+/* Read saved splash from mounted bootconf device */
+static char *splash_read(int *size)
+{
+	FILE *f;
+	char *data;
+	long len;
+
+	f = fopen(SPLASH_PATH, "r");
+	if (NULL == f) return NULL;
+
+	if ( (-1 == fseek(f, 0, SEEK_END)) || ((len = ftell(f)) <= 0)
+			|| (-1 == fseek(f, 0, SEEK_SET)) )
+	{
+		fclose(f);
+		return NULL;
+	}
+
+	data = malloc(len);
+	if (NULL == data) {
+		DPRINTF("Can't allocate memory for splash");
+		fclose(f);
+		return NULL;
+	}
+
+	if (1 != fread(data, len, 1, f)) {
+		log_msg(lg, "+ can't read splash: %s", ERRMSG);
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	*size = len;
+	return data;
+}
+
+/* Load splash saved by previous run. Devices are not waited for because
+ * splash is useful only when it is shown at once */
+static char *splash_load(int *size)
+{
+	char *data;
+
+	mkdir(SPLASH_MOUNTPOINT, 0666);
+	if (-1 == mount(MMCBLK_BOOTCONF, SPLASH_MOUNTPOINT, MMCBLK_BOOTCONF_FSTYPE,
+			MS_RDONLY, NULL))
+	{
+		log_msg(lg, "+ can't mount bootconf device '%s' for splash: %s",
+				MMCBLK_BOOTCONF, ERRMSG);
+		return NULL;
+	}
+
+	data = splash_read(size);
+	if (NULL == data) log_msg(lg, "+ no saved splash");
+
+	umount(SPLASH_MOUNTPOINT);
+	return data;
+}
+
+/* Save splash packed when menu was shown first time. Bootconf device is
+ * written only when picture is changed */
+static void splash_save(struct params_t *params)
+{
+	char *data = params->splash, *old;
+	int size = params->splash_size, old_size = 0;
+	FILE *f;
+
+	if (NULL == data) return;
+	params->splash = NULL;
+
+	if (-1 == mount(MMCBLK_BOOTCONF, SPLASH_MOUNTPOINT, MMCBLK_BOOTCONF_FSTYPE,
+			MS_RDONLY, NULL))
+	{
+		free(data);
+		return;
+	}
+
+	old = splash_read(&old_size);
+	if ( (NULL != old) && (old_size == size) && (0 == memcmp(old, data, size)) )
+		goto end_splash_save;
+
+	if (-1 == mount(MMCBLK_BOOTCONF, SPLASH_MOUNTPOINT, MMCBLK_BOOTCONF_FSTYPE,
+			MS_REMOUNT, NULL))
+	{
+		log_msg(lg, "+ can't remount bootconf device to save splash: %s", ERRMSG);
+		goto end_splash_save;
+	}
+
+	/* Replace old splash only by complete new one */
+	f = fopen(SPLASH_PATH ".new", "w");
+	if (NULL == f) {
+		log_msg(lg, "+ can't save splash: %s", ERRMSG);
+		goto end_splash_save;
+	}
+	if ( (1 != fwrite(data, size, 1, f)) || (0 != fflush(f))
+			|| (-1 == fsync(fileno(f))) )
+	{
+		log_msg(lg, "+ can't save splash: %s", ERRMSG);
+		fclose(f);
+		unlink(SPLASH_PATH ".new");
+		goto end_splash_save;
+	}
+	fclose(f);
+
+	if (-1 == rename(SPLASH_PATH ".new", SPLASH_PATH))
+		log_msg(lg, "+ can't save splash: %s", ERRMSG);
+	else
+		log_msg(lg, "Splash saved (%d bytes)", size);
+
+end_splash_save:
+	umount(SPLASH_MOUNTPOINT);
+	dispose(old);
+	free(data);
+}
+#endif
+
+
+int start_booting(struct params_t *params, int choice)
+{
+	struct boot_item_t *item;
+	unsigned long long t_start, t;
+	kx_loader loader;
+	
+	item = params->bootcfg->list[choice];
+	
+#ifdef USE_SPLASH
+	/* Nothing is written while user looks at menu */
+	splash_save(params);
+#endif
+
+	if ( ! (item->boottype & BOOT_TYPE_LINUX)) {
+		char *const envp[] = { NULL };
+		const char *exec_argv[] = { "/init-android", NULL};
+		system("echo -n 0 > /sys/class/vtconsole/vtcon0/bind");
+		system("echo -n 0 > /sys/class/vtconsole/vtcon1/bind");
+		
+		umount("/dev/pts");
+		umount("/dev");
+		umount("/sys");
+		umount("/proc");
+		umount("/run");
+		umount("/data");
+		
+		execve("/init-android", (char *const *)exec_argv, envp);
+		return -1;
+	}
+	
+#ifdef USE_KEXEC_PRELOAD
+	loader = preload_finish(params, choice);
+	if (KX_LOADER_NONE != loader) {
+		log_msg(lg, "+ booting preloaded kernel");
+		exec_loaded_kernel(loader);
+		return -1;
+	}
+#endif
+	
+	t_start = t = get_time_us();
+
+	if (-1 == mount_boot_item(item)) return -1;
+	
+	log_msg(lg, "+ mount took %llu us", get_time_us() - t);
+
+	if (item->boottype & BOOT_TYPE_KEXEC) {
+		loader = load_boot_item(item);
+		
+		t = get_time_us();
+		umount_boot_item(item);
+		log_msg(lg, "+ cleanup took %llu us", get_time_us() - t);
+		
+		if (KX_LOADER_NONE == loader) {
+			log_msg(lg, "Can't load kernel");
+			return -1;
+		}
+		
+		log_msg(lg, "+ booting after %llu us", get_time_us() - t_start);
 		
-		log_msg(lg, "exec_argv: %s, %s", exec_argv[0], exec_argv[1]);
-			
 		/* Boot new kernel */
-		//execve(kexec_path, (char *const *)exec_argv, envp);
-		system("kexec -e");
+		exec_loaded_kernel(loader);
 	} else {
 		
 		system("init-linux");
@@ -377,13 +943,15 @@ int start_booting(struct params_t *params, int choice)
 }
 
 
-int scan_devices(struct params_t *params)
+/* Scan boot config and devices. Wait up to 'timeout' ms in total for
+ * devices which are not here yet */
+int scan_devices(struct params_t *params, int timeout)
 {
-	struct charlist *fl;
 	struct bootconf_t *bootconf;
 	struct cfgdata_t cfgdata;
 	char cfgpath[256];
 	int rc;
+	unsigned long long start = get_time_us();
 	
 /*#ifdef USE_ICONS
 	kx_cfg_section *sc;
@@ -400,7 +968,7 @@ int scan_devices(struct params_t *params)
 		return -1;
 	}
 	
-	rc = devscan_open(&fl);
+	rc = devscan_open();
 	if (-1 == rc) {
 		log_msg(lg, "can't open device\n");
 		return -1;
@@ -408,6 +976,11 @@ int scan_devices(struct params_t *params)
 	
 	mkdir(MOUNTPOINT, 0666);
 	mkdir(ROOTFS, 0666);
+
+	/* Give slow SD/CF some time to appear */
+	char *bootconf_dev = MMCBLK_BOOTCONF;
+	if (timeout > 0) devscan_wait(&bootconf_dev, 1, timeout);
+
 	if (-1 == mount(MMCBLK_BOOTCONF, MOUNTPOINT, MMCBLK_BOOTCONF_FSTYPE, MS_RDONLY, NULL)) {
 		log_msg(lg, "+ can't mount bootconf device '%s': %s", MMCBLK_BOOTCONF, ERRMSG);
 		goto end_scan_devices;
@@ -437,7 +1010,19 @@ int scan_devices(struct params_t *params)
 		goto end_scan_devices;
 	}
 	
-	addto_bootcfg(bootconf, fl, &cfgdata);
+	/* Wait for devices mentioned in config sections for rest of time */
+	timeout -= (get_time_us() - start) / 1000;
+	if ( (cfgdata.count > 0) && (timeout > 0) ) {
+		char *devices[cfgdata.count];
+		int i;
+
+		for (i = 0; i < cfgdata.count; i++) {
+			devices[i] = (cfgdata.list[i] ? cfgdata.list[i]->device : NULL);
+		}
+		devscan_wait(devices, cfgdata.count, timeout);
+	}
+
+	addto_bootcfg(bootconf, &cfgdata);
 	destroy_cfgdata(&cfgdata);
 	
 end_scan_devices:
@@ -535,6 +1120,11 @@ int fill_menu(struct params_t *params)
 	gui = params->gui;
 #endif
 
+#ifdef USE_FBMENU
+	/* Items are changed. Their images should be rendered again */
+	gui_invalidate_menu(params->gui);
+#endif
+
 	bl = params->bootcfg;
 
 	if ( (NULL != bl) && (bl->fill > 0) ) b_items = bl->fill;
@@ -705,7 +1295,8 @@ int do_rescan(struct params_t *params)
 
 	free_bootcfg(params->bootcfg);
 	params->bootcfg = NULL;
-	scan_devices(params);
+	/* Devices had their time at startup. Don't wait for missing ones */
+	scan_devices(params, 0);
 
 	return fill_menu(params);
 }
@@ -791,15 +1382,25 @@ int process_ctx_menu(struct params_t *params, int action) {
 #endif
 #ifdef USE_TEXTUI
 		tui_show_msg(params->tui, "Rescanning devices.\nPlease wait...");
+#endif
+#ifdef USE_KEXEC_PRELOAD
+		/* Worker may use mountpoint and boot items are going away */
+		preload_drop(params);
 #endif
 		if (-1 == do_rescan(params)) {
 			log_msg(lg, "Rescan failed");
 			return -1;
 		}
 		menu = params->menu;
+#ifdef USE_KEXEC_PRELOAD
+		preload_default(params);
+#endif
 		break;
 
 	case A_DEBUG:
+#ifdef USE_ANIMATION
+		gui_log_frame_stats(params->gui);
+#endif
 		params->context = KX_CTX_TEXTVIEW;
 		break;
 
@@ -810,13 +1411,16 @@ int process_ctx_menu(struct params_t *params, int action) {
 		break;
 
 #ifdef USE_TIMEOUT
-	case A_TIMEOUT:		// timeout was reached - boot 1st kernel if exists
-		if (menu->current->count > 1) {
-			menu_item_select(menu, 0);	/* choose first item */
-			menu_item_select(menu, 1);	/* and switch to next item */
+	case A_TIMEOUT: {	// timeout was reached - boot default kernel if exists
+		int no = default_item_no(params);
+
+		if (no >= 0) {
+			menu->current = menu->top;
+			menu_item_select_by_no(menu, no);
 			rc = 0;
 		}
 		break;
+	}
 #endif
 
 	default:
@@ -891,10 +1495,29 @@ int do_main_loop(struct params_t *params, kx_inputs *inputs)
 	params->context = KX_CTX_MENU;
 	draw_ctx_menu(params);
 
+#ifdef USE_SPLASH
+	if (params->gui) {
+		log_msg(lg, "Menu shown after %llu us",
+				get_time_us() - params->start_time);
+		/* Saved when item is chosen */
+		params->splash = gui_pack_splash(params->gui, &params->splash_size);
+	}
+#endif
+
 	/* Event loop */
 	do {
+#ifdef USE_ANIMATION
+		/* Animate menu until input comes. Input ends animation at once */
+		while (gui_animate(params->gui) && !inputs_ready(inputs));
+		gui_stop_animation(params->gui);
+#endif
+
 		/* Read events */
-		action = inputs_process(inputs);
+#ifdef USE_KEXEC_PRELOAD
+		action = inputs_process(inputs, preload_wait_time(params));
+#else
+		action = inputs_process(inputs, -1);
+#endif
 		if (action != A_NONE) {
 
 			/* Process events in current context */
@@ -921,6 +1544,12 @@ int do_main_loop(struct params_t *params, kx_inputs *inputs)
 		else
 			rc = 1;
 
+#ifdef USE_KEXEC_PRELOAD
+		/* Preload selected item when worker is idle */
+		if ( (rc > 0) && (KX_CTX_MENU == params->context) )
+			preload_follow_menu(params);
+#endif
+
 	/* rc: 0 - select, <0 - raise error, >0 - continue */
 	} while (rc > 0);
 
@@ -940,6 +1569,10 @@ int main(int argc, char **argv)
 
 	lg = log_open(16);
 	log_msg(lg, "%s starting", PACKAGE_STRING);
+#ifdef USE_SPLASH
+	params.start_time = get_time_us();
+	params.splash = NULL;
+#endif
 
 	initmode = do_init();
 
@@ -960,19 +1593,27 @@ int main(int argc, char **argv)
 	machine_kernel = get_machine_kernelpath();	/* FIXME should be passed as arg to get_bootinfo() */
 #endif
 
-#ifdef USE_DELAY
-	/* extra delay for initializing slow SD/CF */
-	sleep(USE_DELAY);
-#endif
-
 	int no_ui = 1;	/* UI presence flag */
 #ifdef USE_FBMENU
 	params.gui = NULL;
 	if (no_ui) {
-		params.gui = gui_init(cfg.angle);
+#ifdef USE_SPLASH
+		int splash_size = 0;
+		char *splash = splash_load(&splash_size);
+
+		params.gui = gui_init(cfg.angle, splash, splash_size);
+		dispose(splash);
+#else
+		params.gui = gui_init(cfg.angle, NULL, 0);
+#endif
 		if (NULL == params.gui) {
 			log_msg(lg, "Can't initialize GUI");
 		} else no_ui = 0;
+#ifdef USE_SPLASH
+		if (params.gui)
+			log_msg(lg, "First frame shown after %llu us",
+					params.gui->first_frame - params.start_time);
+#endif
 	}
 #endif
 #ifdef USE_TEXTUI
@@ -994,12 +1635,22 @@ int main(int argc, char **argv)
 	
 	params.menu = build_menu(&params);
 	params.bootcfg = NULL;
-	scan_devices(&params);
+#ifdef USE_DELAY
+	scan_devices(&params, USE_DELAY * 1000);
+#else
+	scan_devices(&params, 0);
+#endif
 
 	if (-1 == fill_menu(&params)) {
 		exit(-1);
 	}
 
+#ifdef USE_KEXEC_PRELOAD
+	/* Start preparing default item while user looks at menu */
+	preload_init(&params);
+	preload_default(&params);
+#endif
+
 	/* Collect input devices */
 	inputs_init(&inputs, 8);
 	inputs_open(&inputs);
@@ -1028,7 +1679,12 @@ int main(int argc, char **argv)
 	lg = NULL;
 
 	/* rc < 0 indicate error */
-	if (rc < 0) exit(rc);
+	if (rc < 0) {
+#ifdef USE_KEXEC_PRELOAD
+		preload_drop(&params);
+#endif
+		exit(rc);
+	}
 
 	menu_destroy(params.menu, 0);
 
@@ -39,7 +39,7 @@ rgba2comp(kx_rgba rgba, kx_ccomp *red, kx_ccomp *green,
 
 kx_ccomp hchar2int(unsigned char c)
 {
-	static int r;
+	int r;
 
 	if (c >= '0' && c <= '9')
 		r = c - '0';
@@ -56,7 +56,7 @@ kx_ccomp hchar2int(unsigned char c)
 /* Convert hex rgb color to rgb color */
 kx_rgba hex2rgba(char *hex)
 {
-	static kx_ccomp r, g, b, a;
+	kx_ccomp r, g, b, a;
 	switch (strlen(hex)) {
 	case 3 + 1:		/* #abc */
 		r = hchar2int(hex[1]);
@@ -28,6 +28,7 @@
 #include <termios.h>
 #include <limits.h>		/* LONG_MAX, INT_MAX */
 #include <stdarg.h>		/* va_start/va_end */
+#include <time.h>		/* clock_gettime */
 
 #include "config.h"
 #include "util.h"
@@ -452,3 +453,15 @@ int find_attached_ubi_device(const char *mtd_id)
 	}
 	return res;
 }
+
+
+/* Return monotonic time in microseconds */
+unsigned long long get_time_us(void)
+{
+	struct timespec ts;
+
+	if (-1 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
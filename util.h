@@ -157,4 +157,7 @@ int ubi_attach(const char *mtd_id);
 /* Find UBI device attached to mtd_id */
 int find_attached_ubi_device(const char *mtd_id);
 
+/* Return monotonic time in microseconds (for timing measurements) */
+unsigned long long get_time_us(void);
+
 #endif //_HAVE_UTIL_H_
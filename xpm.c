@@ -382,9 +382,9 @@ int xpm_parse_colors(char **xpm_data, struct xpm_meta_t *xpm_meta)
 
 		/* Select color according to supplied bpp */
 		color = NULL;
-		if ( 1 == fb.bpp ) {		/* mono */
+		if ( 1 == fb_pixel_format()->bpp ) {		/* mono */
 			color = colors[XPM_KEY_MONO];
-		} else if ( 2 == fb.bpp) {	/* 4 grays */
+		} else if ( 2 == fb_pixel_format()->bpp) {	/* 4 grays */
 			color = colors[XPM_KEY_GRAY4];
 		}
 
@@ -563,6 +563,13 @@ kx_picture *xpm_parse_image(char **xpm_data, const int rows)
 	/* Store values */
 	xpm_parsed->width = width;
 	xpm_parsed->height = height;
+	xpm_parsed->pixels = NULL;
+	xpm_parsed->native = NULL;
+	xpm_parsed->runs = NULL;
+	xpm_parsed->run_count = 0;
+	xpm_parsed->blend_runs = NULL;
+	xpm_parsed->blend_count = 0;
+	xpm_parsed->opacity = NULL;
 
 	xpm_meta.ncolors = ncolors;
 	xpm_meta.chpp = chpp;